@@ -11,10 +11,12 @@
 #include <stdio.h>
 #include <cstdlib>
 #include "kaleidoscope.hpp"
+#include "engine.hpp"
 
 // Filled in main
 std::map<char, int> KBinopPrecedence;
 extern ExecutionEngine *TheExecutionEngine;
+extern EngineOptions TheOptions;
 
 // LEXER
 // from http://llvm.org/releases/2.8/docs/tutorial/LangImpl1.html
@@ -47,20 +49,34 @@ enum Token {
 std::string IdentifierStr; // if tok_identifier
 double NumVal; // if tok_number
 
+// Where the lexer reads from: stdin for the REPL, or a string
+// handed in through EvalSource
+static const char* LexSrc = 0;
+static int LastChar = ' ';
+// Where in LexSrc the current token starts
+static const char* TokStart = 0;
+
+static int ReadChar() {
+	if(LexSrc) {
+		return *LexSrc ? (unsigned char) *LexSrc++ : EOF;
+	}
+	return getchar();
+}
+
 // the actual lexer
 int gettok() {
-	static int LastChar = ' ';
-	
 	// skip whitespace
 	while(isspace(LastChar)) {
-		// Reads from stdin
-		LastChar = getchar();		
+		LastChar = ReadChar();
+	}
+	if(LexSrc) {
+		TokStart = LastChar == EOF ? LexSrc : LexSrc - 1;
 	}
 
 	// identifier [a-zA-Z][a-zA-Z0-9]*
 	if(isalpha(LastChar)) {
 		IdentifierStr = LastChar;
-		while(isalnum((LastChar = getchar()))) {
+		while(isalnum((LastChar = ReadChar()))) {
 			IdentifierStr += LastChar;
 		}
 
@@ -107,7 +123,7 @@ int gettok() {
 		std::string NumStr;
 		do {
 			NumStr += LastChar;
-			LastChar = getchar();
+			LastChar = ReadChar();
 		} while(isdigit(LastChar) || LastChar == '.');
 
 		NumVal = strtod(NumStr.c_str(), 0);
@@ -117,7 +133,7 @@ int gettok() {
 	// Comment until end of the line
 	if(LastChar == '#') {
 		do {
-			LastChar = getchar();
+			LastChar = ReadChar();
 		} while(LastChar != EOF && LastChar != '\n' && LastChar != '\r');
 
 		if(LastChar != EOF) {
@@ -130,7 +146,7 @@ int gettok() {
 	}
 
 	int ThisChar = LastChar;
-	LastChar = getchar();
+	LastChar = ReadChar();
 	return ThisChar;
 }
 
@@ -138,18 +154,53 @@ int gettok() {
 // all functions should assume that the token that 
 // needs to be parsed is CurTok
 static int CurTok;
+// A token given back by PushBackIdentifier, returned again before the
+// lexer goes on
+static bool HavePushedTok = false;
+static int PushedTok;
+static std::string PushedIdentifier;
+static double PushedNum;
+
 int getNextToken() {
+	if(HavePushedTok) {
+		HavePushedTok = false;
+		IdentifierStr = PushedIdentifier;
+		NumVal = PushedNum;
+		return CurTok = PushedTok;
+	}
+	PhaseTimer T(PH_Lex);
 	return CurTok = gettok();
 }
 
+// Makes the identifier Name, already eaten, the current token again.
+// Lets the parser look past a word that is only a keyword before some
+// tokens, and take it as a name when it isn't.
+static void PushBackIdentifier(const std::string &Name) {
+	HavePushedTok = true;
+	PushedTok = CurTok;
+	PushedIdentifier = IdentifierStr;
+	PushedNum = NumVal;
+	CurTok = tok_identifier;
+	IdentifierStr = Name;
+}
+
 // AST
 // from http://llvm.org/releases/2.8/docs/tutorial/LangImpl2.html
 
 // Error routines
 // This is not the most sofisticated error handling one can have,
 // but its useful enough
+static unsigned NumErrors = 0;
+// Set by CompileSource: errors go there instead of stderr
+static std::string* ErrorLog = 0;
+
 ExprAST* Error(const char* Str) {
-	fprintf(stderr, "Error: %s\n", Str);
+	if(ErrorLog) {
+		*ErrorLog += std::string("Error: ") + Str + "\n";
+	} else {
+		fprintf(stderr, "Error: %s\n", Str);
+	}
+	++NumErrors;
 	return 0;
 }
 
@@ -168,6 +219,245 @@ ForExprAST* ErrorFor(const char* Str) {
 	return 0;
 }
 
+// AST memory usage, for the memory report. Counts the nodes and
+// the buffers they own; allocator overhead is left out.
+
+static size_t StringBytes(const std::string &S) {
+	return S.capacity() + 1;
+}
+
+size_t NumberExprAST::MemoryUsage() const {
+	return sizeof(*this);
+}
+
+size_t VariableExprAST::MemoryUsage() const {
+	return sizeof(*this) + StringBytes(Name);
+}
+
+size_t BinaryExprAST::MemoryUsage() const {
+	return sizeof(*this) + LHS->MemoryUsage() + RHS->MemoryUsage();
+}
+
+size_t UnaryExprAST::MemoryUsage() const {
+	return sizeof(*this) + Operand->MemoryUsage();
+}
+
+size_t IndexExprAST::MemoryUsage() const {
+	return sizeof(*this) + StringBytes(Name) + Index->MemoryUsage();
+}
+
+size_t CallExprAST::MemoryUsage() const {
+	size_t Bytes = sizeof(*this) + StringBytes(Callee) +
+		Args.capacity() * sizeof(ExprAST*);
+	for(unsigned i = 0, e = Args.size(); i != e; ++i) {
+		Bytes += Args[i]->MemoryUsage();
+	}
+	return Bytes;
+}
+
+size_t IfExprAST::MemoryUsage() const {
+	return sizeof(*this) + Cond->MemoryUsage() + Then->MemoryUsage() +
+		Else->MemoryUsage();
+}
+
+size_t ForExprAST::MemoryUsage() const {
+	size_t Bytes = sizeof(*this) + StringBytes(VarName) + Start->MemoryUsage() +
+		End->MemoryUsage() + Body->MemoryUsage();
+	if(Step) {
+		Bytes += Step->MemoryUsage();
+	}
+	return Bytes;
+}
+
+size_t ReduceExprAST::MemoryUsage() const {
+	size_t Bytes = sizeof(*this) + StringBytes(VarName) + Start->MemoryUsage() +
+		End->MemoryUsage() + Body->MemoryUsage();
+	if(Step) {
+		Bytes += Step->MemoryUsage();
+	}
+	return Bytes;
+}
+
+size_t VarExprAST::MemoryUsage() const {
+	size_t Bytes = sizeof(*this) + Body->MemoryUsage() +
+		VarNames.capacity() * sizeof(VarNames[0]) +
+		VarTypes.capacity() * sizeof(ValueType);
+	for(unsigned i = 0, e = VarNames.size(); i != e; ++i) {
+		Bytes += StringBytes(VarNames[i].first);
+		if(VarNames[i].second) {
+			Bytes += VarNames[i].second->MemoryUsage();
+		}
+	}
+	return Bytes;
+}
+
+size_t PrototypeAST::MemoryUsage() const {
+	size_t Bytes = sizeof(*this) + StringBytes(Name) +
+		Args.capacity() * sizeof(std::string) +
+		ArgTypes.capacity() * sizeof(ValueType);
+	for(unsigned i = 0, e = Args.size(); i != e; ++i) {
+		Bytes += StringBytes(Args[i]);
+	}
+	return Bytes;
+}
+
+size_t FunctionAST::MemoryUsage() const {
+	return sizeof(*this) + Proto->MemoryUsage() + Body->MemoryUsage();
+}
+
+void NumberExprAST::CollectCallees(std::vector<std::string> &Callees) const {
+}
+
+void VariableExprAST::CollectCallees(std::vector<std::string> &Callees) const {
+}
+
+void BinaryExprAST::CollectCallees(std::vector<std::string> &Callees) const {
+	// Everything but the builtin operators is a call
+	if(Op != '=' && Op != '<' && Op != '+' && Op != '-' && Op != '*') {
+		Callees.push_back(std::string("binary") + Op);
+	}
+	LHS->CollectCallees(Callees);
+	RHS->CollectCallees(Callees);
+}
+
+void IndexExprAST::CollectCallees(std::vector<std::string> &Callees) const {
+	Index->CollectCallees(Callees);
+}
+
+void UnaryExprAST::CollectCallees(std::vector<std::string> &Callees) const {
+	Callees.push_back(std::string("unary") + Opcode);
+	Operand->CollectCallees(Callees);
+}
+
+void CallExprAST::CollectCallees(std::vector<std::string> &Callees) const {
+	Callees.push_back(Callee);
+	for(unsigned i = 0, e = Args.size(); i != e; ++i) {
+		Args[i]->CollectCallees(Callees);
+	}
+}
+
+void IfExprAST::CollectCallees(std::vector<std::string> &Callees) const {
+	Cond->CollectCallees(Callees);
+	Then->CollectCallees(Callees);
+	Else->CollectCallees(Callees);
+}
+
+void ForExprAST::CollectCallees(std::vector<std::string> &Callees) const {
+	Start->CollectCallees(Callees);
+	End->CollectCallees(Callees);
+	if(Step) {
+		Step->CollectCallees(Callees);
+	}
+	Body->CollectCallees(Callees);
+}
+
+void ReduceExprAST::CollectCallees(std::vector<std::string> &Callees) const {
+	Start->CollectCallees(Callees);
+	End->CollectCallees(Callees);
+	if(Step) {
+		Step->CollectCallees(Callees);
+	}
+	Body->CollectCallees(Callees);
+}
+
+void VarExprAST::CollectCallees(std::vector<std::string> &Callees) const {
+	for(unsigned i = 0, e = VarNames.size(); i != e; ++i) {
+		if(VarNames[i].second) {
+			VarNames[i].second->CollectCallees(Callees);
+		}
+	}
+	Body->CollectCallees(Callees);
+}
+
+void FunctionAST::CollectCallees(std::vector<std::string> &Callees) const {
+	Body->CollectCallees(Callees);
+}
+
+void NumberExprAST::CollectFreeVariables(FreeVariables &FV) const {
+}
+
+void VariableExprAST::CollectFreeVariables(FreeVariables &FV) const {
+	if(!FV.IsBound(Name)) {
+		FV.Read.insert(Name);
+	}
+}
+
+// Storing into an element reads the variable too: it's only assigned
+// when it's a vector, which isn't known before codegen
+void BinaryExprAST::CollectFreeVariables(FreeVariables &FV) const {
+	IndexExprAST* LHSI = dynamic_cast<IndexExprAST*>(LHS);
+	if(Op == '=' && LHSI && !FV.IsBound(LHSI->getName())) {
+		FV.Stored.insert(LHSI->getName());
+	}
+	if(Op == '=' && !LHSI) {
+		VariableExprAST* LHSE = dynamic_cast<VariableExprAST*>(LHS);
+		if(LHSE && !FV.IsBound(LHSE->getName())) {
+			FV.Assigned.insert(LHSE->getName());
+		}
+	} else {
+		LHS->CollectFreeVariables(FV);
+	}
+	RHS->CollectFreeVariables(FV);
+}
+
+void IndexExprAST::CollectFreeVariables(FreeVariables &FV) const {
+	if(!FV.IsBound(Name)) {
+		FV.Read.insert(Name);
+	}
+	Index->CollectFreeVariables(FV);
+}
+
+void UnaryExprAST::CollectFreeVariables(FreeVariables &FV) const {
+	Operand->CollectFreeVariables(FV);
+}
+
+void CallExprAST::CollectFreeVariables(FreeVariables &FV) const {
+	for(unsigned i = 0, e = Args.size(); i != e; ++i) {
+		Args[i]->CollectFreeVariables(FV);
+	}
+}
+
+void IfExprAST::CollectFreeVariables(FreeVariables &FV) const {
+	Cond->CollectFreeVariables(FV);
+	Then->CollectFreeVariables(FV);
+	Else->CollectFreeVariables(FV);
+}
+
+void ForExprAST::CollectFreeVariables(FreeVariables &FV) const {
+	Start->CollectFreeVariables(FV);
+	FV.Bound.push_back(VarName);
+	End->CollectFreeVariables(FV);
+	if(Step) {
+		Step->CollectFreeVariables(FV);
+	}
+	Body->CollectFreeVariables(FV);
+	FV.Bound.pop_back();
+}
+
+// Only the body sees the variable
+void ReduceExprAST::CollectFreeVariables(FreeVariables &FV) const {
+	Start->CollectFreeVariables(FV);
+	End->CollectFreeVariables(FV);
+	if(Step) {
+		Step->CollectFreeVariables(FV);
+	}
+	FV.Bound.push_back(VarName);
+	Body->CollectFreeVariables(FV);
+	FV.Bound.pop_back();
+}
+
+// Each initializer already sees the variables before it
+void VarExprAST::CollectFreeVariables(FreeVariables &FV) const {
+	for(unsigned i = 0, e = VarNames.size(); i != e; ++i) {
+		if(VarNames[i].second) {
+			VarNames[i].second->CollectFreeVariables(FV);
+		}
+		FV.Bound.push_back(VarNames[i].first);
+	}
+	Body->CollectFreeVariables(FV);
+	FV.Bound.resize(FV.Bound.size() - VarNames.size());
+}
+
 static ExprAST* ParseNumberExpr() {
 	ExprAST* Result = new NumberExprAST(NumVal);
 	// Consume number
@@ -186,10 +476,21 @@ static ExprAST* ParseParenExpr() {
 	return V;
 }
 
+// ':' type, with CurTok on the ':'
+static bool ParseTypeAnnotation(ValueType &Ty) {
+	if(getNextToken() != tok_identifier || !ParseTypeName(IdentifierStr, Ty)) {
+		Error("Expected a type after ':'");
+		return false;
+	}
+	getNextToken(); // eat type
+	return true;
+}
+
 static ExprAST *ParseVarExpr() {
   getNextToken();  // eat the var.
 
 	std::vector<std::pair<std::string, ExprAST*> > VarNames;
+	std::vector<ValueType> VarTypes;
 
   // At least one variable name is required.
   if (CurTok != tok_identifier)
@@ -199,6 +500,14 @@ static ExprAST *ParseVarExpr() {
 		std::string Name = IdentifierStr;
     getNextToken();  // eat identifier.
 
+		// Optional type
+		ValueType Ty = VT_Inferred;
+		if(CurTok == ':') {
+			if(!ParseTypeAnnotation(Ty)) return 0;
+			if(Ty == VT_Buffer) return Error("variables can't be buffers");
+		}
+		VarTypes.push_back(Ty);
+
     // Read the optional initializer.
     ExprAST *Init = 0;
     if (CurTok == '=') {
@@ -226,7 +535,49 @@ static ExprAST *ParseVarExpr() {
   ExprAST *Body = ParseExpression();
   if (Body == 0) return 0;
   
-  return new VarExprAST(VarNames, Body);
+  return new VarExprAST(VarNames, Body, VarTypes);
+}
+
+// reduceexpr ::= ('sum' | 'min' | 'max') identifier '=' expr ',' expr
+//                (',' expr)? 'in' expression
+// The kind was eaten already. The words are only special when an
+// identifier follows, so functions and variables can still be called
+// min or max.
+static ExprAST* ParseReduceExpr(ReduceExprAST::Kind K) {
+	std::string IdName = IdentifierStr;
+	getNextToken(); // eat identifier
+
+	if(CurTok != '=') {
+		return Error("expected '=' after reduction variable");
+	}
+	getNextToken();
+
+	ExprAST* Start = ParseExpression();
+	if(!Start) return 0;
+	if(CurTok != ',') {
+		return Error("expected ',' after reduction start value");
+	}
+	getNextToken();
+
+	ExprAST* End = ParseExpression();
+	if(!End) return 0;
+
+	ExprAST* Step = 0;
+	if(CurTok == ',') {
+		getNextToken();
+		Step = ParseExpression();
+		if(!Step) return 0;
+	}
+
+	if(CurTok != tok_in) {
+		return Error("expected 'in' after reduction range");
+	}
+	getNextToken();
+
+	ExprAST* Body = ParseExpression();
+	if(!Body) return 0;
+
+	return new ReduceExprAST(K, IdName, Start, End, Step, Body);
 }
 
 static ExprAST *ParseIdentifierExpr() {
@@ -234,6 +585,30 @@ static ExprAST *ParseIdentifierExpr() {
 	
 	getNextToken(); // eat identifier
 
+	// parallelforexpr ::= 'parallel' forexpr
+	// 'parallel' is only a keyword before 'for'
+	if(CurTok == tok_for && IdName == "parallel") {
+		return ParseForExpr(true);
+	}
+
+	if(CurTok == tok_identifier) {
+		if(IdName == "sum") return ParseReduceExpr(ReduceExprAST::Sum);
+		if(IdName == "min") return ParseReduceExpr(ReduceExprAST::Min);
+		if(IdName == "max") return ParseReduceExpr(ReduceExprAST::Max);
+	}
+
+	// element of a buffer
+	if(CurTok == '[') {
+		getNextToken(); // eat [
+		ExprAST* Index = ParseExpression();
+		if(!Index) return 0;
+		if(CurTok != ']') {
+			return Error("Expected ']' after index");
+		}
+		getNextToken(); // eat ]
+		return new IndexExprAST(IdName, Index);
+	}
+
 	if(CurTok != '(') { // simple var ref
 		return new VariableExprAST(IdName);
 	}
@@ -287,7 +662,7 @@ static ExprAST* ParseIfExpr() {
 	return new IfExprAST(Cond, Then, Else);
 }
 
-static ForExprAST* ParseForExpr() {
+static ForExprAST* ParseForExpr(bool Parallel) {
 	getNextToken();  // eat the for.
 
   if (CurTok != tok_identifier)
@@ -295,6 +670,15 @@ static ForExprAST* ParseForExpr() {
   
 	std::string IdName = IdentifierStr;
   getNextToken();  // eat identifier.
+
+	// Optional type: counting in ints
+	ValueType VarType = VT_Double;
+	if(CurTok == ':') {
+		if(!ParseTypeAnnotation(VarType)) return 0;
+		if(VarType != VT_Double && (VarType != VT_Int || Parallel))
+			return ErrorFor(Parallel ? "parallel for counts in doubles"
+											: "for counts in doubles or ints");
+	}
   
   if (CurTok != '=')
     return ErrorFor("expected '=' after for");
@@ -325,7 +709,7 @@ static ForExprAST* ParseForExpr() {
   ExprAST *Body = ParseExpression();
   if (Body == 0) return 0;
 
-  return new ForExprAST(IdName, Start, End, Step, Body);
+  return new ForExprAST(IdName, Start, End, Step, Body, Parallel, VarType);
 }
 
 static ExprAST* ParsePrimary() {
@@ -346,12 +730,13 @@ static int GetTokPrecedence() {
 		return -1;
 	}
 
-	int TokPrec = KBinopPrecedence[CurTok];
-	if(TokPrec <= 0) {
+	// find, so looking at ')' or ';' doesn't add them to the table
+	std::map<char, int>::const_iterator I = KBinopPrecedence.find(CurTok);
+	if(I == KBinopPrecedence.end() || I->second <= 0) {
 		return -1;
 	}
 
-	return TokPrec;
+	return I->second;
 }
 
 static ExprAST* ParseExpression() {
@@ -390,6 +775,23 @@ static ExprAST* ParseBinOpRHS(int ExprPrec, ExprAST *LHS) {
 
 // Parsing the Rest
 
+bool ParseTypeName(const std::string &Name, ValueType &Ty) {
+	if(Name == "double") {
+		Ty = VT_Double;
+	} else if(Name == "buffer") {
+		Ty = VT_Buffer;
+	} else if(Name == "vec4") {
+		Ty = VT_Vec4;
+	} else if(Name == "vec8") {
+		Ty = VT_Vec8;
+	} else if(Name == "int") {
+		Ty = VT_Int;
+	} else {
+		return false;
+	}
+	return true;
+}
+
 static PrototypeAST* ParsePrototype() {
 	/*
 	 * id '(' id* ')'
@@ -449,9 +851,17 @@ static PrototypeAST* ParsePrototype() {
 		return ErrorP("Expected '(' in prototype");
 	}
 	
+	// Arguments are numbers unless annotated: "b : buffer"
 	std::vector<std::string> ArgNames;
-	while(getNextToken() == tok_identifier) {
+	std::vector<ValueType> ArgTypes;
+	getNextToken(); // eat (
+	while(CurTok == tok_identifier) {
 		ArgNames.push_back(IdentifierStr);
+		ValueType Ty = VT_Double;
+		if(getNextToken() == ':' && !ParseTypeAnnotation(Ty)) {
+			return 0;
+		}
+		ArgTypes.push_back(Ty);
 	}
 	if(CurTok != ')') {
 		return ErrorP("Expected ')' in prototype");
@@ -461,12 +871,26 @@ static PrototypeAST* ParsePrototype() {
 	// eat ')'
 	getNextToken();
 
+	// Result type: "def f(x) : int ..."
+	ValueType RetType = VT_Double;
+	if(CurTok == ':') {
+		if(!ParseTypeAnnotation(RetType)) return 0;
+		if(RetType != VT_Double && RetType != VT_Int) {
+			return ErrorP("functions return doubles or ints");
+		}
+	}
+
 	// Verify right nbr of names for operator
 	if(Kind && ArgNames.size() != Kind) {
 		return ErrorP("Invalid number of operands for operator");
 	}
+	if(Kind && (std::count(ArgTypes.begin(), ArgTypes.end(), VT_Double) != Kind ||
+							RetType != VT_Double)) {
+		return ErrorP("Operators take and return doubles only");
+	}
 
-	return new PrototypeAST(FnName, ArgNames, Kind != 0, BinaryPrecedence);
+	return new PrototypeAST(FnName, ArgNames, Kind != 0, BinaryPrecedence, ArgTypes,
+													RetType);
 }
 
 static ExprAST* ParseUnary() {
@@ -485,14 +909,15 @@ static ExprAST* ParseUnary() {
 	return 0;
 }
 
-// definition ::= 'def' prototype expression
-static FunctionAST* ParseDefinition() {
-	getNextToken();
+// definition ::= ('fast' | 'memo')* 'def' prototype expression
+// Called on 'def', the modifiers before it already eaten
+static FunctionAST* ParseDefinition(bool FastMath, bool Memo) {
+	getNextToken(); // eat def
 	PrototypeAST* Proto = ParsePrototype();
 	if(Proto == 0) return 0;
 
 	if(ExprAST* E = ParseExpression()) {
-		return new FunctionAST(Proto, E);
+		return new FunctionAST(Proto, E, FastMath, Memo);
 	}
 
 	return 0;
@@ -506,9 +931,15 @@ static PrototypeAST* ParseExtern() {
 
 // toplevelexpr ::= expression
 static FunctionAST* ParseTopLevelExpr() {
+	// Numbered in order, so the same script gives the same names, e.g.
+	// in profiles. The '.' keeps them apart from user identifiers.
+	static unsigned AnonCount = 0;
+
 	if(ExprAST* E = ParseExpression()) {
-		PrototypeAST* Proto = new PrototypeAST("", std::vector<std::string>());
-		return new FunctionAST(Proto, E);
+		char Name[32];
+		snprintf(Name, sizeof(Name), "__anon_expr.%u", ++AnonCount);
+		PrototypeAST* Proto = new PrototypeAST(Name, std::vector<std::string>());
+		return new FunctionAST(Proto, E, false, false, true);
 	}
 	return 0;
 }
@@ -516,73 +947,247 @@ static FunctionAST* ParseTopLevelExpr() {
 // TOP LEVEL PARSING
 
 // These were copy-pasted. meh.
-static void HandleDefinition() {
-  if (FunctionAST* F = ParseDefinition()) {
-		if(Function* LF = F->Codegen()) {
-			fprintf(stderr, "Parsed a function definition.\n");
-			LF->dump();
+// Start is where its text begins, at the first modifier
+static void HandleDefinition(const char* Start, bool FastMath, bool Memo) {
+	FunctionAST* F;
+	{
+		PhaseTimer T(PH_Parse);
+		F = ParseDefinition(FastMath, Memo);
+	}
+
+  if (F) {
+		std::string Text;
+		if(Start) {
+			Text.assign(Start, TokStart);
+			Text.erase(Text.find_last_not_of(" \t\r\n") + 1);
+		}
+		// A daemon client may have sent this one before
+		if(!EnterDefinition(F, Text)) {
+			StatsEndItem("def", F->getName());
+			return;
+		}
+		Function* LF = F->Codegen();
+		LeaveDefinition(F, LF != 0);
+		if(LF) {
+			if(TheOptions.Verbosity >= 1) {
+				fprintf(stderr, "Parsed a function definition.\n");
+			}
+			if(TheOptions.Verbosity >= 2) {
+				LF->dump();
+			}
+			StatsEndItem("def", LF->getNameStr());
+			return;
 		}
   } else {
     // Skip token for error recovery.
     getNextToken();
   }
+	StatsEndItem("def", "");
 }
 
 static void HandleExtern() {
-  if (PrototypeAST* P = ParseExtern()) {
-		if(Function* F = P->Codegen()) {
-			fprintf(stderr, "Parsed an extern\n");
-			F->dump();
+	PrototypeAST* P;
+	{
+		PhaseTimer T(PH_Parse);
+		P = ParseExtern();
+	}
+
+  if (P) {
+		Function* F;
+		{
+			PhaseTimer T(PH_IRGen);
+			F = P->Codegen();
+		}
+		if(F) {
+			if(TheOptions.Verbosity >= 1) {
+				fprintf(stderr, "Parsed an extern\n");
+			}
+			if(TheOptions.Verbosity >= 2) {
+				F->dump();
+			}
+			StatsEndItem("extern", F->getNameStr());
+			return;
 		}
   } else {
     // Skip token for error recovery.
     getNextToken();
   }
+	StatsEndItem("extern", "");
 }
 
+// Set by CompileSource
+static std::vector<Function*>* DeferredExprs = 0;
+
 static void HandleTopLevelExpression() {
   // Evaluate a top-level expression into an anonymous function.
-  if (FunctionAST* F = ParseTopLevelExpr()) {
-		//fprintf(stderr, "Parsed a top-level expr\n");
+	FunctionAST* F;
+	{
+		PhaseTimer T(PH_Parse);
+		F = ParseTopLevelExpr();
+	}
 
+  if (F) {
 		if(Function* LF = F->Codegen()) {
-			fprintf(stderr, "Have code gen\n");
+			if(TheOptions.Verbosity >= 1) {
+				fprintf(stderr, "Have code gen\n");
+			}
+			if(TheOptions.Verbosity >= 2) {
+				LF->dump();
+			}
+
+			// CompileSource leaves running it to the caller
+			if(DeferredExprs) {
+				DeferredExprs->push_back(LF);
+				StatsEndItem("expr", LF->getNameStr());
+				return;
+			}
 
-			LF->dump();
-			
 			// JIT the function, return function pointer
-			void *FPtr = TheExecutionEngine->getPointerToFunction(LF);
-			//fprintf(stderr, "FPtr is %p\n", FPtr);
+			void *FPtr;
+			{
+				PhaseTimer T(PH_Emit);
+				FPtr = TheExecutionEngine->getPointerToFunction(LF);
+			}
 
 			// Cast to right type, so we can call it
 			double (*FP)() = (double(*)()) (intptr_t) FPtr;
-			fprintf(stderr, "Evaluated to %f\n", FP());
+			double Result;
+			{
+				PhaseTimer T(PH_Exec);
+				Result = FP();
+				// Whatever the expression printed goes out before the result
+				FlushOutput();
+			}
+			fprintf(stderr, "Evaluated to %f\n", Result);
+			StatsEndItem("expr", LF->getNameStr());
+			return;
 		}
   } else {
     // Skip token for error recovery.
     getNextToken();
   }
+	StatsEndItem("expr", "");
+}
+
+// command ::= '@' identifier identifier* ';'
+// Asks the engine about itself, e.g. "@memory fib;" or "@pure;"
+static void HandleCommand() {
+	getNextToken(); // eat @
+	if(CurTok != tok_identifier) {
+		Error("expected command name after '@'");
+		return;
+	}
+	std::string Command = IdentifierStr;
+	getNextToken();
+
+	std::vector<std::string> Args;
+	while(CurTok == tok_identifier) {
+		Args.push_back(IdentifierStr);
+		getNextToken();
+	}
+	if(CurTok != ';') {
+		Error("expected ';' after command");
+		return;
+	}
+	getNextToken(); // eat ;
+
+	if(Command == "memory" && Args.size() <= 1) {
+		PrintMemoryReport(Args.empty() ? "" : ResolveFunctionName(Args[0]));
+	} else if(Command == "pure" && Args.empty()) {
+		PrintPurityReport();
+	} else if(Command == "memo" && Args.empty()) {
+		PrintMemoReport();
+	} else if(Command == "spec" && Args.empty()) {
+		PrintSpecializationReport();
+	} else if(Command == "dedup" && Args.empty()) {
+		PrintDedupReport();
+	} else {
+		Error("unknown command, or wrong arguments");
+	}
 }
 
-extern "C" double printd(double x) {
-	printf("%f", x);
-	return 0.0;
+static bool IsDefinitionModifier() {
+	return CurTok == tok_identifier && (IdentifierStr == "fast" || IdentifierStr == "memo");
+}
+
+// 'fast' and 'memo' are only keywords before 'def' (or each other), so
+// they still work as names: as the only word before anything else, one
+// starts an expression
+static void HandleModifiers() {
+	const char* Start = LexSrc ? TokStart : 0;
+	std::string First = IdentifierStr;
+	bool FastMath = false;
+	bool Memo = false;
+	unsigned Count = 0;
+	while(IsDefinitionModifier()) {
+		(IdentifierStr == "memo" ? Memo : FastMath) = true;
+		++Count;
+		getNextToken(); // eat fast or memo
+	}
+
+	if(CurTok == tok_def) {
+		HandleDefinition(Start, FastMath, Memo);
+	} else if(Count == 1) {
+		PushBackIdentifier(First);
+		HandleTopLevelExpression();
+	} else {
+		Error("expected 'def' after 'fast' or 'memo'");
+		// Skip token for error recovery.
+		getNextToken();
+		StatsEndItem("def", "");
+	}
 }
 
-extern "C" double putchard(double X) {
-	putchar((char) X);
-	return 0.0;
+// Handle whatever starts at CurTok; shared by the REPL and EvalSource
+static void HandleTopLevelItem() {
+	if(IsDefinitionModifier()) {
+		HandleModifiers();
+		return;
+	}
+	switch(CurTok) {
+	case ';': getNextToken(); break;
+	case '@': HandleCommand(); break;
+	case tok_def: HandleDefinition(LexSrc ? TokStart : 0, false, false); break;
+	case tok_extern: HandleExtern(); break;
+	default: HandleTopLevelExpression(); break;
+	}
 }
 
 void MainLoop() {
 	while(1) {
 		fprintf(stderr, "ready> ");
-		switch(CurTok) {
-		case tok_eof: return;
-		case ';': getNextToken(); break;
-		case tok_def: HandleDefinition(); break;
-		case tok_extern: HandleExtern(); break;
-		default: HandleTopLevelExpression(); break;
-		}
+		if(CurTok == tok_eof) return;
+		HandleTopLevelItem();
+	}
+}
+
+// Same as typing Src at the prompt. The lexer state is saved and
+// restored, so this can be called from host code at any time.
+bool EvalSource(const std::string &Src) {
+	const char* OldSrc = LexSrc;
+	int OldChar = LastChar;
+	int OldTok = CurTok;
+	unsigned OldErrors = NumErrors;
+
+	LexSrc = Src.c_str();
+	LastChar = ' ';
+	getNextToken();
+	while(CurTok != tok_eof) {
+		HandleTopLevelItem();
 	}
+
+	LexSrc = OldSrc;
+	LastChar = OldChar;
+	CurTok = OldTok;
+	return NumErrors == OldErrors;
+}
+
+bool CompileSource(const std::string &Src, std::vector<Function*> &Exprs,
+									 std::string &Errors) {
+	DeferredExprs = &Exprs;
+	ErrorLog = &Errors;
+	bool Ok = EvalSource(Src);
+	DeferredExprs = 0;
+	ErrorLog = 0;
+	return Ok;
 }
@@ -0,0 +1,57 @@
+// Rows per second of a kaleidoscope function evaluated over columns:
+// one call through the function pointer per row, against the generated
+// map kernel looping inside JITed code.
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include "../engine.hpp"
+#include "timer.hpp"
+
+int main(int argc, char** argv) {
+	uint64_t N = argc > 1 ? strtoull(argv[1], 0, 10) : 10000000;
+
+	if(!InitializeEngine()) {
+		return 1;
+	}
+	if(!EvalSource("def score(a b c) a*b + (c - a)*0.5 + b*c*c;")) {
+		return 1;
+	}
+
+	std::vector<double> A(N), B(N), C(N), Out(N);
+	for(uint64_t i = 0; i < N; ++i) {
+		A[i] = i * 0.25;
+		B[i] = 1.0 / (i + 1);
+		C[i] = (double) (i % 17);
+	}
+
+	double (*Row)(double, double, double) =
+		(double(*)(double, double, double)) (intptr_t) GetFunctionPointer("score");
+	MapKernelFn Map = GetMapKernel("score");
+	if(!Row || !Map) {
+		fprintf(stderr, "could not compile score\n");
+		return 1;
+	}
+
+	double Start = Now();
+	for(uint64_t i = 0; i < N; ++i) {
+		Out[i] = Row(A[i], B[i], C[i]);
+	}
+	double PerRow = Now() - Start;
+	double Check = Out[N - 1];
+
+	const double* Cols[] = { &A[0], &B[0], &C[0] };
+	Start = Now();
+	Map(Cols, &Out[0], N);
+	double Batch = Now() - Start;
+
+	if(Out[N - 1] != Check) {
+		fprintf(stderr, "results differ: %f vs %f\n", Out[N - 1], Check);
+		return 1;
+	}
+
+	printf("per-row: %.1f Mrows/s\n", N / PerRow / 1e6);
+	printf("map:     %.1f Mrows/s\n", N / Batch / 1e6);
+
+	ShutdownEngine();
+	return 0;
+}
@@ -0,0 +1,61 @@
+// A data-dependent if, over sorted and over random input. With branches
+// the random case pays for mispredictions; as a select both cost the same.
+//   bench/branch                     (selects)
+//   bench/branch -no-branchless-if   (branches)
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+#include "../engine.hpp"
+#include "timer.hpp"
+
+static void Time(const char* Name, MapKernelFn Map, const std::vector<double> &X,
+								 std::vector<double> &Out) {
+	const double* Cols[] = { &X[0] };
+	uint64_t N = X.size();
+	Map(Cols, &Out[0], N); // warm up
+	double Start = Now();
+	for(unsigned r = 0; r < 10; ++r) {
+		Map(Cols, &Out[0], N);
+	}
+	double T = Now() - Start;
+	printf("%-7s %8.1f Mrows/s\n", Name, 10 * N / T / 1e6);
+}
+
+int main(int argc, char** argv) {
+	EngineOptions Opts;
+	uint64_t N = 10000000;
+	for(int i = 1; i < argc; ++i) {
+		if(!strcmp(argv[i], "-no-branchless-if")) {
+			Opts.BranchlessIf = false;
+		} else {
+			N = strtoull(argv[i], 0, 10);
+		}
+	}
+
+	if(!InitializeEngine(Opts)) {
+		return 1;
+	}
+	if(!EvalSource("def score(x) if x < 0.5 then x*3 + 1 else x*0.5 - 2;")) {
+		return 1;
+	}
+	MapKernelFn Map = GetMapKernel("score");
+	if(!Map) {
+		fprintf(stderr, "could not compile score\n");
+		return 1;
+	}
+
+	std::vector<double> X(N), Out(N);
+	srand(1);
+	for(uint64_t i = 0; i < N; ++i) {
+		X[i] = rand() / (RAND_MAX + 1.0);
+	}
+	printf("%s\n", Opts.BranchlessIf ? "select" : "branch");
+	Time("random", Map, X, Out);
+	std::sort(X.begin(), X.end());
+	Time("sorted", Map, X, Out);
+
+	ShutdownEngine();
+	return 0;
+}
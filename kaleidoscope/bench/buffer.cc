@@ -0,0 +1,74 @@
+// Reading and writing an array through a buffer argument, against an
+// extern call per element
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include "../engine.hpp"
+#include "timer.hpp"
+
+static std::vector<double> Data;
+
+extern "C" double elem(double I) {
+	return Data[(size_t) I];
+}
+
+extern "C" double setelem(double I, double X) {
+	Data[(size_t) I] = X;
+	return 0.0;
+}
+
+int main(int argc, char** argv) {
+	size_t N = argc > 1 ? atol(argv[1]) : 10000000;
+	Data.resize(N);
+	for(size_t i = 0; i < N; ++i) {
+		Data[i] = i % 7;
+	}
+
+	if(!InitializeEngine()) {
+		return 1;
+	}
+	RegisterHostFunction("elem", (void*) elem, 1, HF_NoUnwind);
+	RegisterHostFunction("setelem", (void*) setelem, 2, HF_NoUnwind);
+
+	bool Ok = EvalSource(
+		"def binary : 1 (x y) y;"
+		"extern elem(i);"
+		"extern setelem(i x);"
+		"def bufsum(b : buffer) sum i = 0, len(b) in b[i];"
+		"def callsum(n) sum i = 0, n in elem(i);"
+		"def bufscale(b : buffer k) for i = 0, i < len(b) - 1 in b[i] = b[i] * k;"
+		"def callscale(n k) for i = 0, i < n - 1 in setelem(i, elem(i) * k);");
+	if(!Ok) {
+		return 1;
+	}
+
+	DoubleBuffer B = { &Data[0], N };
+	double (*BufSum)(DoubleBuffer*) = (double(*)(DoubleBuffer*)) GetFunction("bufsum");
+	double (*CallSum)(double) = (double(*)(double)) GetFunction("callsum");
+	double (*BufScale)(DoubleBuffer*, double) =
+		(double(*)(DoubleBuffer*, double)) GetFunction("bufscale");
+	double (*CallScale)(double, double) = (double(*)(double, double)) GetFunction("callscale");
+
+	double Start = Now();
+	double R = CallSum(N);
+	double Call = Now() - Start;
+	printf("%-10s %8.1f Melem/s  (result %f)\n", "callsum", N / Call / 1e6, R);
+	Start = Now();
+	R = BufSum(&B);
+	double Buf = Now() - Start;
+	printf("%-10s %8.1f Melem/s  (result %f)\n", "bufsum", N / Buf / 1e6, R);
+	printf("read speedup %5.2fx\n", Call / Buf);
+
+	Start = Now();
+	CallScale(N, 1.0);
+	Call = Now() - Start;
+	printf("%-10s %8.1f Melem/s\n", "callscale", N / Call / 1e6);
+	Start = Now();
+	BufScale(&B, 1.0);
+	Buf = Now() - Start;
+	printf("%-10s %8.1f Melem/s\n", "bufscale", N / Buf / 1e6);
+	printf("write speedup %5.2fx\n", Call / Buf);
+
+	ShutdownEngine();
+	return 0;
+}
@@ -0,0 +1,175 @@
+// Latency of a small script, run by a fresh main per request and by a
+// daemon: straight from this process over the socket, and through a
+// "main -connect" client process, as a shell script would. Then checks
+// that a daemon in this process compiles a library sent again on the
+// same connection only once.
+//   bench/daemon [path to main] [requests]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <string>
+#include "../engine.hpp"
+#include "timer.hpp"
+
+static const char* Script =
+	"def fib(x) if x < 3 then 1 else fib(x - 1) + fib(x - 2);\n"
+	"def score(x k) if k < 1 then x else x * k + fib(k);\n"
+	"score(2, 10);\n"
+	"fib(20);\n";
+
+static const char* SockPath = "/tmp/kaleidoscope-bench.sock";
+static const char* ReuseSockPath = "/tmp/kaleidoscope-bench-reuse.sock";
+
+// Runs Argv with Input on its stdin and its output thrown away
+static bool Run(const char* const* Argv, const char* Input) {
+	int Pipe[2];
+	if(pipe(Pipe) != 0) {
+		return false;
+	}
+	pid_t Pid = fork();
+	if(Pid == 0) {
+		int Null = open("/dev/null", O_WRONLY);
+		dup2(Pipe[0], 0);
+		dup2(Null, 1);
+		dup2(Null, 2);
+		close(Pipe[1]);
+		execv(Argv[0], (char* const*) Argv);
+		_exit(127);
+	}
+	close(Pipe[0]);
+	bool Ok = write(Pipe[1], Input, strlen(Input)) == (ssize_t) strlen(Input);
+	close(Pipe[1]);
+	int Status;
+	waitpid(Pid, &Status, 0);
+	return Ok && WIFEXITED(Status) && WEXITSTATUS(Status) == 0;
+}
+
+// One request on an open connection; the reply is thrown away
+static bool Request(int Fd, const std::string &Src) {
+	if(write(Fd, Src.c_str(), Src.size() + 1) != (ssize_t) Src.size() + 1) {
+		return false;
+	}
+	char C;
+	ssize_t N;
+	while((N = read(Fd, &C, 1)) == 1 && C != '\0') {
+	}
+	return N == 1;
+}
+
+static void* DaemonThread(void*) {
+	RunDaemon(ReuseSockPath);
+	return 0;
+}
+
+// The script again, and after something else was parsed, on the
+// connection that sent it first: the module must not grow
+static bool CheckReuse() {
+	if(!InitializeEngine()) {
+		return false;
+	}
+	pthread_t T;
+	pthread_create(&T, 0, DaemonThread, 0);
+	pthread_detach(T);
+
+	sockaddr_un Addr;
+	memset(&Addr, 0, sizeof(Addr));
+	Addr.sun_family = AF_UNIX;
+	strcpy(Addr.sun_path, ReuseSockPath);
+	int Fd = -1;
+	for(unsigned Tries = 0; Tries < 5000; ++Tries) {
+		Fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if(connect(Fd, (sockaddr*) &Addr, sizeof(Addr)) == 0) {
+			break;
+		}
+		close(Fd);
+		Fd = -1;
+		usleep(1000);
+	}
+	if(Fd < 0 || !Request(Fd, Script)) {
+		fprintf(stderr, "in-process daemon didn't answer\n");
+		return false;
+	}
+	SessionMemory First, Again;
+	GetSessionMemory(First);
+	bool Ok = Request(Fd, Script) && Request(Fd, std::string("(1 + 2) * 3;\n") + Script);
+	GetSessionMemory(Again);
+	close(Fd);
+	unlink(ReuseSockPath);
+	if(!Ok || Again.Functions != First.Functions) {
+		fprintf(stderr, "library sent again was compiled again (%u functions, then %u)\n",
+						First.Functions, Again.Functions);
+		return false;
+	}
+	return true;
+}
+
+static void Report(const char* Name, double Total, unsigned N) {
+	printf("%-16s %8.3f ms per request\n", Name, Total / N * 1e3);
+}
+
+int main(int argc, char** argv) {
+	const char* Main = argc > 1 ? argv[1] : "./main";
+	unsigned N = argc > 2 ? atoi(argv[2]) : 50;
+
+	// A fresh process per request, which compiles everything again
+	const char* Fresh[] = { Main, "-v=0", 0 };
+	double Start = Now();
+	for(unsigned i = 0; i < N; ++i) {
+		if(!Run(Fresh, Script)) {
+			fprintf(stderr, "%s failed\n", Main);
+			return 1;
+		}
+	}
+	Report("fresh main", Now() - Start, N);
+
+	std::string DaemonArg = std::string("-daemon=") + SockPath;
+	pid_t Daemon = fork();
+	if(Daemon == 0) {
+		execl(Main, Main, DaemonArg.c_str(), (char*) 0);
+		_exit(127);
+	}
+	// Wait until it listens; the first request also compiles the script's
+	// definitions, which the later ones find compiled
+	std::string Reply;
+	for(unsigned Tries = 0; !SendToDaemon(SockPath, Script, Reply); ++Tries) {
+		if(Tries == 5000) {
+			fprintf(stderr, "%s %s didn't start\n", Main, DaemonArg.c_str());
+			kill(Daemon, SIGTERM);
+			return 1;
+		}
+		usleep(1000);
+	}
+
+	Start = Now();
+	for(unsigned i = 0; i < N; ++i) {
+		if(!SendToDaemon(SockPath, Script, Reply)) {
+			fprintf(stderr, "daemon request failed\n");
+			return 1;
+		}
+	}
+	Report("daemon, socket", Now() - Start, N);
+
+	std::string ConnectArg = std::string("-connect=") + SockPath;
+	const char* Client[] = { Main, ConnectArg.c_str(), 0 };
+	Start = Now();
+	for(unsigned i = 0; i < N; ++i) {
+		if(!Run(Client, Script)) {
+			fprintf(stderr, "%s -connect failed\n", Main);
+			return 1;
+		}
+	}
+	Report("daemon, client", Now() - Start, N);
+	printf("last reply:\n%s", Reply.c_str());
+
+	kill(Daemon, SIGTERM);
+	waitpid(Daemon, 0, 0);
+	unlink(SockPath);
+	return CheckReuse() ? 0 : 1;
+}
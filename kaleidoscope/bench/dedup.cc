@@ -0,0 +1,74 @@
+// A generated rule library: many definitions that differ only in name.
+// Times compiling them and emitting each one's code, and shows the
+// machine code the session holds afterwards.
+//   bench/dedup [N]              (duplicates merged)
+//   bench/dedup -no-dedup [N]    (every one compiled)
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include "../engine.hpp"
+#include "timer.hpp"
+
+int main(int argc, char** argv) {
+	EngineOptions Opts;
+	unsigned N = 2000;
+	for(int i = 1; i < argc; ++i) {
+		if(!strcmp(argv[i], "-no-dedup")) {
+			Opts.Dedup = false;
+		} else {
+			N = atoi(argv[i]);
+		}
+	}
+
+	if(!InitializeEngine(Opts)) {
+		return 1;
+	}
+
+	// Four distinct bodies, each repeated N / 4 times
+	const char* Bodies[] = {
+		"if x < y then x * y + 3 else (x - y) * 0.5",
+		"if x < 0 then 0 - x * y else x * x + y * y",
+		"if y < 1 then x else x * y - y * 0.5",
+		"(x + y) * (x - y) * 0.25 + 1"
+	};
+	std::string Src;
+	for(unsigned i = 0; i != N; ++i) {
+		char Name[32];
+		snprintf(Name, sizeof(Name), "rule%u", i);
+		Src += std::string("def ") + Name + "(x y) " + Bodies[i % 4] + ";\n";
+	}
+
+	double Start = Now();
+	if(!EvalSource(Src)) {
+		return 1;
+	}
+	double Compile = Now() - Start;
+
+	typedef double (*RuleFn)(double, double);
+	Start = Now();
+	double Sum = 0;
+	for(unsigned i = 0; i != N; ++i) {
+		char Name[32];
+		snprintf(Name, sizeof(Name), "rule%u", i);
+		RuleFn F = (RuleFn) (intptr_t) GetFunctionPointer(Name);
+		if(!F) {
+			fprintf(stderr, "could not compile %s\n", Name);
+			return 1;
+		}
+		Sum += F(i, 3);
+	}
+	double Emit = Now() - Start;
+
+	SessionMemory M;
+	GetSessionMemory(M);
+	DedupStats S;
+	GetDedupStats(S);
+	printf("%s, %u functions (checksum %g)\n", Opts.Dedup ? "dedup" : "no dedup", N, Sum);
+	printf("compile %8.3f s, emit %8.3f s\n", Compile, Emit);
+	printf("machine code %lu bytes, %u merged, %lu bytes saved\n",
+				 (unsigned long) M.CodeBytes, S.Merged, (unsigned long) S.CodeBytesSaved);
+
+	ShutdownEngine();
+	return 0;
+}
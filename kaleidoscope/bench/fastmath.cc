@@ -0,0 +1,30 @@
+// The same reduction over a for loop, compiled strict and as "fast def"
+#include <stdio.h>
+#include <stdlib.h>
+#include "../engine.hpp"
+#include "timer.hpp"
+
+int main(int argc, char** argv) {
+	double N = argc > 1 ? atof(argv[1]) : 100000000;
+
+	if(!InitializeEngine()) {
+		return 1;
+	}
+
+	bool Ok = EvalSource(
+		"def binary : 1 (x y) y;"
+		"def strict(n) var s = 0 in"
+		"  (for i = 0, i < n in s = s + 1 + i*0.5 + 2 + i*0.25 + 3) : s;"
+		"fast def relaxed(n) var s = 0 in"
+		"  (for i = 0, i < n in s = s + 1 + i*0.5 + 2 + i*0.25 + 3) : s;");
+	if(!Ok) {
+		return 1;
+	}
+
+	double Strict = Time("strict", N);
+	double Relaxed = Time("relaxed", N);
+	printf("speedup  %8.2fx\n", Strict / Relaxed);
+
+	ShutdownEngine();
+	return 0;
+}
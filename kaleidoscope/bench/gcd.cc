@@ -0,0 +1,31 @@
+// gcd by subtraction (as in 02/main.cc) in doubles and in ints
+#include <stdio.h>
+#include <stdlib.h>
+#include "../engine.hpp"
+#include "timer.hpp"
+
+int main(int argc, char** argv) {
+	double N = argc > 1 ? atof(argv[1]) : 100000;
+
+	if(!InitializeEngine()) {
+		return 1;
+	}
+
+	bool Ok = EvalSource(
+		"def gcdd(x y)"
+		"  if x < y then gcdd(x, y - x) else if y < x then gcdd(x - y, y) else x;"
+		"def gcdi(x : int y : int) : int"
+		"  if x < y then gcdi(x, y - x) else if y < x then gcdi(x - y, y) else x;"
+		"def rund(n) sum i = 1, n in gcdd(i, 1000);"
+		"def runi(n) sum i = 1, n in double(gcdi(int(i), 1000));");
+	if(!Ok) {
+		return 1;
+	}
+
+	double Double = Time("rund", N, 100);
+	double Int = Time("runi", N, 100);
+	printf("int speedup %5.2fx\n", Double / Int);
+
+	ShutdownEngine();
+	return 0;
+}
@@ -0,0 +1,64 @@
+// memo def against plain recursion: fib, and counting lattice paths (a
+// dynamic programming recurrence). The second argument is the capacity
+// of the memo tables, to see what evictions cost.
+#include <stdio.h>
+#include <stdlib.h>
+#include "../engine.hpp"
+#include "timer.hpp"
+
+typedef double (*Fn2)(double, double);
+
+static double TimeMemo(const char* Name, double A, double B) {
+	Fn2 F = (Fn2) (intptr_t) GetFunction(Name);
+	// Every run starts with empty tables
+	ClearMemoTables();
+	double Start = Now();
+	double R = F(A, B);
+	double T = Now() - Start;
+	printf("%-10s %8.3f s  (result %.0f)\n", Name, T, R);
+
+	MemoStats S;
+	if(GetMemoStats(Name, S)) {
+		printf("%-10s %u/%u entries, %llu hits, %llu misses, %llu evictions\n", "",
+					 S.Entries, S.Capacity, (unsigned long long) S.Hits,
+					 (unsigned long long) S.Misses, (unsigned long long) S.Evictions);
+	}
+	return T;
+}
+
+int main(int argc, char** argv) {
+	double N = argc > 1 ? atof(argv[1]) : 40;
+
+	EngineOptions Opts;
+	if(argc > 2) {
+		Opts.MemoCapacity = atoi(argv[2]);
+	}
+	if(!InitializeEngine(Opts)) {
+		return 1;
+	}
+
+	// fib and paths take a dummy second argument, so one signature fits all
+	bool Ok = EvalSource(
+		"def fib(n d) if n < 2 then n else fib(n - 1, d) + fib(n - 2, d);"
+		"memo def mfib(n d) if n < 2 then n else mfib(n - 1, d) + mfib(n - 2, d);"
+		"def paths(i j) if i < 1 then 1 else if j < 1 then 1"
+		"  else paths(i - 1, j) + paths(i, j - 1);"
+		"memo def mpaths(i j) if i < 1 then 1 else if j < 1 then 1"
+		"  else mpaths(i - 1, j) + mpaths(i, j - 1);");
+	if(!Ok) {
+		return 1;
+	}
+
+	double Plain = TimeMemo("fib", N, 0);
+	double Memo = TimeMemo("mfib", N, 0);
+	printf("fib memo speedup %10.1fx\n", Plain / Memo);
+
+	// A side of 14 makes C(28, 14), about 40 million leaves, for paths
+	double Side = N / 2 - 6;
+	Plain = TimeMemo("paths", Side, Side);
+	Memo = TimeMemo("mpaths", Side, Side);
+	printf("paths memo speedup %8.1fx\n", Plain / Memo);
+
+	ShutdownEngine();
+	return 0;
+}
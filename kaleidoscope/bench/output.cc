@@ -0,0 +1,43 @@
+// printd through the buffered runtime, against the stdio version it
+// replaced (one printf("%f") per value). Output goes to /dev/null.
+#include <stdio.h>
+#include <stdlib.h>
+#include "../engine.hpp"
+#include "timer.hpp"
+
+extern "C" double printd(double x);
+
+int main(int argc, char** argv) {
+	long N = argc > 1 ? atol(argv[1]) : 10000000;
+
+	if(!freopen("/dev/null", "w", stdout)) {
+		return 1;
+	}
+
+	double Start = Now();
+	for(long i = 0; i < N; ++i) {
+		printf("%f", i * 0.37 - 1000.0);
+	}
+	fflush(stdout);
+	double Stdio = Now() - Start;
+
+	Start = Now();
+	for(long i = 0; i < N; ++i) {
+		printd(i * 0.37 - 1000.0);
+	}
+	FlushOutput();
+	double Buffered = Now() - Start;
+
+	SetBinaryOutput(true);
+	Start = Now();
+	for(long i = 0; i < N; ++i) {
+		printd(i * 0.37 - 1000.0);
+	}
+	FlushOutput();
+	double Binary = Now() - Start;
+
+	fprintf(stderr, "printf:          %.1f Mvalues/s\n", N / Stdio / 1e6);
+	fprintf(stderr, "printd:          %.1f Mvalues/s\n", N / Buffered / 1e6);
+	fprintf(stderr, "printd (binary): %.1f Mvalues/s\n", N / Binary / 1e6);
+	return 0;
+}
@@ -0,0 +1,59 @@
+// Scaling of "parallel for" from 1 thread up to one per core, on a loop
+// whose iterations are independent
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+#include "../engine.hpp"
+#include "timer.hpp"
+
+static std::vector<double> Out;
+
+extern "C" double store(double I, double V) {
+	Out[(size_t) I] = V;
+	return 0;
+}
+
+int main(int argc, char** argv) {
+	double N = argc > 1 ? atof(argv[1]) : 200000;
+	long Cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if(!InitializeEngine()) {
+		return 1;
+	}
+	RegisterHostFunction("store", (void*) store, 2, HF_NoUnwind);
+	bool Ok = EvalSource(
+		"def binary : 1 (x y) y;"
+		"extern store(i v);"
+		"def iter(x) var s = x in (for j = 0, j < 1000 in s = s*0.999 + 0.5) : s;"
+		"def kernel(n) parallel for i = 0, i < n in store(i, iter(i));");
+	if(!Ok) {
+		return 1;
+	}
+	typedef double (*KernelFn)(double);
+	KernelFn Kernel = (KernelFn) (intptr_t) GetFunctionPointer("kernel");
+	Out.resize((size_t) N);
+
+	double Base = 0;
+	for(long T = 1; ; T *= 2) {
+		if(T > Cores) {
+			T = Cores; // finish with all of them
+		}
+		SetParallelThreads(T);
+		Kernel(N); // warm up, and start the threads
+		double Start = Now();
+		Kernel(N);
+		double Time = Now() - Start;
+		if(T == 1) {
+			Base = Time;
+		}
+		printf("%3ld threads: %8.1f Miter/s  speedup %5.2fx\n", T,
+					 N / Time / 1e6, Base / Time);
+		if(T >= Cores) {
+			break;
+		}
+	}
+
+	ShutdownEngine();
+	return 0;
+}
@@ -0,0 +1,52 @@
+// Startup with the standard prelude: loaded precompiled, or compiled from
+// its source like main had to before, and with no prelude at all.
+//   bench/prelude            (precompiled)
+//   bench/prelude -source    (compiled at startup)
+//   bench/prelude -none      (engine only)
+#include <stdio.h>
+#include <string.h>
+#include "../engine.hpp"
+#include "timer.hpp"
+
+int main(int argc, char** argv) {
+	EngineOptions Opts;
+	const char* Mode = "precompiled";
+	bool FromSource = false;
+	Opts.Prelude = &StandardPrelude;
+	for(int i = 1; i < argc; ++i) {
+		if(!strcmp(argv[i], "-source")) {
+			Mode = "source";
+			FromSource = true;
+			Opts.Prelude = 0;
+		} else if(!strcmp(argv[i], "-none")) {
+			Mode = "none";
+			Opts.Prelude = 0;
+		}
+	}
+
+	double Start = Now();
+	if(!InitializeEngine(Opts)) {
+		return 1;
+	}
+	if(FromSource && !EvalSource(StandardPrelude.Source)) {
+		return 1;
+	}
+	double Ready = Now() - Start;
+	printf("%-12s ready in %8.3f ms\n", Mode, Ready * 1e3);
+
+	if(Opts.Prelude || FromSource) {
+		// First call, JIT emission included
+		typedef double (*ClampFn)(double, double, double);
+		Start = Now();
+		ClampFn Clamp = (ClampFn) (intptr_t) GetFunctionPointer("clamp");
+		if(!Clamp) {
+			fprintf(stderr, "no clamp in the prelude\n");
+			return 1;
+		}
+		double R = Clamp(5, 0, 1);
+		printf("%-12s first call %8.3f ms  (result %f)\n", Mode, (Now() - Start) * 1e3, R);
+	}
+
+	ShutdownEngine();
+	return 0;
+}
@@ -0,0 +1,34 @@
+// The same sums and maximum as a reduction and as a for loop over a var
+#include <stdio.h>
+#include <stdlib.h>
+#include "../engine.hpp"
+#include "timer.hpp"
+
+int main(int argc, char** argv) {
+	double N = argc > 1 ? atof(argv[1]) : 100000000;
+
+	if(!InitializeEngine()) {
+		return 1;
+	}
+
+	bool Ok = EvalSource(
+		"def binary : 1 (x y) y;"
+		"def loopsum(n) var s = 0 in (for i = 0, i < n in s = s + i*0.5) : s;"
+		"def redsum(n) sum i = 0, n in i*0.5;"
+		"def loopmax(n) var m = 0 in"
+		"  (for i = 0, i < n in m = if m < i*0.5 then i*0.5 else m) : m;"
+		"def redmax(n) max i = 0, n in i*0.5;");
+	if(!Ok) {
+		return 1;
+	}
+
+	double Loop = Time("loopsum", N, 1000);
+	double Reduce = Time("redsum", N, 1000);
+	printf("sum speedup %5.2fx\n", Loop / Reduce);
+	Loop = Time("loopmax", N, 1000);
+	Reduce = Time("redmax", N, 1000);
+	printf("max speedup %5.2fx\n", Loop / Reduce);
+
+	ShutdownEngine();
+	return 0;
+}
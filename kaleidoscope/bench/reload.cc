@@ -0,0 +1,80 @@
+// Hot redefinition. Compare the cost of a call
+//   bench/reload                (direct calls)
+//   bench/reload -hot-reload    (calls through the slot)
+// With -hot-reload it also times redefinitions, while another thread
+// keeps calling the function being replaced.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "../engine.hpp"
+#include "timer.hpp"
+
+typedef double (*DriveFn)(double);
+
+static double CallsPerThread = 100000000;
+
+struct DriveRun {
+	DriveFn Drive;
+	double Result;
+};
+
+// Runs JITed code only; the engine itself isn't thread safe
+static void* RunDrive(void* Arg) {
+	DriveRun* Run = (DriveRun*) Arg;
+	Run->Result = Run->Drive(CallsPerThread);
+	return 0;
+}
+
+int main(int argc, char** argv) {
+	EngineOptions Opts;
+	for(int i = 1; i < argc; ++i) {
+		if(!strcmp(argv[i], "-hot-reload")) {
+			Opts.HotReload = true;
+		} else {
+			CallsPerThread = atof(argv[i]);
+		}
+	}
+
+	if(!InitializeEngine(Opts)) {
+		return 1;
+	}
+	bool Ok = EvalSource(
+		"def binary : 1 (x y) y;"
+		"def rule(x) x*0.5 + 1;"
+		"def drive(n) var s = 0 in (for i = 0, i < n in s = s + rule(i)) : s;");
+	if(!Ok) {
+		return 1;
+	}
+
+	DriveFn Drive = (DriveFn) (intptr_t) GetFunctionPointer("drive");
+	double N = CallsPerThread;
+	double Start = Now();
+	double R = Drive(N);
+	double T = Now() - Start;
+	printf("%s calls: %6.2f ns/call  (result %f)\n",
+				 Opts.HotReload ? "slot  " : "direct", T / N * 1e9, R);
+
+	if(Opts.HotReload) {
+		// Redefine rule over and over while drive runs on another thread
+		DriveRun Run = { Drive, 0 };
+		pthread_t Thread;
+		pthread_create(&Thread, 0, RunDrive, &Run);
+		const unsigned Swaps = 100;
+		Start = Now();
+		for(unsigned i = 0; i < Swaps; ++i) {
+			char Src[64];
+			snprintf(Src, sizeof(Src), "def rule(x) x*0.5 + %u;", i + 2);
+			if(!EvalSource(Src)) {
+				return 1;
+			}
+		}
+		T = Now() - Start;
+		pthread_join(Thread, 0);
+		printf("redefinition: %6.1f us each (compile + swap), drive saw %f\n",
+					 T / Swaps * 1e6, Run.Result);
+	}
+
+	ShutdownEngine();
+	return 0;
+}
@@ -0,0 +1,188 @@
+#!/usr/bin/env python3
+"""Runs the kaleidoscope programs in bench/programs (plus generated ones)
+through ../main and reports, for each:
+
+  compile_mbps    source bytes compiled per second (lex to emission)
+  first_result_s  wall time from start until the first result is printed
+  steady_s        execution time of the program's last top-level expression
+  peak_rss_kb     peak resident set size
+
+Each program runs --runs times; the median is reported. With
+--save-baseline the results are written to baseline.json; otherwise they
+are compared with it, and the exit status is 1 if anything got worse by
+more than --threshold.
+"""
+
+import argparse
+import json
+import os
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+PROGRAMS = os.path.join(HERE, "programs")
+
+# metric -> True if bigger is better
+METRICS = {
+    "compile_mbps": True,
+    "first_result_s": False,
+    "steady_s": False,
+    "peak_rss_kb": False,
+}
+
+COMPILE_PHASES = ["lex", "parse", "irgen", "verify", "optimize", "emit"]
+
+
+def generate_many_defs(path, count=10000):
+    with open(path, "w") as f:
+        f.write("# %d independent definitions, then one call\n" % count)
+        for i in range(1, count + 1):
+            f.write("def f%d(x y) (x+%d)*(y-%d) + x*y*%d;\n" % (i, i, i, i % 7))
+        f.write("f1(1, 2) + f%d(3, 4);\n" % count)
+
+
+def generate_deep_expr(path, depth=2000):
+    with open(path, "w") as f:
+        f.write("# Expressions nested %d deep\n" % depth)
+        f.write("def deep(x) %s;\n" % ("(x+" * depth + "1" + ")" * depth))
+        f.write("def wide(x) %s;\n" % " + ".join("x*%d" % i for i in range(depth)))
+        f.write("deep(1) + wide(2);\n")
+
+
+def generate_large_functions(path, count=20, nvars=100, nloops=20):
+    """Functions with many mutable variables, loops and ifs: what
+    variable handling (allocas + mem2reg, or direct SSA) costs."""
+    with open(path, "w") as f:
+        f.write("def binary : 1 (x y) y;\n")
+        for n in range(count):
+            names = ["v%d" % i for i in range(nvars)]
+            f.write("def big%d(x)\n  var %s in\n" % (
+                n, ", ".join("%s = x+%d" % (v, i) for i, v in enumerate(names))))
+            stmts = []
+            for l in range(nloops):
+                body = " : ".join(
+                    "%s = (if %s < %s then %s*0.5 + i else %s - 1)" % (
+                        names[(l + k) % nvars], names[k % nvars], names[-1 - k % nvars],
+                        names[(l + k) % nvars], names[k % nvars])
+                    for k in range(10))
+                stmts.append("(for i = 0, i < 3 in %s)" % body)
+            stmts.append(" + ".join(names))
+            f.write("    %s;\n" % " :\n    ".join(stmts))
+        f.write("big0(1) + big%d(2);\n" % (count - 1))
+
+
+def run_once(main, program, main_args):
+    with tempfile.TemporaryDirectory() as tmp:
+        stats_path = os.path.join(tmp, "stats.json")
+        with open(program, "rb") as src, open(os.devnull, "wb") as null:
+            start = time.monotonic()
+            proc = subprocess.Popen([main, "-v=0", "-stats=" + stats_path] + main_args,
+                                    stdin=src, stdout=null, stderr=subprocess.PIPE)
+            first_result = None
+            for line in proc.stderr:
+                if first_result is None and b"Evaluated to" in line:
+                    first_result = time.monotonic() - start
+                if b"Error" in line:
+                    sys.stderr.write("%s: %s" % (program, line.decode()))
+            _, status, rusage = os.wait4(proc.pid, 0)
+            proc.returncode = os.waitstatus_to_exitcode(status)
+            if proc.returncode != 0:
+                raise RuntimeError("%s: main exited with status %d"
+                                   % (program, proc.returncode))
+
+        with open(stats_path) as f:
+            stats = json.load(f)
+
+    total = stats["total"]
+    compile_ns = sum(total[p + "_ns"] for p in COMPILE_PHASES)
+    exprs = [i for i in stats["items"] if i["kind"] == "expr"]
+    return {
+        "compile_mbps": os.path.getsize(program) / 1e6 / (compile_ns * 1e-9),
+        "first_result_s": first_result if first_result is not None else 0.0,
+        "steady_s": exprs[-1]["exec_ns"] * 1e-9 if exprs else 0.0,
+        "peak_rss_kb": rusage.ru_maxrss,
+    }
+
+
+def run(main, program, runs, main_args):
+    samples = [run_once(main, program, main_args) for _ in range(runs)]
+    return dict((m, statistics.median(s[m] for s in samples)) for m in METRICS)
+
+
+def compare(results, baseline, threshold):
+    regressions = 0
+    for name in sorted(results):
+        if name not in baseline:
+            continue
+        for metric, higher_is_better in METRICS.items():
+            old, new = baseline[name][metric], results[name][metric]
+            if old == 0:
+                continue
+            change = (new - old) / old
+            worse = -change if higher_is_better else change
+            flag = ""
+            if worse > threshold:
+                flag = "  REGRESSION"
+                regressions += 1
+            print("%-12s %-15s %12.4g -> %12.4g (%+6.1f%%)%s"
+                  % (name, metric, old, new, change * 100, flag))
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--main", default=os.path.join(HERE, "..", "main"))
+    parser.add_argument("--main-args", default="",
+                        help="extra options for main, e.g. -direct-ssa")
+    parser.add_argument("--runs", type=int, default=3)
+    parser.add_argument("--baseline", default=os.path.join(HERE, "baseline.json"))
+    parser.add_argument("--save-baseline", action="store_true")
+    parser.add_argument("--threshold", type=float, default=0.10,
+                        help="relative change counted as a regression")
+    parser.add_argument("programs", nargs="*",
+                        help="only run these (names without .k)")
+    args = parser.parse_args()
+
+    with tempfile.TemporaryDirectory() as gen:
+        programs = dict((f[:-2], os.path.join(PROGRAMS, f))
+                        for f in os.listdir(PROGRAMS) if f.endswith(".k"))
+        programs["many_defs"] = os.path.join(gen, "many_defs.k")
+        generate_many_defs(programs["many_defs"])
+        programs["deep_expr"] = os.path.join(gen, "deep_expr.k")
+        generate_deep_expr(programs["deep_expr"])
+        programs["large_funcs"] = os.path.join(gen, "large_funcs.k")
+        generate_large_functions(programs["large_funcs"])
+
+        names = args.programs or sorted(programs)
+        results = {}
+        for name in names:
+            results[name] = run(args.main, programs[name], args.runs,
+                                args.main_args.split())
+            r = results[name]
+            print("%-12s compile %8.2f MB/s  first result %7.3fs  "
+                  "steady %8.3fs  rss %7d KB"
+                  % (name, r["compile_mbps"], r["first_result_s"],
+                     r["steady_s"], r["peak_rss_kb"]))
+
+    if args.save_baseline:
+        with open(args.baseline, "w") as f:
+            json.dump(results, f, indent=2, sort_keys=True)
+        print("saved", args.baseline)
+        return 0
+
+    if not os.path.exists(args.baseline):
+        print("no baseline (run with --save-baseline first)")
+        return 0
+
+    with open(args.baseline) as f:
+        baseline = json.load(f)
+    print()
+    return 1 if compare(results, baseline, args.threshold) else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,50 @@
+// A rule whose work depends on its last two arguments, called in a loop
+// with them constant in the source (specialized) and passed in at run
+// time (the generic body), e.g.
+//   bench/specialize 10000000
+#include <stdio.h>
+#include <stdlib.h>
+#include "../engine.hpp"
+#include "timer.hpp"
+
+typedef double (*Fn3)(double, double, double);
+
+static double TimeRule(const char* Name, double N) {
+	Fn3 F = (Fn3) (intptr_t) GetFunction(Name);
+	F(100, 3, 0.5); // warm up
+	double Start = Now();
+	double R = F(N, 3, 0.5);
+	double T = Now() - Start;
+	printf("%-9s %8.3f s  (result %f)\n", Name, T, R);
+	return T;
+}
+
+int main(int argc, char** argv) {
+	double N = argc > 1 ? atof(argv[1]) : 10000000;
+
+	if(!InitializeEngine()) {
+		return 1;
+	}
+
+	bool Ok = EvalSource(
+		"def rule(x k w)"
+		"  if k < 1 then w"
+		"  else if k < 2 then x * w"
+		"  else if k < 3 then (x * x + x) * w"
+		"  else if k < 4 then ((x * x + x) * x + 1) * w"
+		"  else x * w * 0.5;"
+		// k and w are ignored: the call has them as constants
+		"def constant(n k w) sum i = 0, n in rule(i, 3, 0.5);"
+		"def generic(n k w) sum i = 0, n in rule(i, k, w);");
+	if(!Ok) {
+		return 1;
+	}
+
+	double Generic = TimeRule("generic", N);
+	double Constant = TimeRule("constant", N);
+	printf("specialization speedup %5.2fx\n", Generic / Constant);
+
+	EvalSource("@spec;");
+	ShutdownEngine();
+	return 0;
+}
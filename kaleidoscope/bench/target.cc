@@ -0,0 +1,60 @@
+// Element-wise kernels compiled for a given CPU. Compare
+//   bench/target                (host CPU)
+//   bench/target -mcpu=x86-64   (baseline)
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "../engine.hpp"
+#include "timer.hpp"
+
+int main(int argc, char** argv) {
+	EngineOptions Opts;
+	uint64_t N = 10000000;
+	for(int i = 1; i < argc; ++i) {
+		if(!strncmp(argv[i], "-mcpu=", 6)) {
+			Opts.CPU = argv[i] + 6;
+		} else {
+			N = strtoull(argv[i], 0, 10);
+		}
+	}
+
+	if(!InitializeEngine(Opts)) {
+		return 1;
+	}
+	bool Ok = EvalSource(
+		"extern sqrt(x);"
+		"def norm(x y z) sqrt(x*x + y*y + z*z);"
+		"def blend(x y z) x*0.25 + y*0.5 + z*0.25 - (x - z)*(y - z)*0.125;");
+	if(!Ok) {
+		return 1;
+	}
+
+	std::vector<double> X(N), Y(N), Z(N), Out(N);
+	for(uint64_t i = 0; i < N; ++i) {
+		X[i] = i * 0.5;
+		Y[i] = 1.0 / (i + 1);
+		Z[i] = (double) (i % 31);
+	}
+	const double* Cols[] = { &X[0], &Y[0], &Z[0] };
+
+	const char* Kernels[] = { "norm", "blend" };
+	for(unsigned k = 0; k < 2; ++k) {
+		MapKernelFn Map = GetMapKernel(Kernels[k]);
+		if(!Map) {
+			fprintf(stderr, "could not compile %s\n", Kernels[k]);
+			return 1;
+		}
+		Map(Cols, &Out[0], N); // warm up
+		double Start = Now();
+		for(unsigned r = 0; r < 10; ++r) {
+			Map(Cols, &Out[0], N);
+		}
+		double T = Now() - Start;
+		printf("%-6s %s: %8.1f Mrows/s\n", Kernels[k],
+					 Opts.CPU.empty() ? "host" : Opts.CPU.c_str(), 10 * N / T / 1e6);
+	}
+
+	ShutdownEngine();
+	return 0;
+}
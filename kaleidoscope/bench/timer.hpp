@@ -0,0 +1,44 @@
+// Shared by the benchmark programs
+
+#ifndef DEF_KALEID_BENCH_TIMER
+#define DEF_KALEID_BENCH_TIMER
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include "../engine.hpp"
+
+// Wall clock, in seconds
+static inline double Now() {
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+// Compiled code of the definition Name; exits if there is none
+static inline void* GetFunction(const char* Name) {
+	void* F = GetFunctionPointer(Name);
+	if(!F) {
+		fprintf(stderr, "could not compile %s\n", Name);
+		exit(1);
+	}
+	return F;
+}
+
+// Runs the one argument definition Name on N, N being its iteration
+// count, and prints how long it took. A warm-up run on WarmUp comes
+// first unless it is 0. Returns the time in seconds.
+static inline double Time(const char* Name, double N, double WarmUp = 0) {
+	double (*F)(double) = (double(*)(double)) (intptr_t) GetFunction(Name);
+	if(WarmUp) {
+		F(WarmUp);
+	}
+	double Start = Now();
+	double R = F(N);
+	double T = Now() - Start;
+	printf("%-8s %8.3f s %8.1f Miter/s  (result %f)\n", Name, T, N / T / 1e6, R);
+	return T;
+}
+
+#endif
@@ -0,0 +1,123 @@
+// The same kernels written with numbers and with vec4/vec8: a dot
+// product and scaling a signal in place. First runs vector '<' on
+// tricky lanes (NaN, infinities, signed zeros, equal values) and checks
+// it against the scalar '<'; exits with 1 if they differ.
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <vector>
+#include "../engine.hpp"
+#include "timer.hpp"
+
+typedef double (*LessFn)(DoubleBuffer*, DoubleBuffer*, DoubleBuffer*);
+
+// Every lane of vec4 and vec8 '<' against the scalar '<' of the same
+// numbers
+static bool CheckLess() {
+	double (*Less)(double, double) = (double(*)(double, double)) GetFunction("less1");
+	LessFn Less4 = (LessFn) GetFunction("less4");
+	LessFn Less8 = (LessFn) GetFunction("less8");
+
+	const double Values[] = { -1.5, 0.0, -0.0, 1.0, 2.5, INFINITY, -INFINITY, NAN };
+	const unsigned N = sizeof(Values) / sizeof(Values[0]);
+	// Every pair of values, 8 at a time
+	std::vector<double> X, Y, Out(N * N);
+	for(unsigned i = 0; i != N; ++i) {
+		for(unsigned j = 0; j != N; ++j) {
+			X.push_back(Values[i]);
+			Y.push_back(Values[j]);
+		}
+	}
+	DoubleBuffer A = { &X[0], X.size() };
+	DoubleBuffer B = { &Y[0], Y.size() };
+	DoubleBuffer C = { &Out[0], Out.size() };
+
+	for(unsigned Width = 4; Width <= 8; Width *= 2) {
+		for(size_t i = 0; i != Out.size(); ++i) {
+			Out[i] = -1;
+		}
+		(Width == 4 ? Less4 : Less8)(&A, &B, &C);
+		for(size_t i = 0; i != Out.size(); ++i) {
+			if(Out[i] != Less(X[i], Y[i])) {
+				fprintf(stderr, "vec%u: %f < %f gives %f, %f as numbers\n", Width, X[i], Y[i],
+								Out[i], Less(X[i], Y[i]));
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+typedef double (*DotFn)(DoubleBuffer*, DoubleBuffer*);
+typedef double (*ScaleFn)(DoubleBuffer*, double);
+
+static double TimeDot(const char* Name, DoubleBuffer* A, DoubleBuffer* B, int Reps) {
+	DotFn F = (DotFn) GetFunction(Name);
+	double R = F(A, B); // warm up
+	double Start = Now();
+	for(int i = 0; i < Reps; ++i) {
+		R = F(A, B);
+	}
+	double T = (Now() - Start) / Reps;
+	printf("%-8s %8.1f Melem/s  (result %f)\n", Name, A->Length / T / 1e6, R);
+	return T;
+}
+
+static double TimeScale(const char* Name, DoubleBuffer* A, int Reps) {
+	ScaleFn F = (ScaleFn) GetFunction(Name);
+	F(A, 1.0);
+	double Start = Now();
+	for(int i = 0; i < Reps; ++i) {
+		F(A, 1.0);
+	}
+	double T = (Now() - Start) / Reps;
+	printf("%-8s %8.1f Melem/s\n", Name, A->Length / T / 1e6);
+	return T;
+}
+
+int main(int argc, char** argv) {
+	// A multiple of 8, so the vector loops have no rest
+	size_t N = (argc > 1 ? atol(argv[1]) : 1 << 16) & ~(size_t) 7;
+	int Reps = argc > 2 ? atoi(argv[2]) : 1000;
+	std::vector<double> X(N), Y(N);
+	for(size_t i = 0; i < N; ++i) {
+		X[i] = i % 7;
+		Y[i] = i % 5;
+	}
+	DoubleBuffer A = { &X[0], N };
+	DoubleBuffer B = { &Y[0], N };
+
+	if(!InitializeEngine()) {
+		return 1;
+	}
+
+	bool Ok = EvalSource(
+		"def binary : 1 (x y) y;"
+		"def dot1(a : buffer b : buffer) var s = 0 in"
+		"  (for i = 0, i < len(a) - 1 in s = s + a[i] * b[i]) : s;"
+		"def dot4(a : buffer b : buffer) var s = vec4(0) in"
+		"  (for i = 0, i < len(a) - 4, 4 in s = s + vec4(a, i) * vec4(b, i)) : hsum(s);"
+		"def dot8(a : buffer b : buffer) var s = vec8(0) in"
+		"  (for i = 0, i < len(a) - 8, 8 in s = s + vec8(a, i) * vec8(b, i)) : hsum(s);"
+		"def scale1(a : buffer k) for i = 0, i < len(a) - 1 in a[i] = a[i] * k;"
+		"def scale4(a : buffer k) for i = 0, i < len(a) - 4, 4 in a[i] = vec4(a, i) * k;"
+		"def scale8(a : buffer k) for i = 0, i < len(a) - 8, 8 in a[i] = vec8(a, i) * k;"
+		"def less1(x y) x < y;"
+		"def less4(a : buffer b : buffer c : buffer)"
+		"  for i = 0, i < len(a) - 4, 4 in c[i] = vec4(a, i) < vec4(b, i);"
+		"def less8(a : buffer b : buffer c : buffer)"
+		"  for i = 0, i < len(a) - 8, 8 in c[i] = vec8(a, i) < vec8(b, i);");
+	if(!Ok || !CheckLess()) {
+		return 1;
+	}
+
+	double Scalar = TimeDot("dot1", &A, &B, Reps);
+	printf("vec4 speedup %5.2fx\n", Scalar / TimeDot("dot4", &A, &B, Reps));
+	printf("vec8 speedup %5.2fx\n", Scalar / TimeDot("dot8", &A, &B, Reps));
+	Scalar = TimeScale("scale1", &A, Reps);
+	printf("vec4 speedup %5.2fx\n", Scalar / TimeScale("scale4", &A, Reps));
+	printf("vec8 speedup %5.2fx\n", Scalar / TimeScale("scale8", &A, Reps));
+
+	ShutdownEngine();
+	return 0;
+}
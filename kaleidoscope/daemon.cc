@@ -0,0 +1,311 @@
+// Daemon mode: one warm engine serving many short-lived clients over a
+// Unix domain socket. Every connection gets a thread. A request is
+// compiled under the engine lock (the parser, code generator and module
+// are shared), and its top-level expressions then run on the client's
+// thread with the lock released, so requests from different clients
+// execute at the same time. Lazy compilation is off: the JIT emits a
+// function and everything it calls while the lock is held, never from
+// a running expression. A request's expressions, and the bodies of the
+// parallel fors in them, are freed once they have run.
+//
+// Each connection is a namespace: its definitions are compiled under
+// names of their own ("fib#3"), which its later code resolves its names
+// to, and it has its own operator precedences. Definitions stay in the
+// module, and one with the same text, calling the same functions and
+// parsed with the same precedences as one compiled before (for any
+// client) is not compiled again, so clients can send their library
+// with every request. Externs and the prelude are shared.
+
+#include <llvm/Function.h>
+#include <llvm/Module.h>
+#include <llvm/ExecutionEngine/ExecutionEngine.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <string>
+#include <vector>
+#include <map>
+#include "kaleidoscope.hpp"
+#include "engine.hpp"
+
+extern Module* TheModule;
+extern ExecutionEngine* TheExecutionEngine;
+extern EngineOptions TheOptions;
+
+extern std::map<char, int> KBinopPrecedence;
+
+static pthread_mutex_t EngineLock = PTHREAD_MUTEX_INITIALIZER;
+
+namespace {
+
+// A client's names, and the operator precedences it parses with. While
+// one of its requests is compiled, its table is swapped with the
+// engine's.
+struct Session {
+	std::map<std::string, std::string> Names;
+	std::map<char, int> Precedence;
+};
+
+}
+
+// The following is only touched under EngineLock.
+// Session of the request being compiled, if any
+static Session* Current = 0;
+// Every definition compiled for a client, by DefinitionKey
+static std::map<std::string, std::string> Compiled;
+static unsigned NumDefinitions = 0;
+// The definition being compiled: its key, name in the source, and what
+// that stood for before (empty if nothing)
+static std::string PendingKey, PendingName, PendingOld;
+
+std::string ResolveFunctionName(const std::string &Name) {
+	if(Current) {
+		std::map<std::string, std::string>::const_iterator I = Current->Names.find(Name);
+		if(I != Current->Names.end()) {
+			return I->second;
+		}
+	}
+	return Name;
+}
+
+// What makes two definitions compile the same: text, the functions they
+// call (by module name, "" for themselves) and the precedences of the
+// binary operators, i.e. the entries above 0
+static std::string DefinitionKey(FunctionAST* F, const std::string &Text) {
+	std::string Key = Text;
+	std::vector<std::string> Callees;
+	F->CollectCallees(Callees);
+	for(unsigned i = 0, e = Callees.size(); i != e; ++i) {
+		Key += '\0';
+		if(Callees[i] != F->getName()) {
+			Key += ResolveFunctionName(Callees[i]);
+		}
+	}
+	for(std::map<char, int>::const_iterator I = KBinopPrecedence.begin(),
+				E = KBinopPrecedence.end(); I != E; ++I) {
+		if(I->second <= 0) {
+			continue;
+		}
+		char Prec[16];
+		snprintf(Prec, sizeof(Prec), "%c%d", I->first, I->second);
+		Key += '\0';
+		Key += Prec;
+	}
+	return Key;
+}
+
+bool EnterDefinition(FunctionAST* F, const std::string &Text) {
+	PendingKey.clear();
+	// A host function's name keeps its meaning, so defining it is the
+	// usual error
+	if(Current == 0 || LookupHostFunction(F->getName())) {
+		return true;
+	}
+
+	PrototypeAST* Proto = F->getProto();
+	std::string Key = DefinitionKey(F, Text);
+	std::map<std::string, std::string>::iterator I = Compiled.find(Key);
+	if(I != Compiled.end()) {
+		Current->Names[F->getName()] = I->second;
+		if(Proto->isBinaryOp()) {
+			KBinopPrecedence[Proto->getOperatorName()] = Proto->getBinaryPrecedence();
+		}
+		return false;
+	}
+
+	PendingKey = Key;
+	PendingName = F->getName();
+	PendingOld = ResolveFunctionName(PendingName);
+	if(PendingOld == PendingName) {
+		PendingOld.clear();
+	}
+	// Before the body is compiled, so recursive calls find it
+	char Suffix[16];
+	snprintf(Suffix, sizeof(Suffix), "#%u", ++NumDefinitions);
+	Proto->setName(PendingName + Suffix);
+	Current->Names[PendingName] = Proto->getName();
+	return true;
+}
+
+void LeaveDefinition(FunctionAST* F, bool Ok) {
+	if(PendingKey.empty()) {
+		return;
+	}
+	if(Ok) {
+		Compiled[PendingKey] = F->getName();
+	} else if(PendingOld.empty()) {
+		Current->Names.erase(PendingName);
+	} else {
+		Current->Names[PendingName] = PendingOld;
+	}
+	PendingKey.clear();
+}
+
+static bool WriteAll(int Fd, const char* Data, size_t Size) {
+	while(Size) {
+		ssize_t N = write(Fd, Data, Size);
+		if(N < 0 && errno == EINTR) {
+			continue;
+		}
+		if(N <= 0) {
+			return false;
+		}
+		Data += N;
+		Size -= N;
+	}
+	return true;
+}
+
+// Next NUL terminated message from Fd. Buf keeps what was read past it.
+static bool ReadMessage(int Fd, std::string &Buf, std::string &Msg) {
+	size_t End;
+	while((End = Buf.find('\0')) == std::string::npos) {
+		char Chunk[4096];
+		ssize_t N = read(Fd, Chunk, sizeof(Chunk));
+		if(N < 0 && errno == EINTR) {
+			continue;
+		}
+		if(N <= 0) {
+			return false;
+		}
+		Buf.append(Chunk, N);
+	}
+	Msg.assign(Buf, 0, End);
+	Buf.erase(0, End + 1);
+	return true;
+}
+
+static bool Serve(int Fd, Session &S, const std::string &Src) {
+	std::vector<Function*> Exprs;
+	std::vector<double (*)()> Code;
+	std::string Errors;
+	pthread_mutex_lock(&EngineLock);
+	Current = &S;
+	KBinopPrecedence.swap(S.Precedence);
+	CompileSource(Src, Exprs, Errors);
+	for(unsigned i = 0, e = Exprs.size(); i != e; ++i) {
+		Code.push_back((double(*)()) (intptr_t) TheExecutionEngine->getPointerToFunction(Exprs[i]));
+	}
+	KBinopPrecedence.swap(S.Precedence);
+	Current = 0;
+	pthread_mutex_unlock(&EngineLock);
+
+	bool Ok = WriteAll(Fd, Errors.data(), Errors.size());
+	SetOutputDescriptor(Fd);
+	for(unsigned i = 0, e = Code.size(); Ok && i != e; ++i) {
+		double Result = Code[i]();
+		// Whatever the expression printed goes out before the result
+		FlushOutput();
+		char Line[64];
+		int N = snprintf(Line, sizeof(Line), "Evaluated to %f\n", Result);
+		Ok = WriteAll(Fd, Line, N);
+	}
+	SetOutputDescriptor(-1);
+
+	pthread_mutex_lock(&EngineLock);
+	// With what was outlined from them ("__anon_expr.1.par", ...), which
+	// follows its caller in the module, so it loses its uses first
+	std::vector<Function*> Dead;
+	for(unsigned i = 0, e = Exprs.size(); i != e; ++i) {
+		std::string Prefix = Exprs[i]->getNameStr() + ".";
+		for(Module::iterator F = TheModule->begin(), E = TheModule->end(); F != E; ++F) {
+			if(F == Exprs[i] || F->getName().startswith(Prefix)) {
+				Dead.push_back(F);
+			}
+		}
+	}
+	for(unsigned i = 0, e = Dead.size(); i != e; ++i) {
+		TheExecutionEngine->freeMachineCodeForFunction(Dead[i]);
+		Dead[i]->eraseFromParent();
+	}
+	pthread_mutex_unlock(&EngineLock);
+
+	return Ok && WriteAll(Fd, "", 1);
+}
+
+static void* ClientThread(void* Arg) {
+	int Fd = (int) (intptr_t) Arg;
+	std::string Buf, Src;
+	// Starts with the engine's operators (the builtin and prelude ones)
+	Session S;
+	pthread_mutex_lock(&EngineLock);
+	S.Precedence = KBinopPrecedence;
+	pthread_mutex_unlock(&EngineLock);
+	while(ReadMessage(Fd, Buf, Src) && Serve(Fd, S, Src)) {
+	}
+	close(Fd);
+	return 0;
+}
+
+bool RunDaemon(const std::string &Path) {
+	sockaddr_un Addr;
+	memset(&Addr, 0, sizeof(Addr));
+	Addr.sun_family = AF_UNIX;
+	if(Path.size() >= sizeof(Addr.sun_path)) {
+		fprintf(stderr, "Socket path too long: %s\n", Path.c_str());
+		return false;
+	}
+	strcpy(Addr.sun_path, Path.c_str());
+
+	int Fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	// A socket left over by an earlier daemon
+	unlink(Path.c_str());
+	if(Fd < 0 || bind(Fd, (sockaddr*) &Addr, sizeof(Addr)) != 0 || listen(Fd, 64) != 0) {
+		perror("daemon");
+		return false;
+	}
+
+	TheExecutionEngine->DisableLazyCompilation(true);
+	// A client that hangs up early is only a failed write
+	signal(SIGPIPE, SIG_IGN);
+	if(TheOptions.Verbosity >= 1) {
+		fprintf(stderr, "Listening on %s\n", Path.c_str());
+	}
+
+	for(;;) {
+		int Client = accept(Fd, 0, 0);
+		if(Client < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			perror("daemon");
+			break;
+		}
+		pthread_t T;
+		if(pthread_create(&T, 0, ClientThread, (void*) (intptr_t) Client) != 0) {
+			close(Client);
+			continue;
+		}
+		pthread_detach(T);
+	}
+
+	close(Fd);
+	unlink(Path.c_str());
+	return false;
+}
+
+bool SendToDaemon(const std::string &Path, const std::string &Src, std::string &Reply) {
+	sockaddr_un Addr;
+	memset(&Addr, 0, sizeof(Addr));
+	Addr.sun_family = AF_UNIX;
+	if(Path.size() >= sizeof(Addr.sun_path)) {
+		return false;
+	}
+	strcpy(Addr.sun_path, Path.c_str());
+
+	int Fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(Fd < 0) {
+		return false;
+	}
+	std::string Buf;
+	bool Ok = connect(Fd, (sockaddr*) &Addr, sizeof(Addr)) == 0 &&
+		WriteAll(Fd, Src.c_str(), Src.size() + 1) && ReadMessage(Fd, Buf, Reply);
+	close(Fd);
+	return Ok;
+}
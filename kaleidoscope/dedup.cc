@@ -0,0 +1,167 @@
+// Merging of identical functions. Once a definition is optimized, its IR
+// is reduced to a structural signature: opcodes, types and operands,
+// with arguments, instructions and blocks by position, and calls to
+// itself marked as such, so names don't matter. A definition with the
+// signature of an earlier one becomes a thunk, a tail call to that one,
+// and later calls go to the earlier one directly. The thunk is all the
+// JIT emits for it.
+
+#include <llvm/Constants.h>
+#include <llvm/DerivedTypes.h>
+#include <llvm/Function.h>
+#include <llvm/Instructions.h>
+#include <llvm/Module.h>
+#include <llvm/Support/IRBuilder.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#include "kaleidoscope.hpp"
+#include "engine.hpp"
+
+extern Module* TheModule;
+extern EngineOptions TheOptions;
+
+typedef std::vector<uintptr_t> Signature;
+
+static std::map<Signature, Function*> Originals;
+// Name of each thunk, and the function it calls
+static std::map<std::string, Function*> Merged;
+
+// Operand kinds
+enum { OP_Argument, OP_Instruction, OP_Block, OP_Self, OP_Other };
+
+static void GetSignature(Function* F, Signature &Sig) {
+	// Operands may refer forward (phis), so number everything first
+	std::map<const Value*, uintptr_t> Numbers;
+	uintptr_t N = 0;
+	for(Function::arg_iterator AI = F->arg_begin(), E = F->arg_end(); AI != E; ++AI) {
+		Numbers[AI] = N++;
+	}
+	for(Function::iterator BB = F->begin(), E = F->end(); BB != E; ++BB) {
+		Numbers[BB] = N++;
+		for(BasicBlock::iterator I = BB->begin(), IE = BB->end(); I != IE; ++I) {
+			Numbers[I] = N++;
+		}
+	}
+
+	Sig.push_back((uintptr_t) F->getFunctionType());
+	Sig.push_back((uintptr_t) F->getAttributes().getRawPointer());
+	for(Function::iterator BB = F->begin(), E = F->end(); BB != E; ++BB) {
+		Sig.push_back(BB->size());
+		for(BasicBlock::iterator I = BB->begin(), IE = BB->end(); I != IE; ++I) {
+			Sig.push_back(I->getOpcode());
+			Sig.push_back((uintptr_t) I->getType());
+			// nsw/nuw, exact and inbounds
+			Sig.push_back(I->getRawSubclassOptionalData());
+			if(CmpInst* C = dyn_cast<CmpInst>(I)) {
+				Sig.push_back(C->getPredicate());
+			} else if(LoadInst* L = dyn_cast<LoadInst>(I)) {
+				Sig.push_back(L->isVolatile());
+				Sig.push_back(L->getAlignment());
+			} else if(StoreInst* S = dyn_cast<StoreInst>(I)) {
+				Sig.push_back(S->isVolatile());
+				Sig.push_back(S->getAlignment());
+			} else if(CallInst* CI = dyn_cast<CallInst>(I)) {
+				Sig.push_back(CI->isTailCall());
+				Sig.push_back(CI->getCallingConv());
+				Sig.push_back((uintptr_t) CI->getAttributes().getRawPointer());
+			} else if(AllocaInst* A = dyn_cast<AllocaInst>(I)) {
+				Sig.push_back(A->getAlignment());
+			}
+
+			Sig.push_back(I->getNumOperands());
+			for(User::op_iterator OI = I->op_begin(), OE = I->op_end(); OI != OE; ++OI) {
+				Value* V = *OI;
+				if(V == F) {
+					Sig.push_back(OP_Self);
+				} else if(isa<Argument>(V) || isa<Instruction>(V) || isa<BasicBlock>(V)) {
+					Sig.push_back(isa<Argument>(V) ? OP_Argument
+												: isa<Instruction>(V) ? OP_Instruction : OP_Block);
+					Sig.push_back(Numbers[V]);
+				} else {
+					// Constants and globals are uniqued, so the same one is the
+					// same pointer
+					Sig.push_back(OP_Other);
+					Sig.push_back((uintptr_t) V);
+				}
+			}
+		}
+	}
+}
+
+// Replace F's body with a tail call to Target
+static void MakeThunk(Function* F, Function* Target) {
+	F->deleteBody();
+	BasicBlock* BB = BasicBlock::Create(getGlobalContext(), "entry", F);
+	IRBuilder<> B(BB);
+	std::vector<Value*> Args;
+	for(Function::arg_iterator AI = F->arg_begin(), E = F->arg_end(); AI != E; ++AI) {
+		Args.push_back(AI);
+	}
+	CallInst* Call = B.CreateCall(Target, Args.begin(), Args.end());
+	Call->setTailCall();
+	Call->setAttributes(Target->getAttributes());
+	B.CreateRet(Call);
+}
+
+bool MergeDuplicate(Function* F) {
+	// With hot reload, every body must stay the one its slot points to.
+	// Internal functions (top-level expressions) run once, and may be
+	// freed after that.
+	if(!TheOptions.Dedup || TheOptions.HotReload ||
+		 F->getNameStr().find('.') != std::string::npos) {
+		return false;
+	}
+
+	Signature Sig;
+	GetSignature(F, Sig);
+	std::map<Signature, Function*>::iterator I = Originals.find(Sig);
+	if(I == Originals.end()) {
+		Originals[Sig] = F;
+		return false;
+	}
+
+	Function* Original = I->second;
+	MakeThunk(F, Original);
+	Merged[F->getNameStr()] = Original;
+	if(TheOptions.Verbosity >= 1) {
+		fprintf(stderr, "Merged %s into %s\n", F->getNameStr().c_str(),
+						Original->getNameStr().c_str());
+	}
+	return true;
+}
+
+Function* GetMergedFunction(Function* F) {
+	std::map<std::string, Function*>::iterator I = Merged.find(F->getNameStr());
+	return I != Merged.end() ? I->second : F;
+}
+
+void GetDedupStats(DedupStats &Out) {
+	Out.Merged = Merged.size();
+	Out.CodeBytesSaved = 0;
+	for(std::map<std::string, Function*>::iterator I = Merged.begin(), E = Merged.end();
+			I != E; ++I) {
+		// What the duplicate would have taken, less its thunk. Nothing is
+		// counted until the JIT has emitted the original.
+		FunctionMemory Thunk, Original;
+		if(GetFunctionMemory(I->second->getNameStr(), Original) &&
+			 GetFunctionMemory(I->first, Thunk) && Original.CodeBytes > Thunk.CodeBytes) {
+			Out.CodeBytesSaved += Original.CodeBytes - Thunk.CodeBytes;
+		}
+	}
+}
+
+void PrintDedupReport() {
+	fprintf(stderr, "%-24s %s\n", "function", "merged into");
+	for(std::map<std::string, Function*>::iterator I = Merged.begin(), E = Merged.end();
+			I != E; ++I) {
+		fprintf(stderr, "%-24s %s\n", I->first.c_str(), I->second->getNameStr().c_str());
+	}
+	DedupStats S;
+	GetDedupStats(S);
+	fprintf(stderr, "%u functions merged, %lu bytes of machine code saved\n", S.Merged,
+					(unsigned long) S.CodeBytesSaved);
+}
@@ -0,0 +1,206 @@
+#include <llvm/DerivedTypes.h>
+#include <llvm/ExecutionEngine/ExecutionEngine.h>
+#include <llvm/ExecutionEngine/JIT.h>
+#include <llvm/LLVMContext.h>
+#include <llvm/Module.h>
+#include <llvm/PassManager.h>
+#include <llvm/Analysis/Verifier.h>
+#include <llvm/Target/TargetData.h>
+#include <llvm/Target/TargetOptions.h>
+#include <llvm/Target/TargetSelect.h>
+#include <llvm/Transforms/Scalar.h>
+#include <llvm/Support/IRBuilder.h>
+#include <llvm/System/Host.h>
+
+#include <stdio.h>
+#include "kaleidoscope.hpp"
+#include "engine.hpp"
+
+extern std::map<char, int> KBinopPrecedence;
+extern Module* TheModule;
+
+FunctionPassManager *TheFPM;
+
+ExecutionEngine *TheExecutionEngine;
+
+EngineOptions TheOptions;
+
+static JITEventListener* ThePerfListener;
+static JITEventListener* TheMemoryListener;
+
+static std::map<std::string, HostFunction> HostFunctions;
+
+// runtime.cc
+extern "C" double printd(double x);
+extern "C" double putchard(double X);
+
+bool RegisterHostFunction(const std::string &Name, void* Addr,
+													unsigned Arity, unsigned Flags) {
+	std::map<std::string, HostFunction>::iterator I = HostFunctions.find(Name);
+	if(I != HostFunctions.end() &&
+		 (I->second.Addr != Addr || I->second.Arity != Arity)) {
+		fprintf(stderr, "Host function %s already registered\n", Name.c_str());
+		return false;
+	}
+
+	HostFunction &HF = HostFunctions[Name];
+	HF.Addr = Addr;
+	HF.Arity = Arity;
+	HF.Flags = Flags;
+	return true;
+}
+
+const HostFunction* LookupHostFunction(const std::string &Name) {
+	std::map<std::string, HostFunction>::const_iterator I = HostFunctions.find(Name);
+	if(I == HostFunctions.end()) {
+		return 0;
+	}
+	return &I->second;
+}
+
+bool InitializeEngine(const EngineOptions &Opts) {
+	TheOptions = Opts;
+	StatsEnabled = !TheOptions.StatsFile.empty();
+
+	// This is needed by the JIT
+	InitializeNativeTarget();
+
+	// Fill precedence table
+	KBinopPrecedence['='] = 2;
+	KBinopPrecedence['<'] = 10;
+	KBinopPrecedence['+'] = 20;
+	KBinopPrecedence['-'] = 20;
+	KBinopPrecedence['*'] = 40; // higher
+
+	if(TheOptions.Prelude) {
+		TheModule = LoadPrelude(*TheOptions.Prelude);
+		if(!TheModule) {
+			return false;
+		}
+	} else {
+		TheModule = new Module("cool jit", getGlobalContext());
+	}
+
+	// Read by the code generator when the JIT creates the target
+	UnsafeFPMath = TheOptions.FastMath;
+
+	// Target the host CPU, unless told otherwise
+	std::string CPU = TheOptions.CPU;
+	if(CPU.empty()) {
+		CPU = sys::getHostCPUName();
+	}
+
+	CodeGenOpt::Level OptLevel;
+	switch(TheOptions.CodegenOptLevel) {
+	case 0: OptLevel = CodeGenOpt::None; break;
+	case 1: OptLevel = CodeGenOpt::Less; break;
+	case 2: OptLevel = CodeGenOpt::Default; break;
+	default: OptLevel = CodeGenOpt::Aggressive; break;
+	}
+
+	// Create a JIT. Taks ownership of the module
+	std::string ErrStr;
+	TheExecutionEngine = EngineBuilder(TheModule)
+		.setErrorStr(&ErrStr)
+		.setOptLevel(OptLevel)
+		.setMCPU(CPU)
+		.setMAttrs(TheOptions.CPUFeatures)
+		.create();
+	if(!TheExecutionEngine) {
+		fprintf(stderr, "Could not create ExecutionEngine: %s\n", ErrStr.c_str());
+		return false;
+	}
+
+	TheMemoryListener = CreateMemoryListener();
+	TheExecutionEngine->RegisterJITEventListener(TheMemoryListener);
+
+	if(TheOptions.PerfMap || TheOptions.PerfJitDump) {
+		ThePerfListener = CreatePerfMapListener(TheOptions.PerfMap,
+																						TheOptions.PerfJitDump);
+		TheExecutionEngine->RegisterJITEventListener(ThePerfListener);
+	}
+
+	// Set up optimizing pipeline
+	TheFPM = new FunctionPassManager(TheModule);
+	// Set up the optimizer pipeline.  Start with registering info about how the
+	// target lays out data structures.
+	TheFPM->add(new TargetData(*TheExecutionEngine->getTargetData()));
+	// Promote allocas to registers. Direct SSA codegen makes none.
+	if(!TheOptions.DirectSSA) {
+		TheFPM->add(createPromoteMemoryToRegisterPass());
+	}
+	// Simple "peephole" optimizations and bit-twiddling optzns.
+	TheFPM->add(createInstructionCombiningPass());
+	// Reassociate expressions.
+	TheFPM->add(createReassociatePass());
+	// Hoist loop invariants (e.g. calls to pure host functions) out of loops.
+	TheFPM->add(createLICMPass());
+	// Version loops on invariant branches, such as the hoisted buffer
+	// bounds checks, so one copy runs without them.
+	TheFPM->add(createLoopUnswitchPass());
+	// Eliminate Common SubExpressions.
+	TheFPM->add(createGVNPass());
+	// Simplify the control flow graph (deleting unreachable blocks, etc).
+	TheFPM->add(createCFGSimplificationPass());
+
+	TheFPM->doInitialization();
+
+	// The runtime library, so externs to it need no symbol lookup
+	RegisterHostFunction("printd", (void*) printd, 1, HF_NoUnwind);
+	RegisterHostFunction("putchard", (void*) putchard, 1, HF_NoUnwind);
+
+	SetParallelThreads(TheOptions.Threads);
+	return true;
+}
+
+void ShutdownEngine() {
+	if(StatsEnabled) {
+		WriteStatsReport(TheOptions.StatsFile);
+	}
+
+	if(TheOptions.Profile) {
+		PrintProfileReport();
+	}
+
+	StopThreadPool();
+
+	delete TheFPM;
+	TheFPM = 0;
+
+	if(ThePerfListener) {
+		TheExecutionEngine->UnregisterJITEventListener(ThePerfListener);
+		delete ThePerfListener;
+		ThePerfListener = 0;
+	}
+
+	TheExecutionEngine->UnregisterJITEventListener(TheMemoryListener);
+	delete TheMemoryListener;
+	TheMemoryListener = 0;
+}
+
+void* GetFunctionPointer(const std::string &Name) {
+	if(TheOptions.HotReload) {
+		if(GlobalVariable* Slot = GetFunctionSlot(Name)) {
+			return ReadFunctionSlot(Slot);
+		}
+	}
+
+	Function* F = TheModule->getFunction(Name);
+	if(F == 0 || F->empty()) {
+		return 0;
+	}
+	return TheExecutionEngine->getPointerToFunction(F);
+}
+
+MapKernelFn GetMapKernel(const std::string &Name) {
+	Function* F = TheModule->getFunction(Name);
+	if(F == 0 || F->empty()) {
+		return 0;
+	}
+
+	Function* K = CreateMapKernel(F);
+	if(K == 0) {
+		return 0;
+	}
+	return (MapKernelFn) (intptr_t) TheExecutionEngine->getPointerToFunction(K);
+}
@@ -0,0 +1,258 @@
+// Embedding API: lets host programs drive the JIT without the REPL
+
+#ifndef DEF_KALEID_ENGINE
+#define DEF_KALEID_ENGINE
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// What a full set of a memo table gives up for a new entry
+enum MemoEvictionPolicy {
+	// The entry looked up or stored longest ago
+	ME_LRU,
+	// The entry stored longest ago
+	ME_FIFO
+};
+
+// Definitions compiled ahead of time by prelude-gen (see prelude.k):
+// their optimized IR, as bitcode, and the precedence of the binary
+// operators among them
+struct PreludeOperator {
+	// 0 ends the list
+	char Op;
+	int Precedence;
+};
+
+struct PreludeImage {
+	// Followed by a NUL, which BitcodeSize doesn't count
+	const unsigned char* Bitcode;
+	size_t BitcodeSize;
+	const PreludeOperator* Operators;
+	// What it was built from
+	const char* Source;
+};
+
+// The one main is linked with, built from prelude.k
+extern const PreludeImage StandardPrelude;
+
+// Session-wide compilation settings
+struct EngineOptions {
+	// Treat externs to well-known libm functions (sin, cos, sqrt, ...) as
+	// pure, so calls to them are folded, CSEd and hoisted out of loops
+	bool MathBuiltins;
+
+	// Give up IEEE exactness for speed in every function (not just the
+	// "fast def" ones): FP arithmetic is reassociated, and the code
+	// generator runs with UnsafeFPMath
+	bool FastMath;
+
+	// CPU the JIT generates code for. Empty means the one we're running
+	// on; give an explicit name (e.g. "x86-64") for reproducible code.
+	std::string CPU;
+
+	// Extra target features on top of the CPU's, e.g. "+avx" or "-sse41"
+	std::vector<std::string> CPUFeatures;
+
+	// Code generator optimization level, 0 to 3
+	unsigned CodegenOptLevel;
+
+	// Describe every function the JIT emits in /tmp/perf-<pid>.map, and in
+	// a jit-<pid>.dump in the current directory, for perf
+	bool PerfMap;
+	bool PerfJitDump;
+
+	// 0: errors and results only, 1: progress messages, 2: IR dumps too
+	unsigned Verbosity;
+
+	// Where ShutdownEngine writes the per-phase timings, per top-level
+	// item and for the whole session (JSON if it ends in .json, CSV
+	// otherwise). Timers are off if empty.
+	std::string StatsFile;
+
+	// Count calls and time every function (inclusive and self), and print
+	// a report at ShutdownEngine. Functions carry no instrumentation
+	// when this is off.
+	bool Profile;
+
+	// Build SSA form while generating code, instead of giving every
+	// variable an alloca and promoting them all with mem2reg afterwards
+	bool DirectSSA;
+
+	// Compute both arms of an if whose arms are a few side effect free
+	// arithmetic operations, and select the result, instead of branching
+	bool BranchlessIf;
+
+	// Allow a def to replace an existing function while the session runs.
+	// Calls go through a per-function slot holding the current code, so
+	// callers pick up the new body without being recompiled, at the cost
+	// of an indirect call. Map kernels keep the body they were built with.
+	bool HotReload;
+
+	// Threads running "parallel for" loops, the calling one included.
+	// 0 means one per core.
+	unsigned Threads;
+
+	// Entries in the table of each "memo def" function, rounded up to a
+	// power of two and at most 2^26, and which one goes when a set of
+	// them is full
+	unsigned MemoCapacity;
+	MemoEvictionPolicy MemoEviction;
+
+	// IR instructions the session may spend on clones of functions
+	// specialized for the constant arguments of a call. 0 turns call-site
+	// specialization off.
+	unsigned SpecializeBudget;
+
+	// Compile a definition whose optimized IR is the same as an earlier
+	// one's (but for the name) to a thunk calling that one. Off with
+	// HotReload.
+	bool Dedup;
+
+	// Loaded into the module before anything else, if given. Its
+	// definitions can be replaced by the session's; code compiled before
+	// that keeps calling the prelude's. Built with the default options.
+	const PreludeImage* Prelude;
+
+	EngineOptions() : MathBuiltins(true), FastMath(false), CodegenOptLevel(2),
+										PerfMap(false), PerfJitDump(false), Verbosity(0),
+										Profile(false), DirectSSA(false), BranchlessIf(true),
+										HotReload(false), Threads(0), MemoCapacity(1 << 16),
+										MemoEviction(ME_LRU), SpecializeBudget(20000),
+											Dedup(true), Prelude(0) {}
+};
+
+// Create the module, the JIT and the optimizing pipeline.
+// Must be called once before anything else.
+bool InitializeEngine(const EngineOptions &Opts = EngineOptions());
+
+void ShutdownEngine();
+
+// Parse and compile (and run the top-level expressions of) Src,
+// exactly as if it was typed at the prompt.
+// Returns false if any error was reported.
+bool EvalSource(const std::string &Src);
+
+// Change EngineOptions::Threads. Not while a parallel for is running.
+void SetParallelThreads(unsigned Threads);
+
+// Native code for an already defined function, 0 if there is none.
+// With HotReload, the body current at the time of the call.
+void* GetFunctionPointer(const std::string &Name);
+
+// Host memory for "buffer" arguments, e.g. def total(b : buffer) ...
+// The function is called with a pointer to one per buffer argument:
+//   double (*)(DoubleBuffer* b)
+// Indexing is bounds checked against Length.
+struct DoubleBuffer {
+	double* Data;
+	uint64_t Length;
+};
+
+// Batch entry point for f(a, b, ...): Out[i] = f(Cols[0][i], Cols[1][i], ...)
+// for i in [0, N). The loop runs in JITed code, with f inlined into it.
+// Only for functions of doubles (no buffers, vectors or ints). Out may
+// be one of the columns, to map a column in place.
+typedef void (*MapKernelFn)(const double* const* Cols, double* Out, uint64_t N);
+
+MapKernelFn GetMapKernel(const std::string &Name);
+
+// Host functions: native code callable from kaleidoscope. Once registered,
+// an "extern Name(...)" is bound straight to Addr (no symbol lookup) and
+// gets the attributes below, so the optimizer can reason about calls.
+// Every argument and the result are doubles.
+enum HostFunctionFlags {
+	HF_None = 0,
+	// Result depends only on the arguments, and the function has no side
+	// effects (readnone). Calls can be CSE'd and hoisted out of loops.
+	HF_Pure = 1 << 0,
+	// Never throws (nounwind)
+	HF_NoUnwind = 1 << 1
+};
+
+// Fails if Name is already registered with a different address or arity
+bool RegisterHostFunction(const std::string &Name, void* Addr,
+													unsigned Arity, unsigned Flags);
+
+// Memory accounting, per function and for the whole session. Also shown
+// by the "@memory;" and "@memory name;" REPL commands.
+struct FunctionMemory {
+	// AST of the definition (0 for generated functions like map kernels)
+	size_t ASTBytes;
+	// IR right after codegen, and after the FPM
+	unsigned IRInstructions, IRBlocks;
+	unsigned OptIRInstructions, OptIRBlocks;
+	// Machine code, 0 until the JIT emits it
+	size_t CodeBytes;
+};
+
+// False if Name was never compiled
+bool GetFunctionMemory(const std::string &Name, FunctionMemory &Out);
+
+struct SessionMemory {
+	// What the module holds now, declarations included
+	unsigned Functions;
+	unsigned IRInstructions, IRBlocks;
+	// Sum over every definition compiled
+	size_t ASTBytes;
+	// Machine code the JIT currently holds
+	size_t CodeBytes;
+};
+
+void GetSessionMemory(SessionMemory &Out);
+
+// Table of a "memo def" function, also shown by the "@memo;" REPL
+// command. False if Name has none.
+struct MemoStats {
+	uint64_t Hits, Misses;
+	// Entries given up for new ones
+	uint64_t Evictions;
+	unsigned Entries, Capacity;
+};
+
+bool GetMemoStats(const std::string &Name, MemoStats &Out);
+
+// Empty every memo table (and reset its counts)
+void ClearMemoTables();
+
+// Functions merged into an identical earlier one, also shown by the
+// "@dedup;" REPL command
+struct DedupStats {
+	unsigned Merged;
+	// Machine code of the originals, less that of the thunks, over all
+	// merges whose original the JIT has emitted
+	size_t CodeBytesSaved;
+};
+
+void GetDedupStats(DedupStats &Out);
+
+// Daemon mode (main -daemon=PATH): serve clients on a Unix domain socket
+// at Path with this engine, until the process is killed. A request is
+// source text ended by a NUL byte. The reply, ended by a NUL too, is
+// what the REPL would have printed for it: errors, printd/putchard
+// output and "Evaluated to ..." per top-level expression. Each
+// connection has its own function names and operators; a definition
+// sent again (by any client) with the same text is not compiled again.
+// Expressions of different clients run at the same time. Returns only
+// on error.
+bool RunDaemon(const std::string &Path);
+
+// One request to the daemon at Path, on a connection of its own
+bool SendToDaemon(const std::string &Path, const std::string &Src, std::string &Reply);
+
+// Output of printd/putchard is kept in a per-thread buffer, and only
+// written to stdout here. The REPL flushes after every top-level
+// expression; threads running JITed code on their own must flush
+// before exiting.
+void FlushOutput();
+
+// Where FlushOutput sends this thread's output: a file descriptor, or
+// -1 (the default) for stdout
+void SetOutputDescriptor(int Fd);
+int GetOutputDescriptor();
+
+// In binary mode printd writes the raw 8 bytes of its argument
+// instead of formatting it as text. Off by default.
+void SetBinaryOutput(bool Enable);
+
+#endif
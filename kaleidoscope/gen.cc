@@ -9,29 +9,157 @@
 #include <llvm/Target/TargetSelect.h>
 #include <llvm/Transforms/Scalar.h>
 #include <llvm/Support/IRBuilder.h>
+#include <llvm/Transforms/Utils/Cloning.h>
 
 #include <string>
 #include <vector>
 #include <map>
+#include <algorithm>
 #include <stdio.h>
 #include <cstdlib>
 #include "kaleidoscope.hpp"
+#include "engine.hpp"
 
 // CODE GENERATION
 // from http://llvm.org/releases/2.8/docs/tutorial/LangImpl3.html
 
 Module* TheModule;
+extern ExecutionEngine *TheExecutionEngine;
 static IRBuilder<> Builder(getGlobalContext());
 static std::map<std::string, AllocaInst*> NamedValues;
 
+// Set while generating a "fast def" (or any function, in a fast-math session)
+static bool FastMathMode = false;
+
+// Sets FastMathMode for the function being generated, and clears it
+// once that's done, whichever way it ends
+class FastMathScope {
+public:
+	FastMathScope(bool Enable) {
+		FastMathMode = Enable;
+	}
+	~FastMathScope() {
+		FastMathMode = false;
+	}
+};
+
+// Direct SSA construction (EngineOptions::DirectSSA): instead of an alloca,
+// each variable in scope maps to its current value. Where control flow
+// joins, variables get phis: at an if merge for those whose value differs
+// between the arms, and at a loop header for all of them. The loop phis
+// of variables the loop doesn't assign are removed once the back edge is
+// known.
+typedef std::map<std::string, Value*> SSAScope;
+static SSAScope SSAValues;
+static bool DirectSSA = false;
+
+// Buffer arguments in scope: the DoubleBuffer pointer, and its data and
+// length, loaded once where the function starts. The length is also
+// kept as a double, for bounds checks and len(b).
+struct BufferBinding {
+	Value* Ptr;
+	Value* Data;
+	Value* Length;
+	Value* LengthFP;
+};
+static std::map<std::string, BufferBinding> BufferValues;
+
+// What Name is bound to now: its alloca, or with direct SSA its value
+static Value* GetBinding(const std::string &Name) {
+	if(DirectSSA) {
+		SSAScope::iterator I = SSAValues.find(Name);
+		return I != SSAValues.end() ? I->second : 0;
+	}
+	std::map<std::string, AllocaInst*>::iterator I = NamedValues.find(Name);
+	return I != NamedValues.end() ? I->second : 0;
+}
+
+// Loops whose variable is known to stay within [Lo, Hi] in the body,
+// innermost last. A buffer access at the variable, or at a constant
+// offset from it, gets a check for the whole range in the loop's
+// preheader, which the loop branches on (see CreateBufferAccess). The
+// branch is loop invariant, so loop unswitching leaves a version of the
+// loop without the checks.
+struct LoopRange {
+	std::string Var;
+	// What Var is bound to in the loop, to tell it from one shadowing it
+	Value* Binding;
+	Value* Lo;
+	Value* Hi;
+	BasicBlock* Preheader;
+	// Checks emitted so far, by buffer, offset and width
+	std::map<std::pair<std::string, std::pair<double, unsigned> >, Value*> Checks;
+};
+static std::vector<LoopRange> LoopRanges;
+
+// Pushes the range of a loop's variable, once it is bound, for as long
+// as the body is generated. Nothing when Lo is 0: no known range.
+class LoopRangeScope {
+	bool Pushed;
+public:
+	LoopRangeScope(const std::string &Var, Value* Lo, Value* Hi, BasicBlock* Preheader)
+		: Pushed(Lo != 0) {
+		if(Pushed) {
+			LoopRange R;
+			R.Var = Var;
+			R.Binding = GetBinding(Var);
+			R.Lo = Lo;
+			R.Hi = Hi;
+			R.Preheader = Preheader;
+			LoopRanges.push_back(R);
+		}
+	}
+	~LoopRangeScope() {
+		if(Pushed) {
+			LoopRanges.pop_back();
+		}
+	}
+};
+
+// Out of bounds paths of the function being generated. They are moved
+// to its end, out of the way of the code that runs; LLVM 2.8 has no
+// cold attribute or branch weights to say so.
+static std::vector<BasicBlock*> ColdBlocks;
+
 extern FunctionPassManager *TheFPM;
+extern EngineOptions TheOptions;
+
+// Runtime (runtime.cc)
+extern "C" void BufferBoundsError(double Index, uint64_t Length);
+
+// DoubleBuffer*, see engine.hpp
+static const Type* GetBufferType() {
+	std::vector<const Type*> Fields;
+	Fields.push_back(PointerType::getUnqual(Type::getDoubleTy(getGlobalContext())));
+	Fields.push_back(Type::getInt64Ty(getGlobalContext()));
+	return PointerType::getUnqual(StructType::get(getGlobalContext(), Fields));
+}
+
+static void BindBuffer(const std::string &Name, Value* Ptr) {
+	BufferBinding B;
+	B.Ptr = Ptr;
+	B.Data = Builder.CreateLoad(Builder.CreateStructGEP(Ptr, 0), (Name + ".data").c_str());
+	B.Length = Builder.CreateLoad(Builder.CreateStructGEP(Ptr, 1), (Name + ".len").c_str());
+	B.LengthFP = Builder.CreateUIToFP(B.Length, Type::getDoubleTy(getGlobalContext()),
+																		(Name + ".lenfp").c_str());
+	BufferValues[Name] = B;
+}
+
+static void MoveColdBlocks(Function* F) {
+	for(unsigned i = 0; i != ColdBlocks.size(); ++i) {
+		if(ColdBlocks[i]->getParent() == F) {
+			ColdBlocks[i]->moveAfter(&F->back());
+			ColdBlocks.erase(ColdBlocks.begin() + i--);
+		}
+	}
+}
 
 static AllocaInst* CreateEntryBlockAlloca(Function* TheFunction, 
-																					const std::string &VarName) {
+																					const std::string &VarName,
+																					const Type* Ty = Type::getDoubleTy(getGlobalContext())) {
 	IRBuilder<> TmpB(&TheFunction->getEntryBlock(),
 									 TheFunction->getEntryBlock().begin());
-  return TmpB.CreateAlloca(Type::getDoubleTy(getGlobalContext()), 0,
-                           VarName.c_str());
+  return TmpB.CreateAlloca(Ty, 0, VarName.c_str());
 }
 
 /// CreateArgumentAllocas - Create an alloca for each argument and register the
@@ -39,8 +167,13 @@ static AllocaInst* CreateEntryBlockAlloca(Function* TheFunction,
 void PrototypeAST::CreateArgumentAllocas(Function *F) {
 	Function::arg_iterator AI = F->arg_begin();
   for (unsigned Idx = 0, e = Args.size(); Idx != e; ++Idx, ++AI) {
+		if(ArgTypes[Idx] == VT_Buffer) {
+			BindBuffer(Args[Idx], AI);
+			continue;
+		}
+
     // Create an alloca for this variable.
-    AllocaInst *Alloca = CreateEntryBlockAlloca(F, Args[Idx]);
+    AllocaInst *Alloca = CreateEntryBlockAlloca(F, Args[Idx], AI->getType());
 
     // Store the initial value into the alloca.
     Builder.CreateStore(AI, Alloca);
@@ -50,38 +183,515 @@ void PrototypeAST::CreateArgumentAllocas(Function *F) {
   }
 }
 
+void PrototypeAST::BindArguments(Function *F) {
+	Function::arg_iterator AI = F->arg_begin();
+	for(unsigned Idx = 0, e = Args.size(); Idx != e; ++Idx, ++AI) {
+		if(ArgTypes[Idx] == VT_Buffer)
+			BindBuffer(Args[Idx], AI);
+		else
+			SSAValues[Args[Idx]] = AI;
+	}
+}
+
+// Is V the current value of some variable? Then it has a use IR can't see.
+static bool IsSSAValue(Value* V) {
+	for(SSAScope::iterator I = SSAValues.begin(), E = SSAValues.end(); I != E; ++I) {
+		if(I->second == V) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Phi whose incoming values are all the same (or itself): replace it
+// with that value. Returns what replaced it, or P if it's needed.
+static Value* RemoveTrivialPhi(PHINode* P) {
+	Value* Same = 0;
+	for(unsigned i = 0, e = P->getNumIncomingValues(); i != e; ++i) {
+		Value* V = P->getIncomingValue(i);
+		if(V == P || V == Same) {
+			continue;
+		}
+		if(Same) {
+			return P;
+		}
+		Same = V;
+	}
+
+	P->replaceAllUsesWith(Same);
+	P->eraseFromParent();
+	for(SSAScope::iterator I = SSAValues.begin(), E = SSAValues.end(); I != E; ++I) {
+		if(I->second == P) {
+			I->second = Same;
+		}
+	}
+	return Same;
+}
+
 Value* ErrorV(const char* Str) {
 	Error(Str);
 	return 0;
 }
 
+static unsigned VectorWidth(Value* V) {
+	const VectorType* VT = dyn_cast<VectorType>(V->getType());
+	return VT ? VT->getNumElements() : 0;
+}
+
+static bool IsInt(Value* V) {
+	return V->getType()->isIntegerTy(64);
+}
+
+// Ints and vectors (vec4, vec8) are only known by their IR type. Where a
+// double is needed, this makes anything else an error.
+static Value* CheckNumber(Value* V) {
+	if(V && !V->getType()->isDoubleTy()) {
+		return ErrorV(IsInt(V) ? "int used as a double; convert it with double()"
+									: "vector used as a number");
+	}
+	return V;
+}
+
+// A double or an int
+static Value* CheckScalar(Value* V) {
+	if(V && VectorWidth(V)) {
+		return ErrorV("vector used as a number");
+	}
+	return V;
+}
+
+// V as a value of type Ty. Types don't change, except that a number
+// literal (or constant expression) that is a whole number can be an int.
+// 0 if that doesn't work.
+static Value* Coerce(Value* V, const Type* Ty) {
+	if(V->getType() == Ty) {
+		return V;
+	}
+	ConstantFP* C = dyn_cast<ConstantFP>(V);
+	if(C && Ty->isIntegerTy(64)) {
+		// The cast is only defined in range, which NaN isn't
+		double D = C->getValueAPF().convertToDouble();
+		if(D >= -9223372036854775808.0 && D < 9223372036854775808.0 &&
+			 D == (double) (int64_t) D) {
+			return ConstantInt::get(Ty, (int64_t) D, true);
+		}
+	}
+	return 0;
+}
+
+// Operands of an int operator: a double can only be a literal
+static bool MatchIntOperands(Value* &L, Value* &R) {
+	const Type* I64Ty = Type::getInt64Ty(getGlobalContext());
+	L = Coerce(L, I64Ty);
+	R = L ? Coerce(R, I64Ty) : 0;
+	return L && R;
+}
+
+static const char* MixedIntError = "int and double mixed; convert with int() or double()";
+
+// x in every lane
+static Value* CreateSplat(Value* X, unsigned Width) {
+	const Type* I32Ty = Type::getInt32Ty(getGlobalContext());
+	const VectorType* VT = VectorType::get(X->getType(), Width);
+	Value* V = Builder.CreateInsertElement(UndefValue::get(VT), X,
+																				 ConstantInt::get(I32Ty, 0), "splat");
+	return Builder.CreateShuffleVector(V, UndefValue::get(VT),
+																		 ConstantAggregateZero::get(VectorType::get(I32Ty, Width)),
+																		 "splat");
+}
+
+// Lanes [First, First + Width) of V
+static Value* CreateLanes(Value* V, unsigned First, unsigned Width) {
+	const Type* I32Ty = Type::getInt32Ty(getGlobalContext());
+	std::vector<Constant*> Mask;
+	for(unsigned i = 0; i != Width; ++i) {
+		Mask.push_back(ConstantInt::get(I32Ty, First + i));
+	}
+	return Builder.CreateShuffleVector(V, UndefValue::get(V->getType()),
+																		 ConstantVector::get(Mask), "lanes");
+}
+
+// Operands of an element-wise operator: a number next to a vector is
+// splatted. False if the widths don't match.
+static bool MatchOperands(Value* &L, Value* &R) {
+	unsigned LW = VectorWidth(L), RW = VectorWidth(R);
+	if(LW && RW && LW != RW) {
+		return false;
+	}
+	if(LW && !RW) R = CreateSplat(R, LW);
+	if(RW && !LW) L = CreateSplat(L, RW);
+	return true;
+}
+
+// Argument (and value) types of the language
+static const Type* GetBufferType();
+static const Type* GetValueType(ValueType Ty) {
+	const Type* DoubleTy = Type::getDoubleTy(getGlobalContext());
+	switch(Ty) {
+	case VT_Buffer: return GetBufferType();
+	case VT_Vec4: return VectorType::get(DoubleTy, 4);
+	case VT_Vec8: return VectorType::get(DoubleTy, 8);
+	case VT_Int: return Type::getInt64Ty(getGlobalContext());
+	default: return DoubleTy;
+	}
+}
+
+// A function of the engine's own runtime, bound to its address. Names
+// have a '.', so they can't clash with user functions.
+static Function* GetRuntimeFunction(const char* Name, void* Addr,
+																		const FunctionType* FT) {
+	if(Function* F = TheModule->getFunction(Name)) {
+		return F;
+	}
+
+	Function* F = Function::Create(FT, Function::ExternalLinkage, Name, TheModule);
+	F->setDoesNotThrow();
+	TheExecutionEngine->addGlobalMapping(F, Addr);
+	return F;
+}
+
+Value* ExprAST::CodegenCond() {
+	Value* V = CheckScalar(Codegen());
+	if(V == 0) return 0;
+
+	if(IsInt(V)) {
+		return Builder.CreateICmpNE(V, ConstantInt::get(V->getType(), 0), "cond");
+	}
+
+	// Convert condition to a bool by comparing equal to 0.0.
+	return Builder.CreateFCmpONE(V, ConstantFP::get(getGlobalContext(), APFloat(0.0)),
+															 "cond");
+}
+
 Value* NumberExprAST::Codegen() {
 	return ConstantFP::get(getGlobalContext(), APFloat(Val));
 }
 
-Value* VariableExprAST::Codegen() {
+// Variable holding a number or a vector? It hides a buffer of the same
+// name.
+static bool IsValueVariable(const std::string &Name) {
+	if(DirectSSA) {
+		return SSAValues.count(Name) != 0;
+	}
+	std::map<std::string, AllocaInst*>::iterator I = NamedValues.find(Name);
+	return I != NamedValues.end() && I->second;
+}
+
+static bool IsBufferVariable(const std::string &Name) {
+	return !IsValueVariable(Name) && BufferValues.count(Name);
+}
+
+// Current value of a variable in scope
+static Value* ReadVariable(const std::string &Name) {
+	if(IsBufferVariable(Name)) {
+		return ErrorV("buffer used as a number");
+	}
+
+	if(DirectSSA) {
+		SSAScope::iterator I = SSAValues.find(Name);
+		if(I == SSAValues.end()) return ErrorV("Unknown variable name");
+		return I->second;
+	}
+
 	Value* V = NamedValues[Name];
-	if(V == 0) ErrorV("Unknown variable name");
+	if(V == 0) return ErrorV("Unknown variable name");
 
 	// Load value
 	return Builder.CreateLoad(V, Name.c_str());
 }
 
+// Bind Name to V in the current scope, in a fresh variable
+static void BindVariable(const std::string &Name, Value* V) {
+	if(DirectSSA) {
+		SSAValues[Name] = V;
+		return;
+	}
+
+	AllocaInst* Alloca = CreateEntryBlockAlloca(Builder.GetInsertBlock()->getParent(),
+																							Name, V->getType());
+	Builder.CreateStore(V, Alloca);
+	NamedValues[Name] = Alloca;
+}
+
+// Name = V. A variable keeps the type it was created with.
+static Value* AssignVariable(const std::string &Name, Value* V) {
+	if(DirectSSA) {
+		SSAScope::iterator I = SSAValues.find(Name);
+		if(I == SSAValues.end()) return ErrorV("Unknown variable name");
+		if((V = Coerce(V, I->second->getType())) == 0) {
+			return ErrorV("assigned value doesn't have the type of the variable");
+		}
+		I->second = V;
+		return V;
+	}
+
+	AllocaInst* Variable = NamedValues[Name];
+	if(Variable == 0) return ErrorV("Unknown variable name");
+	if((V = Coerce(V, Variable->getAllocatedType())) == 0) {
+		return ErrorV("assigned value doesn't have the type of the variable");
+	}
+	Builder.CreateStore(V, Variable);
+	return V;
+}
+
+Value* VariableExprAST::Codegen() {
+	return ReadVariable(Name);
+}
+
+// First >= 0 and Last + Width - 1 < Length, all doubles. The compares
+// are ordered, so a NaN fails, and an index that passes converts to an
+// integer safely.
+static Value* CreateRangeCheck(IRBuilder<> &B, Value* First, Value* Last,
+															 Value* LengthFP, unsigned Width) {
+	Value* Zero = ConstantFP::get(getGlobalContext(), APFloat(0.0));
+	if(Width > 1) {
+		Last = B.CreateFAdd(Last, ConstantFP::get(getGlobalContext(), APFloat(Width - 1.0)),
+												"last");
+	}
+	return B.CreateAnd(B.CreateFCmpOGE(First, Zero), B.CreateFCmpOLT(Last, LengthFP),
+										 "inbounds");
+}
+
+// The check for all the accesses of a loop, if Index is i, i + c, c + i
+// or i - c with i the variable of a loop in LoopRanges. The index goes
+// up (or down) with i, and so does every step of the check, so checking
+// the ends of the range covers everything in between. Emitted in the
+// loop's preheader, once per buffer, offset and width; 0 if Index isn't
+// of that form.
+static Value* GetHoistedCheck(const std::string &Name, ExprAST* Index, unsigned Width) {
+	std::string Var;
+	double Offset = 0;
+	if(VariableExprAST* V = dynamic_cast<VariableExprAST*>(Index)) {
+		Var = V->getName();
+	} else if(BinaryExprAST* Bin = dynamic_cast<BinaryExprAST*>(Index)) {
+		VariableExprAST* LV = dynamic_cast<VariableExprAST*>(Bin->getLHS());
+		VariableExprAST* RV = dynamic_cast<VariableExprAST*>(Bin->getRHS());
+		NumberExprAST* LN = dynamic_cast<NumberExprAST*>(Bin->getLHS());
+		NumberExprAST* RN = dynamic_cast<NumberExprAST*>(Bin->getRHS());
+		if(Bin->getOp() == '+' && LV && RN) {
+			Var = LV->getName();
+			Offset = RN->getVal();
+		} else if(Bin->getOp() == '+' && LN && RV) {
+			Var = RV->getName();
+			Offset = LN->getVal();
+		} else if(Bin->getOp() == '-' && LV && RN) {
+			Var = LV->getName();
+			Offset = -RN->getVal();
+		}
+	}
+	if(Var.empty()) {
+		return 0;
+	}
+
+	Value* Binding = GetBinding(Var);
+	for(unsigned i = LoopRanges.size(); i != 0; --i) {
+		LoopRange &R = LoopRanges[i - 1];
+		if(R.Var != Var || R.Binding != Binding) {
+			continue;
+		}
+		Value* &Check = R.Checks[std::make_pair(Name, std::make_pair(Offset, Width))];
+		if(!Check) {
+			IRBuilder<> PB(R.Preheader, BasicBlock::iterator(R.Preheader->getTerminator()));
+			Value* C = ConstantFP::get(getGlobalContext(), APFloat(Offset));
+			Check = CreateRangeCheck(PB, PB.CreateFAdd(R.Lo, C), PB.CreateFAdd(R.Hi, C),
+															 BufferValues[Name].LengthFP, Width);
+		}
+		return Check;
+	}
+	return 0;
+}
+
+// Elements [Index, Index + Width) of a buffer: a number for a width of
+// 1, a vector otherwise. Checked against the length loaded on entry: an
+// int index with one unsigned compare (a negative index becomes a huge
+// one), a double one in floating point, before it is converted. In a
+// loop with a known range the check is done for the whole loop first
+// (GetHoistedCheck), and only redone here if that one fails. The failing
+// path reports the error and carries on, so the handler isn't noreturn.
+static Value* CreateBufferAccess(const std::string &Name, ExprAST* Index, Value* IndexV,
+																 Value* StoreVal, unsigned Width) {
+	const BufferBinding &B = BufferValues[Name];
+	const Type* IdxTy = Type::getInt64Ty(getGlobalContext());
+	const Type* DoubleTy = Type::getDoubleTy(getGlobalContext());
+	const Type* ElemTy = Width > 1 ? VectorType::get(DoubleTy, Width) : DoubleTy;
+
+	Function *TheFunction = Builder.GetInsertBlock()->getParent();
+	Value* Hoisted = IsInt(IndexV) ? 0 : GetHoistedCheck(Name, Index, Width);
+	BasicBlock* CheckBB = Hoisted ? BasicBlock::Create(getGlobalContext(), "boundscheck",
+																										 TheFunction) : 0;
+	BasicBlock* OkBB = BasicBlock::Create(getGlobalContext(), "inbounds", TheFunction);
+	BasicBlock* FailBB = BasicBlock::Create(getGlobalContext(), "outofbounds");
+	BasicBlock* MergeBB = BasicBlock::Create(getGlobalContext(), "afteraccess");
+	if(Hoisted) {
+		Builder.CreateCondBr(Hoisted, OkBB, CheckBB);
+		Builder.SetInsertPoint(CheckBB);
+	}
+
+	Value* InBounds;
+	if(IsInt(IndexV)) {
+		InBounds = Builder.CreateICmpULT(IndexV, B.Length, "inbounds");
+		if(Width > 1) {
+			Value* Last = Builder.CreateAdd(IndexV, ConstantInt::get(IdxTy, Width - 1), "last");
+			InBounds = Builder.CreateAnd(InBounds, Builder.CreateICmpULT(Last, B.Length),
+																	 "inbounds");
+		}
+	} else {
+		InBounds = CreateRangeCheck(Builder, IndexV, IndexV, B.LengthFP, Width);
+	}
+	Builder.CreateCondBr(InBounds, OkBB, FailBB);
+
+	// Vectors are only as aligned as the doubles in them
+	Builder.SetInsertPoint(OkBB);
+	Value* Idx = IsInt(IndexV) ? IndexV : Builder.CreateFPToSI(IndexV, IdxTy, "idx");
+	Value* Addr = Builder.CreateGEP(B.Data, Idx);
+	if(Width > 1) {
+		Addr = Builder.CreateBitCast(Addr, PointerType::getUnqual(ElemTy));
+	}
+	LoadInst* Elem = 0;
+	if(StoreVal) {
+		Builder.CreateStore(StoreVal, Addr)->setAlignment(8);
+	} else {
+		Elem = Builder.CreateLoad(Addr, Name.c_str());
+		Elem->setAlignment(8);
+	}
+	Builder.CreateBr(MergeBB);
+
+	TheFunction->getBasicBlockList().push_back(FailBB);
+	ColdBlocks.push_back(FailBB);
+	Builder.SetInsertPoint(FailBB);
+	std::vector<const Type*> Params;
+	Params.push_back(DoubleTy);
+	Params.push_back(IdxTy);
+	FunctionType* FT = FunctionType::get(Type::getVoidTy(getGlobalContext()),
+																			 Params, false);
+	Builder.CreateCall2(GetRuntimeFunction("buffer.bounds", (void*) BufferBoundsError, FT),
+											IsInt(IndexV) ? Builder.CreateSIToFP(IndexV, DoubleTy) : IndexV,
+											B.Length);
+	Builder.CreateBr(MergeBB);
+
+	TheFunction->getBasicBlockList().push_back(MergeBB);
+	Builder.SetInsertPoint(MergeBB);
+	if(StoreVal) {
+		return StoreVal;
+	}
+	PHINode* PN = Builder.CreatePHI(ElemTy, "elem");
+	PN->addIncoming(Elem, OkBB);
+	PN->addIncoming(Constant::getNullValue(ElemTy), FailBB);
+	return PN;
+}
+
+// b[i] on a buffer, v[i] on a lane of a vector. Lane indexes wrap
+// around the width, so they can't be out of range.
+Value* IndexExprAST::CodegenAccess(Value* StoreVal) {
+	Value* IndexV = CheckScalar(Index->Codegen());
+	if(IndexV == 0) return 0;
+
+	if(IsBufferVariable(Name)) {
+		if(StoreVal && !VectorWidth(StoreVal) && CheckNumber(StoreVal) == 0) {
+			return 0;
+		}
+		return CreateBufferAccess(Name, Index, IndexV, StoreVal,
+															StoreVal ? std::max(VectorWidth(StoreVal), 1u) : 1);
+	}
+
+	if(!IsValueVariable(Name)) {
+		return ErrorV("Unknown variable name");
+	}
+	Value* V = ReadVariable(Name);
+	unsigned Width = VectorWidth(V);
+	if(Width == 0) {
+		return ErrorV("only buffers and vectors can be indexed");
+	}
+
+	const Type* I32Ty = Type::getInt32Ty(getGlobalContext());
+	Value* Lane = IsInt(IndexV) ? Builder.CreateTrunc(IndexV, I32Ty)
+		: Builder.CreateFPToSI(IndexV, I32Ty);
+	Lane = Builder.CreateAnd(Lane, ConstantInt::get(I32Ty, Width - 1), "lane");
+	if(!StoreVal) {
+		return Builder.CreateExtractElement(V, Lane, Name.c_str());
+	}
+	if(CheckNumber(StoreVal) == 0) {
+		return 0;
+	}
+	if(AssignVariable(Name, Builder.CreateInsertElement(V, StoreVal, Lane, Name.c_str())) == 0) {
+		return 0;
+	}
+	return StoreVal;
+}
+
+Value* IndexExprAST::Codegen() {
+	return CodegenAccess(0);
+}
+
+Value* IndexExprAST::CodegenStore(Value* Val) {
+	return CodegenAccess(Val);
+}
+
+// Call to a user function or operator. With hot reload, through its
+// slot: a volatile load, so no caller ever holds on to an old body.
+// A merged function is skipped for the one it was merged into.
+static CallInst* CreateUserCall(Function* F, const std::vector<Value*> &Args,
+																const char* Name) {
+	F = GetMergedFunction(F);
+	if(TheOptions.HotReload) {
+		if(GlobalVariable* Slot = GetFunctionSlot(F->getNameStr())) {
+			Value* Target = Builder.CreateLoad(Slot, true, "target");
+			return Builder.CreateCall(Target, Args.begin(), Args.end(), Name);
+		}
+	}
+	return Builder.CreateCall(F, Args.begin(), Args.end(), Name);
+}
+
 Value* UnaryExprAST::Codegen() {
-	Value* OperandV = Operand->Codegen();
+	Value* OperandV = CheckNumber(Operand->Codegen());
 	if(OperandV == 0)
 		return 0;
 
-	Function* F = TheModule->getFunction(std::string("unary") + Opcode);
+	Function* F = TheModule->getFunction(ResolveFunctionName(std::string("unary") + Opcode));
 	if(F == 0) {
 		return ErrorV("Unknown unary operator");
 	}
 
-	return Builder.CreateCall(F, OperandV, "unop");
+	return CreateUserCall(F, std::vector<Value*>(1, OperandV), "unop");
+}
+
+// Fast-math FP add/mul: constants are moved to the top of chains of the
+// same operator, where they fold together, e.g. (x+1)+2 -> x+3 and
+// (x+1)+y -> (x+y)+1. Reassociate doesn't touch FP in this LLVM.
+// The old inner op is left dead, for instcombine to delete.
+static Value* CreateFastFPOp(Instruction::BinaryOps Opc, Value* L, Value* R,
+														 const char* Name) {
+	// Constant goes right
+	if(isa<ConstantFP>(L) && !isa<ConstantFP>(R)) {
+		std::swap(L, R);
+	}
+
+	BinaryOperator* BO = dyn_cast<BinaryOperator>(L);
+	if(BO && BO->getOpcode() == Opc && BO->use_empty() &&
+		 isa<ConstantFP>(BO->getOperand(1)) && !(DirectSSA && IsSSAValue(BO))) {
+		Value* A = BO->getOperand(0);
+		Value* C = BO->getOperand(1);
+		Value* V;
+		if(isa<ConstantFP>(R)) {
+			V = Builder.CreateBinOp(Opc, A, Builder.CreateBinOp(Opc, C, R), Name);
+		} else {
+			V = Builder.CreateBinOp(Opc, Builder.CreateBinOp(Opc, A, R), C, Name);
+		}
+		return V;
+	}
+
+	return Builder.CreateBinOp(Opc, L, R, Name);
 }
 
 Value* BinaryExprAST::Codegen() {
 	if(Op == '=') {
+		// Or a buffer element
+		if(IndexExprAST* LHSI = dynamic_cast<IndexExprAST*>(LHS)) {
+			Value* Val = RHS->Codegen();
+			if(Val == 0) return 0;
+			return LHSI->CodegenStore(Val);
+		}
+
 		// Assignment requires the LHS to be an identifier.
     VariableExprAST *LHSE = dynamic_cast<VariableExprAST*>(LHS);
     if (!LHSE)
@@ -91,12 +701,7 @@ Value* BinaryExprAST::Codegen() {
     Value *Val = RHS->Codegen();
     if (Val == 0) return 0;
 
-    // Look up the name.
-    Value *Variable = NamedValues[LHSE->getName()];
-    if (Variable == 0) return ErrorV("Unknown variable name");
-
-    Builder.CreateStore(Val, Variable);
-    return Val;
+		return AssignVariable(LHSE->getName(), Val);
 	}
 
 	Value* L = LHS->Codegen();
@@ -105,38 +710,169 @@ Value* BinaryExprAST::Codegen() {
 	if(L == 0 || R == 0) {
 		return 0;
 	}
+
+	// Builtin operators work lane by lane on vectors, and lower to the
+	// vector form of the same instruction, but for '<'. On ints they are
+	// int instructions, and '<' gives an int.
+	bool Builtin = Op == '+' || Op == '-' || Op == '*' || Op == '<';
+	if(Builtin && (IsInt(L) || IsInt(R))) {
+		if(!MatchIntOperands(L, R)) {
+			return ErrorV(MixedIntError);
+		}
+		switch(Op) {
+		case '+': return Builder.CreateAdd(L, R, "addtmp");
+		case '-': return Builder.CreateSub(L, R, "subtmp");
+		case '*': return Builder.CreateMul(L, R, "multmp");
+		default:
+			return Builder.CreateZExt(Builder.CreateICmpSLT(L, R, "cmptmp"), L->getType(),
+																"booltmp");
+		}
+	}
+
+	if(Builtin && (VectorWidth(L) || VectorWidth(R))) {
+		if(!MatchOperands(L, R)) {
+			return ErrorV("vector widths don't match");
+		}
+		switch(Op) {
+		case '+': return Builder.CreateFAdd(L, R, "addtmp");
+		case '-': return Builder.CreateFSub(L, R, "subtmp");
+		case '*': return Builder.CreateFMul(L, R, "multmp");
+		default: {
+			// 0.0/1.0 in each lane, a lane at a time: compares of vectors,
+			// and vectors of i1, aren't well supported by this LLVM's code
+			// generator. Unordered like the scalar '<', so each lane is what
+			// '<' gives on its numbers, NaN included.
+			const Type* I32Ty = Type::getInt32Ty(getGlobalContext());
+			const Type* DoubleTy = Type::getDoubleTy(getGlobalContext());
+			Value* V = UndefValue::get(L->getType());
+			for(unsigned i = 0, e = VectorWidth(L); i != e; ++i) {
+				Value* Lane = ConstantInt::get(I32Ty, i);
+				Value* C = Builder.CreateFCmpULT(Builder.CreateExtractElement(L, Lane),
+																				 Builder.CreateExtractElement(R, Lane), "cmptmp");
+				V = Builder.CreateInsertElement(V, Builder.CreateUIToFP(C, DoubleTy, "booltmp"),
+																				Lane, "booltmp");
+			}
+			return V;
+		}
+		}
+	}
+
+	if(Op == '<') {
+		// Convert bool false/true to 0.0/1.0
+		return Builder.CreateUIToFP(Builder.CreateFCmpULT(L, R, "cmptmp"),
+																Type::getDoubleTy(getGlobalContext()), "booltmp");
+	}
 	
+	if(FastMathMode) {
+		switch(Op) {
+		case '+': return CreateFastFPOp(Instruction::FAdd, L, R, "addtmp");
+		case '-':
+			if(ConstantFP* C = dyn_cast<ConstantFP>(R)) {
+				// x-c -> x+(-c), so it joins add chains
+				return CreateFastFPOp(Instruction::FAdd, L, ConstantExpr::getFNeg(C),
+															"subtmp");
+			}
+			break;
+		case '*': return CreateFastFPOp(Instruction::FMul, L, R, "multmp");
+		default: break;
+		}
+	}
+
 	switch(Op) {
 	case '+': return Builder.CreateFAdd(L, R, "addtmp");
 	case '-': return Builder.CreateFSub(L, R, "subtmp");
 	case '*': return Builder.CreateFMul(L, R, "multmp");
-	case '<':
-		L = Builder.CreateFCmpULT(L, R, "cmptmp");
-		// Convert bool false/true to 0.0/1.0
-		return Builder.CreateUIToFP(L, Type::getDoubleTy(getGlobalContext()), 
-																"booltmp");
 	default: break; //return ErrorV("Invalid binary operator");
 	}
 	
 	// If it wasnt a builtin binary operator, is must be a user defined one
 	// emit code to call it
-	Function *F = TheModule->getFunction(std::string("binary") + Op);
+	Function *F = TheModule->getFunction(ResolveFunctionName(std::string("binary") + Op));
 	assert(F && "binary operator not found");
+	if(CheckNumber(L) == 0 || CheckNumber(R) == 0) {
+		return 0;
+	}
 	
-	//Value* Ops[2] = { L, R };
-	//return Builder.CreateCall(F, Ops, "binop");
-	return Builder.CreateCall2(F, L, R, "binop");
+	std::vector<Value*> Ops;
+	Ops.push_back(L);
+	Ops.push_back(R);
+	return CreateUserCall(F, Ops, "binop");
+}
+
+Value* BinaryExprAST::CodegenCond() {
+	if(Op != '<') {
+		return ExprAST::CodegenCond();
+	}
+
+	Value* L = CheckScalar(LHS->Codegen());
+	Value* R = CheckScalar(RHS->Codegen());
+	if(L == 0 || R == 0) {
+		return 0;
+	}
+	if(IsInt(L) || IsInt(R)) {
+		if(!MatchIntOperands(L, R)) {
+			return ErrorV(MixedIntError);
+		}
+		return Builder.CreateICmpSLT(L, R, "cmptmp");
+	}
+	return Builder.CreateFCmpULT(L, R, "cmptmp");
+}
+
+// Builtin operators only: a user defined one is a call
+bool BinaryExprAST::IsSpeculatable(unsigned &Budget) const {
+	if(Op != '+' && Op != '-' && Op != '*' && Op != '<') {
+		return false;
+	}
+	if(Budget == 0) {
+		return false;
+	}
+	--Budget;
+	return LHS->IsSpeculatable(Budget) && RHS->IsSpeculatable(Budget);
+}
+
+bool IfExprAST::IsSpeculatable(unsigned &Budget) const {
+	if(Budget == 0) {
+		return false;
+	}
+	--Budget;
+	return Cond->IsSpeculatable(Budget) && Then->IsSpeculatable(Budget) &&
+		Else->IsSpeculatable(Budget);
 }
 
+// Values of the arms of an if, as the same type
+static bool MatchArms(Value* &ThenV, Value* &ElseV) {
+	if(Value* V = Coerce(ElseV, ThenV->getType())) {
+		ElseV = V;
+		return true;
+	}
+	if(Value* V = Coerce(ThenV, ElseV->getType())) {
+		ThenV = V;
+		return true;
+	}
+	return false;
+}
+
+// Operations both arms of an if may take together, and still be
+// computed unconditionally. A mispredicted branch costs about as much
+// as a handful of dependent FP operations.
+static const unsigned SelectBudget = 8;
+
 Value* IfExprAST::Codegen() {
-	//	return (Value*) 0;
-	Value *CondV = Cond->Codegen();
+	Value *CondV = Cond->CodegenCond();
   if (CondV == 0) return 0;
-  
-  // Convert condition to a bool by comparing equal to 0.0.
-  CondV = Builder.CreateFCmpONE(CondV, 
-																ConstantFP::get(getGlobalContext(), APFloat(0.0)),
-                                "ifcond");
+
+	// Small, side effect free arms: no branch at all. Nothing is assigned,
+	// so the SSA variables are the same after either arm.
+	unsigned Budget = SelectBudget;
+	if(TheOptions.BranchlessIf && Then->IsSpeculatable(Budget) &&
+		 Else->IsSpeculatable(Budget)) {
+		Value *ThenV = Then->Codegen();
+		Value *ElseV = Else->Codegen();
+		if (ThenV == 0 || ElseV == 0) return 0;
+		if (!MatchArms(ThenV, ElseV))
+			return ErrorV("then and else have different types");
+		return Builder.CreateSelect(CondV, ThenV, ElseV, "iftmp");
+	}
 	
 	Function *TheFunction = Builder.GetInsertBlock()->getParent();
   
@@ -147,6 +883,12 @@ Value* IfExprAST::Codegen() {
   BasicBlock *MergeBB = BasicBlock::Create(getGlobalContext(), "ifcont");
 
   Builder.CreateCondBr(CondV, ThenBB, ElseBB);
+
+	// Both arms start from the variables' values here
+	SSAScope BeforeValues;
+	if(DirectSSA) {
+		BeforeValues = SSAValues;
+	}
 	
   // Emit then value.
   Builder.SetInsertPoint(ThenBB);
@@ -158,12 +900,21 @@ Value* IfExprAST::Codegen() {
   // Codegen of 'Then' can change the current block, update ThenBB for the PHI.
   ThenBB = Builder.GetInsertBlock();
 
+	SSAScope ThenValues;
+	if(DirectSSA) {
+		ThenValues.swap(SSAValues);
+		SSAValues = BeforeValues;
+	}
+
 	// Emit else block.
   TheFunction->getBasicBlockList().push_back(ElseBB);
   Builder.SetInsertPoint(ElseBB);
   
   Value *ElseV = Else->Codegen();
   if (ElseV == 0) return 0;
+	// Only constants change type, so ThenBB needs no new code
+	if (!MatchArms(ThenV, ElseV))
+		return ErrorV("then and else have different types");
   
   Builder.CreateBr(MergeBB);
   // Codegen of 'Else' can change the current block, update ElseBB for the PHI.
@@ -172,16 +923,29 @@ Value* IfExprAST::Codegen() {
   // Emit merge block.
   TheFunction->getBasicBlockList().push_back(MergeBB);
   Builder.SetInsertPoint(MergeBB);
-  PHINode *PN = Builder.CreatePHI(Type::getDoubleTy(getGlobalContext()),
-                                  "iftmp");
+  PHINode *PN = Builder.CreatePHI(ThenV->getType(), "iftmp");
   
   PN->addIncoming(ThenV, ThenBB);
   PN->addIncoming(ElseV, ElseBB);
+
+	// Variables assigned in either arm
+	if(DirectSSA) {
+		for(SSAScope::iterator I = SSAValues.begin(), E = SSAValues.end(); I != E; ++I) {
+			Value* ThenVal = ThenValues[I->first];
+			if(ThenVal != I->second) {
+				PHINode* VarPN = Builder.CreatePHI(ThenVal->getType(), I->first.c_str());
+				VarPN->addIncoming(ThenVal, ThenBB);
+				VarPN->addIncoming(I->second, ElseBB);
+				I->second = VarPN;
+			}
+		}
+	}
   return PN;
 }
 
 Value *VarExprAST::Codegen() {
 	std::vector<AllocaInst *> OldBindings;
+	std::vector<Value *> OldSSABindings;
   
   Function *TheFunction = Builder.GetInsertBlock()->getParent();
 
@@ -198,11 +962,23 @@ Value *VarExprAST::Codegen() {
     if (Init) {
       InitVal = Init->Codegen();
       if (InitVal == 0) return 0;
-    } else { // If not specified, use 0.0.
+    } else if (VarTypes[i] != VT_Inferred) { // Zero of the given type
+			InitVal = Constant::getNullValue(GetValueType(VarTypes[i]));
+		} else { // If not specified, use 0.0.
       InitVal = ConstantFP::get(getGlobalContext(), APFloat(0.0));
     }
+		if (VarTypes[i] != VT_Inferred &&
+				(InitVal = Coerce(InitVal, GetValueType(VarTypes[i]))) == 0)
+			return ErrorV("initializer doesn't have the type of the variable");
+
+		if(DirectSSA) {
+			SSAScope::iterator I = SSAValues.find(VarName);
+			OldSSABindings.push_back(I != SSAValues.end() ? I->second : 0);
+			SSAValues[VarName] = InitVal;
+			continue;
+		}
     
-    AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
+    AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName, InitVal->getType());
     Builder.CreateStore(InitVal, Alloca);
 
     // Remember the old variable binding so that we can restore the binding when
@@ -218,6 +994,17 @@ Value *VarExprAST::Codegen() {
   if (BodyVal == 0) return 0;
 
 	// Pop all our variables from scope.
+	if(DirectSSA) {
+		// Backwards, in case a name is bound twice
+		for(unsigned i = VarNames.size(); i-- != 0; ) {
+			if(OldSSABindings[i])
+				SSAValues[VarNames[i].first] = OldSSABindings[i];
+			else
+				SSAValues.erase(VarNames[i].first);
+		}
+		return BodyVal;
+	}
+
   for (unsigned i = 0, e = VarNames.size(); i != e; ++i)
     NamedValues[VarNames[i].first] = OldBindings[i];
 
@@ -225,22 +1012,148 @@ Value *VarExprAST::Codegen() {
   return BodyVal;
 }
 
+// Start or step (1 if there is none) of a sequential for, as the type
+// of its variable
+static Value* CodegenLoopValue(ExprAST* E, const Type* Ty) {
+	Value* V = E ? E->Codegen() : ConstantFP::get(getGlobalContext(), APFloat(1.0));
+	if(V == 0) return 0;
+	if((V = Coerce(V, Ty)) == 0) {
+		return ErrorV("for start and step need the type of the loop variable");
+	}
+	return V;
+}
+
+static Value* CreateLoopIncrement(Value* Var, Value* StepVal) {
+	if(IsInt(Var)) {
+		return Builder.CreateAdd(Var, StepVal, "nextvar");
+	}
+	return Builder.CreateFAdd(Var, StepVal, "nextvar");
+}
+
+// Does E assign (or store into) the variable Name in scope around it?
+static bool AssignsVariable(ExprAST* E, const std::string &Name) {
+	FreeVariables FV;
+	E->CollectFreeVariables(FV);
+	return FV.Assigned.count(Name) || FV.Stored.count(Name);
+}
+
+// Can the limit of a loop be computed once, before it? Numbers, len of
+// a buffer, and builtin arithmetic on those and on variables the body
+// doesn't assign are free of side effects and don't change in the loop.
+static bool IsInvariantLimit(ExprAST* E, const FreeVariables &BodyFV) {
+	if(dynamic_cast<NumberExprAST*>(E)) {
+		return true;
+	}
+	if(VariableExprAST* V = dynamic_cast<VariableExprAST*>(E)) {
+		return !BodyFV.Assigned.count(V->getName()) && !BodyFV.Stored.count(V->getName());
+	}
+	if(BinaryExprAST* B = dynamic_cast<BinaryExprAST*>(E)) {
+		return (B->getOp() == '+' || B->getOp() == '-' || B->getOp() == '*') &&
+			IsInvariantLimit(B->getLHS(), BodyFV) && IsInvariantLimit(B->getRHS(), BodyFV);
+	}
+	CallExprAST* C = dynamic_cast<CallExprAST*>(E);
+	if(!C || C->getCallee() != "len" || C->getArgs().size() != 1) {
+		return false;
+	}
+	VariableExprAST* Arg = dynamic_cast<VariableExprAST*>(C->getArgs()[0]);
+	return Arg && IsBufferVariable(Arg->getName());
+}
+
+// 1 if V is a whole number of at most 2^52 in magnitude, where adding
+// whole numbers to it stays exact. V goes through fptosi only when it
+// is in range.
+static Value* CreateIsWhole(Value* V) {
+	const Type* DoubleTy = Type::getDoubleTy(getGlobalContext());
+	Value* Max = ConstantFP::get(getGlobalContext(), APFloat(4503599627370496.0));
+	Value* InRange = Builder.CreateAnd(Builder.CreateFCmpOLE(V, Max),
+		Builder.CreateFCmpOGE(V, Builder.CreateFNeg(Max)));
+	Value* Safe = Builder.CreateSelect(InRange, V, Constant::getNullValue(DoubleTy));
+	Value* Whole = Builder.CreateSIToFP(
+		Builder.CreateFPToSI(Safe, Type::getInt64Ty(getGlobalContext())), DoubleTy);
+	return Builder.CreateAnd(InRange, Builder.CreateFCmpOEQ(Whole, V), "whole");
+}
+
+// For a sequential loop over doubles with a step that is a positive
+// whole number, an end condition "i < limit" with a limit the body
+// can't change, and a body that doesn't assign i and uses buffers. The
+// body runs for i = start, then as long as the i before the step was <
+// limit. With start and limit whole numbers, exact as doubles, i then
+// stays in [start, max(start, limit + step - 1)]; otherwise Hi is NaN,
+// which fails every check. Emitted where the code goes, before the loop.
+bool ForExprAST::CreateRange(Value* StartVal, Value* &Lo, Value* &Hi) {
+	if(VarType != VT_Double || BufferValues.empty()) {
+		return false;
+	}
+	NumberExprAST* StepN = dynamic_cast<NumberExprAST*>(Step);
+	double StepC = Step == 0 ? 1.0 : StepN ? StepN->getVal() : 0.0;
+	if(!(StepC >= 1.0 && StepC < 1e15 && StepC == (double) (int64_t) StepC)) {
+		return false;
+	}
+	BinaryExprAST* Cond = dynamic_cast<BinaryExprAST*>(End);
+	VariableExprAST* CondVar = Cond ? dynamic_cast<VariableExprAST*>(Cond->getLHS()) : 0;
+	if(!CondVar || Cond->getOp() != '<' || CondVar->getName() != VarName) {
+		return false;
+	}
+
+	// With nothing bound, assignments to i show up too
+	FreeVariables FV;
+	Body->CollectFreeVariables(FV);
+	FreeVariables LimitFV;
+	Cond->getRHS()->CollectFreeVariables(LimitFV);
+	if(FV.Assigned.count(VarName) || FV.Stored.count(VarName) ||
+		 LimitFV.Read.count(VarName) || !IsInvariantLimit(Cond->getRHS(), FV)) {
+		return false;
+	}
+	bool UsesBuffer = false;
+	for(std::set<std::string>::iterator I = FV.Read.begin(), E = FV.Read.end(); I != E; ++I) {
+		UsesBuffer = UsesBuffer || IsBufferVariable(*I);
+	}
+	if(!UsesBuffer) {
+		return false;
+	}
+
+	Value* Limit = CheckNumber(Cond->getRHS()->Codegen());
+	if(Limit == 0) {
+		return false;
+	}
+	Value* Last = Builder.CreateFAdd(Limit, ConstantFP::get(getGlobalContext(),
+																													APFloat(StepC - 1.0)));
+	Last = Builder.CreateSelect(Builder.CreateFCmpOLT(StartVal, Limit), Last, StartVal);
+	Value* Exact = Builder.CreateAnd(CreateIsWhole(StartVal), CreateIsWhole(Limit));
+	Lo = StartVal;
+	Hi = Builder.CreateSelect(Exact, Last, ConstantFP::get(getGlobalContext(),
+																												APFloat::getNaN(APFloat::IEEEdouble)),
+														"hi");
+	return true;
+}
+
 Value* ForExprAST::Codegen() {	
+	if(Parallel) {
+		return CodegenParallel();
+	}
+	if(DirectSSA) {
+		return CodegenSSA();
+	}
+
 	// Make the new basic block for the loop header, inserting after current
   // block.
   Function *TheFunction = Builder.GetInsertBlock()->getParent();
 
 	// Create an alloca for the variable in the entry block.
-  AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
+  AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName,
+																							GetValueType(VarType));
 
 	// Emit the start code first, without 'variable' in scope.
-  Value *StartVal = Start->Codegen();
+  Value *StartVal = CodegenLoopValue(Start, GetValueType(VarType));
   if (StartVal == 0) return 0;
 	
 	// Store the value into the alloca.
   Builder.CreateStore(StartVal, Alloca);
 
-  //BasicBlock *PreheaderBB = Builder.GetInsertBlock();
+	Value *Lo = 0, *Hi = 0;
+	CreateRange(StartVal, Lo, Hi);
+
+  BasicBlock *PreheaderBB = Builder.GetInsertBlock();
   BasicBlock *LoopBB = BasicBlock::Create(getGlobalContext(), "loop", TheFunction);
   
   // Insert an explicit fall through from the current block to the LoopBB.
@@ -263,35 +1176,27 @@ Value* ForExprAST::Codegen() {
   // Emit the body of the loop.  This, like any other expr, can change the
   // current BB.  Note that we ignore the value computed by the body, but don't
   // allow an error.
-  if (Body->Codegen() == 0)
-    return 0;
-	
-	// Emit the step value.
-  Value *StepVal;
-  if (Step) {
-    StepVal = Step->Codegen();
-    if (StepVal == 0) return 0;
-  } else {
-    // If not specified, use 1.0.
-    StepVal = ConstantFP::get(getGlobalContext(), APFloat(1.0));
-  }
+	{
+		LoopRangeScope Range(VarName, Lo, Hi, PreheaderBB);
+		if (Body->Codegen() == 0)
+			return 0;
+	}
+	
+	// Emit the step value. If not specified, use 1.0.
+  Value *StepVal = CodegenLoopValue(Step, GetValueType(VarType));
+  if (StepVal == 0) return 0;
   
   //Value *NextVar = Builder.CreateFAdd(Variable, StepVal, "nextvar");
 
 	// Compute the end condition.
-  Value *EndCond = End->Codegen();
+  Value *EndCond = End->CodegenCond();
   if (EndCond == 0) return EndCond;
 
 	// Reload, increment, and restore the alloca.  This handles the case where
   // the body of the loop mutates the variable.
   Value *CurVar = Builder.CreateLoad(Alloca);
-  Value *NextVar = Builder.CreateFAdd(CurVar, StepVal, "nextvar");
+  Value *NextVar = CreateLoopIncrement(CurVar, StepVal);
   Builder.CreateStore(NextVar, Alloca);
-  
-  // Convert condition to a bool by comparing equal to 0.0.
-  EndCond = Builder.CreateFCmpONE(EndCond, 
-																	ConstantFP::get(getGlobalContext(), APFloat(0.0)),
-                                  "loopcond");
 
 	// Create the "after loop" block and insert it.
   //BasicBlock *LoopEndBB = Builder.GetInsertBlock();
@@ -316,6 +1221,435 @@ Value* ForExprAST::Codegen() {
   return Constant::getNullValue(Type::getDoubleTy(getGlobalContext()));
 }
 
+Value* ForExprAST::CodegenSSA() {
+	Function *TheFunction = Builder.GetInsertBlock()->getParent();
+
+	// Emit the start code first, without 'variable' in scope.
+	Value *StartVal = CodegenLoopValue(Start, GetValueType(VarType));
+	if (StartVal == 0) return 0;
+
+	Value *Lo = 0, *Hi = 0;
+	CreateRange(StartVal, Lo, Hi);
+
+	BasicBlock *PreheaderBB = Builder.GetInsertBlock();
+	BasicBlock *LoopBB = BasicBlock::Create(getGlobalContext(), "loop", TheFunction);
+	Builder.CreateBr(LoopBB);
+	Builder.SetInsertPoint(LoopBB);
+
+	// Any variable in scope may be assigned in the loop, so each one gets a
+	// phi here. Its back edge value is only known after the body.
+	std::vector<std::pair<std::string, PHINode*> > Phis;
+	for(SSAScope::iterator I = SSAValues.begin(), E = SSAValues.end(); I != E; ++I) {
+		PHINode *P = Builder.CreatePHI(I->second->getType(), I->first.c_str());
+		P->addIncoming(I->second, PreheaderBB);
+		I->second = P;
+		Phis.push_back(std::make_pair(I->first, P));
+	}
+
+	PHINode *Variable = Builder.CreatePHI(StartVal->getType(), VarName.c_str());
+	Variable->addIncoming(StartVal, PreheaderBB);
+
+	// The loop variable may shadow an existing one
+	SSAScope::iterator Old = SSAValues.find(VarName);
+	Value *OldVal = Old != SSAValues.end() ? Old->second : 0;
+	SSAValues[VarName] = Variable;
+
+	{
+		LoopRangeScope Range(VarName, Lo, Hi, PreheaderBB);
+		if (Body->Codegen() == 0)
+			return 0;
+	}
+
+	Value *StepVal = CodegenLoopValue(Step, StartVal->getType());
+	if (StepVal == 0) return 0;
+
+	Value *EndCond = End->CodegenCond();
+	if (EndCond == 0) return EndCond;
+
+	// The body may have assigned the loop variable
+	Value *NextVar = CreateLoopIncrement(SSAValues[VarName], StepVal);
+
+	BasicBlock *LoopEndBB = Builder.GetInsertBlock();
+	BasicBlock *AfterBB = BasicBlock::Create(getGlobalContext(), "afterloop", TheFunction);
+	Builder.CreateCondBr(EndCond, LoopBB, AfterBB);
+	Builder.SetInsertPoint(AfterBB);
+
+	Variable->addIncoming(NextVar, LoopEndBB);
+
+	if (OldVal)
+		SSAValues[VarName] = OldVal;
+	else
+		SSAValues.erase(VarName);
+
+	// Close the phis, then drop the ones of variables the loop left alone.
+	// Removing one can make another trivial, so repeat until nothing changes.
+	for(unsigned i = 0, e = Phis.size(); i != e; ++i) {
+		Phis[i].second->addIncoming(SSAValues[Phis[i].first], LoopEndBB);
+	}
+	bool Changed = true;
+	while(Changed) {
+		Changed = false;
+		for(unsigned i = 0; i != Phis.size(); ++i) {
+			if(RemoveTrivialPhi(Phis[i].second) != Phis[i].second) {
+				Phis.erase(Phis.begin() + i--);
+				Changed = true;
+			}
+		}
+	}
+
+	// for expr always returns 0.0.
+	return Constant::getNullValue(Type::getDoubleTy(getGlobalContext()));
+}
+
+
+// Iterations of i = start, start + step, ... while i < limit, as an i64:
+// ceil((limit - start) / step), 0 if that isn't positive
+static Value* CreateIterationCount(Value* StartVal, Value* Limit, Value* StepVal) {
+	const Type* IdxTy = Type::getInt64Ty(getGlobalContext());
+	Value* Span = Builder.CreateFDiv(Builder.CreateFSub(Limit, StartVal), StepVal, "span");
+	// Clamped to [0, 2^62] before fptosi, which is undefined out of range;
+	// a NaN span is no iterations
+	Value* Zero = ConstantFP::get(getGlobalContext(), APFloat(0.0));
+	Value* MaxSpan = ConstantFP::get(getGlobalContext(), APFloat(4611686018427387904.0));
+	Value* Positive = Builder.CreateFCmpOGT(Span, Zero);
+	Span = Builder.CreateSelect(Builder.CreateFCmpOLT(Span, MaxSpan), Span, MaxSpan);
+	Span = Builder.CreateSelect(Positive, Span, Zero, "span");
+	Value* Count = Builder.CreateFPToSI(Span, IdxTy, "count");
+	Value* Partial = Builder.CreateFCmpOGT(Span, Builder.CreateSIToFP(Count, Span->getType()));
+	return Builder.CreateAdd(Count, Builder.CreateZExt(Partial, IdxTy), "count");
+}
+
+// parallel for: the body becomes a function of its own,
+//   void body(double* env, i64 begin, i64 end)
+// running iterations [begin, end), and ParallelFor (parallel.cc) hands
+// out the iterations to the thread pool. The iteration count is known
+// up front: the end condition has to be "i < limit", and the limit and
+// the step are evaluated once. env holds the start, the step and the
+// variables the body reads from outside, which it may not assign.
+Value* ForExprAST::CodegenParallel() {
+	BinaryExprAST* Cond = dynamic_cast<BinaryExprAST*>(End);
+	VariableExprAST* CondVar = Cond ? dynamic_cast<VariableExprAST*>(Cond->getLHS()) : 0;
+	if(!CondVar || Cond->getOp() != '<' || CondVar->getName() != VarName) {
+		return ErrorV("parallel for needs an end condition of the form 'i < n'");
+	}
+
+	FreeVariables LimitFV;
+	Cond->getRHS()->CollectFreeVariables(LimitFV);
+	if(Step) {
+		Step->CollectFreeVariables(LimitFV);
+	}
+	if(LimitFV.Read.count(VarName)) {
+		return ErrorV("parallel for limit and step can't use the loop variable");
+	}
+
+	FreeVariables FV;
+	FV.Bound.push_back(VarName);
+	Body->CollectFreeVariables(FV);
+	// Storing into a lane of a vector assigns it, into a buffer doesn't
+	for(std::set<std::string>::iterator I = FV.Stored.begin(), E = FV.Stored.end();
+			I != E; ++I) {
+		if(!IsBufferVariable(*I)) {
+			FV.Assigned.insert(*I);
+		}
+	}
+	if(!FV.Assigned.empty()) {
+		std::string Msg = "parallel for body assigns '" + *FV.Assigned.begin() +
+			"', which all iterations share";
+		return ErrorV(Msg.c_str());
+	}
+	std::vector<std::string> Captures(FV.Read.begin(), FV.Read.end());
+
+	const Type* DoubleTy = Type::getDoubleTy(getGlobalContext());
+	const Type* IdxTy = Type::getInt64Ty(getGlobalContext());
+
+	Value *StartVal = CheckNumber(Start->Codegen());
+	if (StartVal == 0) return 0;
+	Value *Limit = CheckNumber(Cond->getRHS()->Codegen());
+	if (Limit == 0) return 0;
+	Value *StepVal = ConstantFP::get(getGlobalContext(), APFloat(1.0));
+	if (Step) {
+		StepVal = CheckNumber(Step->Codegen());
+		if (StepVal == 0) return 0;
+	}
+
+	Value* Count = CreateIterationCount(StartVal, Limit, StepVal);
+
+	Function *TheFunction = Builder.GetInsertBlock()->getParent();
+	Value* Env;
+	{
+		IRBuilder<> TmpB(&TheFunction->getEntryBlock(),
+										 TheFunction->getEntryBlock().begin());
+		Env = TmpB.CreateAlloca(DoubleTy, ConstantInt::get(Type::getInt32Ty(getGlobalContext()),
+																											 2 + Captures.size()), "env");
+	}
+	Builder.CreateStore(StartVal, Builder.CreateConstGEP1_32(Env, 0));
+	Builder.CreateStore(StepVal, Builder.CreateConstGEP1_32(Env, 1));
+	// An int, or a buffer's pointer, goes in as its bits
+	std::vector<const Type*> CaptureTypes;
+	for(unsigned i = 0, e = Captures.size(); i != e; ++i) {
+		Value* V;
+		if(IsBufferVariable(Captures[i])) {
+			V = Builder.CreatePtrToInt(BufferValues[Captures[i]].Ptr, IdxTy);
+			CaptureTypes.push_back(GetBufferType());
+		} else {
+			V = ReadVariable(Captures[i]);
+			if(V == 0) return 0;
+			if(VectorWidth(V)) {
+				std::string Msg = "parallel for body can't use vector '" + Captures[i] + "'";
+				return ErrorV(Msg.c_str());
+			}
+			CaptureTypes.push_back(V->getType());
+		}
+		Builder.CreateStore(Builder.CreateBitCast(V, DoubleTy),
+												Builder.CreateConstGEP1_32(Env, 2 + i));
+	}
+
+	// Generate the body function, in a scope of its own
+	BasicBlock* ParentBB = Builder.GetInsertBlock();
+	std::map<std::string, AllocaInst*> ParentNamedValues;
+	ParentNamedValues.swap(NamedValues);
+	SSAScope ParentSSAValues;
+	ParentSSAValues.swap(SSAValues);
+	std::map<std::string, BufferBinding> ParentBufferValues;
+	ParentBufferValues.swap(BufferValues);
+	std::vector<LoopRange> ParentLoopRanges;
+	ParentLoopRanges.swap(LoopRanges);
+
+	std::vector<const Type*> Params;
+	Params.push_back(PointerType::getUnqual(DoubleTy));
+	Params.push_back(IdxTy);
+	Params.push_back(IdxTy);
+	FunctionType* BodyTy = FunctionType::get(Type::getVoidTy(getGlobalContext()),
+																					 Params, false);
+	Function* BodyF = Function::Create(BodyTy, Function::ExternalLinkage,
+																		 TheFunction->getNameStr() + ".par", TheModule);
+	BodyF->setDoesNotAlias(1);
+	Function::arg_iterator AI = BodyF->arg_begin();
+	Value* BodyEnv = AI++;
+	Value* Begin = AI++;
+	Value* EndIdx = AI;
+	BodyEnv->setName("env");
+	Begin->setName("begin");
+	EndIdx->setName("end");
+
+	BasicBlock* EntryBB = BasicBlock::Create(getGlobalContext(), "entry", BodyF);
+	BasicBlock* LoopBB = BasicBlock::Create(getGlobalContext(), "loop", BodyF);
+	BasicBlock* AfterBB = BasicBlock::Create(getGlobalContext(), "afterloop", BodyF);
+
+	Builder.SetInsertPoint(EntryBB);
+	Value* BodyStart = Builder.CreateLoad(Builder.CreateConstGEP1_32(BodyEnv, 0), "start");
+	Value* BodyStep = Builder.CreateLoad(Builder.CreateConstGEP1_32(BodyEnv, 1), "step");
+	for(unsigned i = 0, e = Captures.size(); i != e; ++i) {
+		Value* V = Builder.CreateLoad(Builder.CreateConstGEP1_32(BodyEnv, 2 + i),
+																	Captures[i].c_str());
+		if(CaptureTypes[i] == GetBufferType()) {
+			BindBuffer(Captures[i], Builder.CreateIntToPtr(Builder.CreateBitCast(V, IdxTy),
+																										 GetBufferType()));
+		} else {
+			BindVariable(Captures[i], Builder.CreateBitCast(V, CaptureTypes[i]));
+		}
+	}
+	// The variable goes through its values at begin and end - 1, and
+	// those in between
+	Value *Lo = 0, *Hi = 0;
+	if(!BufferValues.empty() && !AssignsVariable(Body, VarName)) {
+		Value* First = Builder.CreateFAdd(BodyStart,
+			Builder.CreateFMul(Builder.CreateSIToFP(Begin, DoubleTy), BodyStep));
+		Value* Last = Builder.CreateFAdd(BodyStart,
+			Builder.CreateFMul(Builder.CreateSIToFP(Builder.CreateSub(EndIdx,
+				ConstantInt::get(IdxTy, 1)), DoubleTy), BodyStep));
+		Value* Down = Builder.CreateFCmpOLT(Last, First);
+		Lo = Builder.CreateSelect(Down, Last, First, "lo");
+		Hi = Builder.CreateSelect(Down, First, Last, "hi");
+	}
+	Builder.CreateCondBr(Builder.CreateICmpSLT(Begin, EndIdx), LoopBB, AfterBB);
+
+	Builder.SetInsertPoint(LoopBB);
+	PHINode* K = Builder.CreatePHI(IdxTy, "k");
+	K->addIncoming(Begin, EntryBB);
+	Value* IV = Builder.CreateFAdd(BodyStart,
+																 Builder.CreateFMul(Builder.CreateSIToFP(K, DoubleTy),
+																										BodyStep), VarName.c_str());
+	BindVariable(VarName, IV);
+
+	bool Ok;
+	{
+		LoopRangeScope Range(VarName, Lo, Hi, EntryBB);
+		Ok = Body->Codegen() != 0;
+	}
+	if(Ok) {
+		Value* NextK = Builder.CreateAdd(K, ConstantInt::get(IdxTy, 1), "nextk");
+		K->addIncoming(NextK, Builder.GetInsertBlock());
+		Builder.CreateCondBr(Builder.CreateICmpSLT(NextK, EndIdx), LoopBB, AfterBB);
+		Builder.SetInsertPoint(AfterBB);
+		Builder.CreateRetVoid();
+	}
+
+	NamedValues.swap(ParentNamedValues);
+	SSAValues.swap(ParentSSAValues);
+	BufferValues.swap(ParentBufferValues);
+	LoopRanges.swap(ParentLoopRanges);
+	Builder.SetInsertPoint(ParentBB);
+	if(!Ok) {
+		BodyF->eraseFromParent();
+		return 0;
+	}
+
+	MoveColdBlocks(BodyF);
+	{
+		PhaseTimer T(PH_Verify);
+		verifyFunction(*BodyF);
+	}
+	RecordFunctionIR(BodyF, 0, false);
+	{
+		PhaseTimer T(PH_Optimize);
+		TheFPM->run(*BodyF);
+	}
+	RecordFunctionIR(BodyF, 0, true);
+
+	// The JIT compiles BodyF along with this function, so the threads
+	// find it ready
+	std::vector<const Type*> RunParams;
+	RunParams.push_back(PointerType::getUnqual(BodyTy));
+	RunParams.push_back(PointerType::getUnqual(DoubleTy));
+	RunParams.push_back(IdxTy);
+	FunctionType* RunTy = FunctionType::get(Type::getVoidTy(getGlobalContext()),
+																					RunParams, false);
+	Builder.CreateCall3(GetRuntimeFunction("parallel.for", (void*) ParallelFor, RunTy),
+											BodyF, Env, Count);
+
+	// for expr always returns 0.0.
+	return Constant::getNullValue(DoubleTy);
+}
+
+// Reductions keep several independent accumulators and combine them at
+// the end: each iteration adds to (compares with) the accumulator of
+// the iteration NumAccumulators before it, so the additions don't wait
+// for each other. The accumulators rotate through the loop phis, so the
+// body is emitted once. This reassociates the reduction, and nothing
+// else; the body still runs in iteration order. Must be a power of two.
+static const unsigned NumAccumulators = 4;
+
+Value* ReduceExprAST::Combine(Value* Acc, Value* V) {
+	switch(K) {
+	case Sum: return Builder.CreateFAdd(Acc, V, "acc");
+	case Min: return Builder.CreateSelect(Builder.CreateFCmpOLT(V, Acc), V, Acc, "acc");
+	default: return Builder.CreateSelect(Builder.CreateFCmpOGT(V, Acc), V, Acc, "acc");
+	}
+}
+
+Value* ReduceExprAST::Codegen() {
+	// Otherwise direct SSA would need loop phis for those variables
+	FreeVariables FV;
+	FV.Bound.push_back(VarName);
+	Body->CollectFreeVariables(FV);
+	if(!FV.Assigned.empty()) {
+		return ErrorV("reduction body can't assign variables from outside of it");
+	}
+	for(std::set<std::string>::iterator I = FV.Stored.begin(), E = FV.Stored.end();
+			I != E; ++I) {
+		if(!IsBufferVariable(*I)) {
+			return ErrorV("reduction body can't assign variables from outside of it");
+		}
+	}
+
+	const Type* DoubleTy = Type::getDoubleTy(getGlobalContext());
+	const Type* IdxTy = Type::getInt64Ty(getGlobalContext());
+
+	Value *StartVal = CheckNumber(Start->Codegen());
+	if (StartVal == 0) return 0;
+	Value *Limit = CheckNumber(End->Codegen());
+	if (Limit == 0) return 0;
+	Value *StepVal = ConstantFP::get(getGlobalContext(), APFloat(1.0));
+	if (Step) {
+		StepVal = CheckNumber(Step->Codegen());
+		if (StepVal == 0) return 0;
+	}
+
+	Value* Count = CreateIterationCount(StartVal, Limit, StepVal);
+	Value* Identity = K == Sum ? ConstantFP::get(getGlobalContext(), APFloat(0.0))
+		: ConstantFP::get(getGlobalContext(),
+											APFloat::getInf(APFloat::IEEEdouble, K == Max));
+
+	// The variable may shadow an existing one
+	AllocaInst* OldAlloca = NamedValues.count(VarName) ? NamedValues[VarName] : 0;
+	Value* OldSSA = SSAValues.count(VarName) ? SSAValues[VarName] : 0;
+
+	Function *TheFunction = Builder.GetInsertBlock()->getParent();
+	BasicBlock* PreheaderBB = Builder.GetInsertBlock();
+	BasicBlock* LoopBB = BasicBlock::Create(getGlobalContext(), "reduce", TheFunction);
+	BasicBlock* AfterBB = BasicBlock::Create(getGlobalContext(), "afterreduce");
+
+	// The variable goes through its values at 0 and Count - 1, and those
+	// in between
+	Value *Lo = 0, *Hi = 0;
+	if(!BufferValues.empty() && !AssignsVariable(Body, VarName)) {
+		Value* Last = Builder.CreateFAdd(StartVal, Builder.CreateFMul(Builder.CreateSIToFP(
+			Builder.CreateSub(Count, ConstantInt::get(IdxTy, 1)), DoubleTy), StepVal));
+		Value* Down = Builder.CreateFCmpOLT(Last, StartVal);
+		Lo = Builder.CreateSelect(Down, Last, StartVal, "lo");
+		Hi = Builder.CreateSelect(Down, StartVal, Last, "hi");
+	}
+	Builder.CreateCondBr(Builder.CreateICmpSGT(Count, ConstantInt::get(IdxTy, 0)),
+											 LoopBB, AfterBB);
+
+	Builder.SetInsertPoint(LoopBB);
+	PHINode* Idx = Builder.CreatePHI(IdxTy, "k");
+	Idx->addIncoming(ConstantInt::get(IdxTy, 0), PreheaderBB);
+	std::vector<PHINode*> Accs;
+	for(unsigned j = 0; j != NumAccumulators; ++j) {
+		Accs.push_back(Builder.CreatePHI(DoubleTy, "acc"));
+		Accs[j]->addIncoming(Identity, PreheaderBB);
+	}
+	BindVariable(VarName, Builder.CreateFAdd(StartVal,
+		Builder.CreateFMul(Builder.CreateSIToFP(Idx, DoubleTy), StepVal), VarName.c_str()));
+
+	Value* V;
+	{
+		LoopRangeScope Range(VarName, Lo, Hi, PreheaderBB);
+		V = CheckNumber(Body->Codegen());
+	}
+	if(V) {
+		// The first accumulator takes this iteration, and goes to the back
+		std::vector<Value*> NextAccs(Accs.begin() + 1, Accs.end());
+		NextAccs.push_back(Combine(Accs[0], V));
+		Value* NextIdx = Builder.CreateAdd(Idx, ConstantInt::get(IdxTy, 1), "nextk");
+		BasicBlock* LoopEndBB = Builder.GetInsertBlock();
+		Idx->addIncoming(NextIdx, LoopEndBB);
+		for(unsigned j = 0; j != NumAccumulators; ++j) {
+			Accs[j]->addIncoming(NextAccs[j], LoopEndBB);
+		}
+		Builder.CreateCondBr(Builder.CreateICmpSLT(NextIdx, Count), LoopBB, AfterBB);
+
+		// Combine the accumulators pairwise
+		TheFunction->getBasicBlockList().push_back(AfterBB);
+		Builder.SetInsertPoint(AfterBB);
+		std::vector<Value*> Partial;
+		for(unsigned j = 0; j != NumAccumulators; ++j) {
+			PHINode* P = Builder.CreatePHI(DoubleTy, "acc");
+			P->addIncoming(Identity, PreheaderBB);
+			P->addIncoming(NextAccs[j], LoopEndBB);
+			Partial.push_back(P);
+		}
+		while(Partial.size() > 1) {
+			for(unsigned j = 0; j != Partial.size() / 2; ++j) {
+				Partial[j] = Combine(Partial[2 * j], Partial[2 * j + 1]);
+			}
+			Partial.resize(Partial.size() / 2);
+		}
+		V = Partial[0];
+	}
+
+	// Restore the unshadowed variable
+	if(DirectSSA) {
+		if(OldSSA) SSAValues[VarName] = OldSSA;
+		else SSAValues.erase(VarName);
+	} else {
+		if(OldAlloca) NamedValues[VarName] = OldAlloca;
+		else NamedValues.erase(VarName);
+	}
+	return V;
+}
 
 /*
 // old version, before mutable variables
@@ -396,8 +1730,186 @@ Value* ForExprAST::Codegen() {
 	//return 0;
 }*/
 
+// libm functions the optimizer knows about. They stay libm calls, marked
+// readnone/nounwind: constant folding of those is done by name, and the
+// attributes allow CSE and LICM. Not even sqrt goes through its
+// intrinsic, which this LLVM leaves undefined below zero where libm
+// gives a NaN.
+struct MathFunction {
+	const char* Name;
+	unsigned Arity;
+};
+
+static const MathFunction MathFunctions[] = {
+	{ "sqrt", 1 },
+	{ "sin", 1 },
+	{ "cos", 1 },
+	{ "tan", 1 },
+	{ "asin", 1 },
+	{ "acos", 1 },
+	{ "atan", 1 },
+	{ "atan2", 2 },
+	{ "sinh", 1 },
+	{ "cosh", 1 },
+	{ "tanh", 1 },
+	{ "exp", 1 },
+	{ "log", 1 },
+	{ "log10", 1 },
+	{ "pow", 2 },
+	{ "fabs", 1 },
+	{ "floor", 1 },
+	{ "ceil", 1 },
+	{ "fmod", 2 }
+};
+
+// Only plain externs qualify: not a def, nor a registered host function
+// that happens to have the same name
+static const MathFunction* GetMathFunction(Function* F) {
+	if(!TheOptions.MathBuiltins || !F->isDeclaration() ||
+		 LookupHostFunction(F->getName())) {
+		return 0;
+	}
+
+	for(unsigned i = 0; i != sizeof(MathFunctions) / sizeof(MathFunctions[0]); ++i) {
+		if(F->getName() == MathFunctions[i].Name &&
+			 F->arg_size() == MathFunctions[i].Arity) {
+			return &MathFunctions[i];
+		}
+	}
+	return 0;
+}
+
+bool IsMathFunction(Function* F) {
+	return GetMathFunction(F) != 0;
+}
+
+// vec4(x) has x in every lane, vec4(a, b, c, d) the given lanes, and
+// vec4(b, i) is b[i] to b[i+3] of a buffer. Likewise vec8.
+static Value* CodegenVector(unsigned Width, const std::vector<ExprAST*> &Args) {
+	if(Args.size() == 2) {
+		VariableExprAST* Buf = dynamic_cast<VariableExprAST*>(Args[0]);
+		if(!Buf || !IsBufferVariable(Buf->getName())) {
+			return ErrorV("expected a buffer argument");
+		}
+		Value* IndexV = CheckScalar(Args[1]->Codegen());
+		if(IndexV == 0) return 0;
+		return CreateBufferAccess(Buf->getName(), Args[1], IndexV, 0, Width);
+	}
+
+	if(Args.size() != 1 && Args.size() != Width) {
+		return ErrorV("Incorrect # arguments passed");
+	}
+	std::vector<Value*> Lanes;
+	for(unsigned i = 0, e = Args.size(); i != e; ++i) {
+		Lanes.push_back(CheckNumber(Args[i]->Codegen()));
+		if(Lanes.back() == 0) return 0;
+	}
+	if(Lanes.size() == 1) {
+		return CreateSplat(Lanes[0], Width);
+	}
+
+	const Type* I32Ty = Type::getInt32Ty(getGlobalContext());
+	Value* V = UndefValue::get(VectorType::get(Lanes[0]->getType(), Width));
+	for(unsigned i = 0; i != Width; ++i) {
+		V = Builder.CreateInsertElement(V, Lanes[i], ConstantInt::get(I32Ty, i), "vec");
+	}
+	return V;
+}
+
+// hsum(v), hmin(v), hmax(v) over the lanes of a vector. The sum adds the
+// two halves until one lane is left, log2(width) vector additions. Min
+// and max work on the lanes: selects of vectors aren't well supported
+// by this LLVM's code generator.
+static Value* CodegenHorizontal(char Kind, const std::vector<ExprAST*> &Args) {
+	if(Args.size() != 1) {
+		return ErrorV("Incorrect # arguments passed");
+	}
+	Value* V = Args[0]->Codegen();
+	if(V == 0) return 0;
+	unsigned Width = VectorWidth(V);
+	if(Width == 0) {
+		return ErrorV("expected a vector argument");
+	}
+
+	const Type* I32Ty = Type::getInt32Ty(getGlobalContext());
+	if(Kind == '+') {
+		for(; Width > 1; Width /= 2) {
+			V = Builder.CreateFAdd(CreateLanes(V, 0, Width / 2),
+														 CreateLanes(V, Width / 2, Width / 2), "hsum");
+		}
+		return Builder.CreateExtractElement(V, ConstantInt::get(I32Ty, 0), "hsum");
+	}
+
+	std::vector<Value*> Partial;
+	for(unsigned i = 0; i != Width; ++i) {
+		Partial.push_back(Builder.CreateExtractElement(V, ConstantInt::get(I32Ty, i)));
+	}
+	while(Partial.size() > 1) {
+		for(unsigned j = 0; j != Partial.size() / 2; ++j) {
+			Value* A = Partial[2 * j];
+			Value* B = Partial[2 * j + 1];
+			Value* KeepA = Kind == '<' ? Builder.CreateFCmpOLT(A, B) : Builder.CreateFCmpOGT(A, B);
+			Partial[j] = Builder.CreateSelect(KeepA, A, B, Kind == '<' ? "hmin" : "hmax");
+		}
+		Partial.resize(Partial.size() / 2);
+	}
+	return Partial[0];
+}
+
+// int(x) rounds towards zero, double(n) is exact up to 2^53. Either one
+// leaves a value of its own type alone.
+static Value* CodegenConversion(const std::string &To, const std::vector<ExprAST*> &Args) {
+	if(Args.size() != 1) {
+		return ErrorV("Incorrect # arguments passed");
+	}
+	Value* V = CheckScalar(Args[0]->Codegen());
+	if(V == 0) return 0;
+
+	if(To == "int") {
+		if(IsInt(V)) {
+			return V;
+		}
+		// fptosi is undefined out of range, so saturate: values past
+		// either end give the largest or smallest int, and NaN gives 0
+		const Type* I64Ty = Type::getInt64Ty(getGlobalContext());
+		const Type* DoubleTy = Type::getDoubleTy(getGlobalContext());
+		Value* Min = ConstantFP::get(DoubleTy, -9223372036854775808.0);
+		Value* Max = ConstantFP::get(DoubleTy, 9223372036854775808.0);
+		Value* Above = Builder.CreateFCmpOGE(V, Max, "int.above");
+		Value* Below = Builder.CreateFCmpOLT(V, Min, "int.below");
+		Value* InRange = Builder.CreateAnd(Builder.CreateFCmpOGE(V, Min),
+																			 Builder.CreateFCmpOLT(V, Max), "int.inrange");
+		Value* Safe = Builder.CreateSelect(InRange, V, ConstantFP::get(DoubleTy, 0.0));
+		Value* Out = Builder.CreateSelect(Above, ConstantInt::get(I64Ty, ~0ULL >> 1),
+			Builder.CreateSelect(Below, ConstantInt::get(I64Ty, 1ULL << 63),
+													 ConstantInt::get(I64Ty, 0)));
+		return Builder.CreateSelect(InRange, Builder.CreateFPToSI(Safe, I64Ty), Out, "int");
+	}
+	return IsInt(V) ? Builder.CreateSIToFP(V, Type::getDoubleTy(getGlobalContext()), "double")
+		: V;
+}
+
 Value* CallExprAST::Codegen() {
-	Function* CalleeF = TheModule->getFunction(Callee);
+	// len(b): length of a buffer
+	if(Callee == "len" && Args.size() == 1) {
+		VariableExprAST* Arg = dynamic_cast<VariableExprAST*>(Args[0]);
+		if(Arg && IsBufferVariable(Arg->getName())) {
+			return BufferValues[Arg->getName()].LengthFP;
+		}
+	}
+
+	Function* CalleeF = TheModule->getFunction(ResolveFunctionName(Callee));
+
+	// Vector builtins, unless a function of that name hides them
+	if(CalleeF == 0) {
+		if(Callee == "vec4") return CodegenVector(4, Args);
+		if(Callee == "vec8") return CodegenVector(8, Args);
+		if(Callee == "hsum") return CodegenHorizontal('+', Args);
+		if(Callee == "hmin") return CodegenHorizontal('<', Args);
+		if(Callee == "hmax") return CodegenHorizontal('>', Args);
+		if(Callee == "int" || Callee == "double") return CodegenConversion(Callee, Args);
+	}
+
 	if(CalleeF == 0) {
 		return ErrorV("Unknown function reference");
 	}
@@ -406,23 +1918,50 @@ Value* CallExprAST::Codegen() {
 		return ErrorV("Incorrect # arguments passed");
 	}
 
+	// Buffers are passed on as they are, by name
+	const FunctionType* FT = CalleeF->getFunctionType();
 	std::vector<Value*> ArgsV;
 	for(unsigned i = 0, e = Args.size(); i != e; ++i) {
+		if(FT->getParamType(i) == GetBufferType()) {
+			VariableExprAST* Arg = dynamic_cast<VariableExprAST*>(Args[i]);
+			if(!Arg || !IsBufferVariable(Arg->getName())) {
+				return ErrorV("expected a buffer argument");
+			}
+			ArgsV.push_back(BufferValues[Arg->getName()].Ptr);
+			continue;
+		}
+
 		ArgsV.push_back(Args[i]->Codegen());
 		if(ArgsV.back() == 0) {
 			return 0;
 		}
+		if((ArgsV.back() = Coerce(ArgsV.back(), FT->getParamType(i))) == 0) {
+			return ErrorV("argument doesn't have the type of the parameter");
+		}
+	}
+
+	if(!IsMathFunction(CalleeF)) {
+		return CreateUserCall(CalleeF, ArgsV, "calltmp");
 	}
-	return Builder.CreateCall(CalleeF, ArgsV.begin(), ArgsV.end(), "calltmp");
+
+	CallInst* Call = Builder.CreateCall(CalleeF, ArgsV.begin(), ArgsV.end(),
+																			"calltmp");
+	Call->setDoesNotAccessMemory();
+	Call->setDoesNotThrow();
+	return Call;
 }
 
 // Function code generation
+FunctionType* PrototypeAST::getFunctionType() const {
+	std::vector<const Type*> ArgTys;
+	for(unsigned i = 0, e = Args.size(); i != e; ++i) {
+		ArgTys.push_back(GetValueType(ArgTypes[i]));
+	}
+	return FunctionType::get(GetValueType(RetType), ArgTys, false);
+}
+
 Function* PrototypeAST::Codegen() {
-	std::vector<const Type*> Doubles(Args.size(), 
-																	 Type::getDoubleTy(getGlobalContext()));
-	FunctionType* FT = FunctionType::get(Type::getDoubleTy(getGlobalContext()),
-																												 Doubles,
-																												 false);
+	FunctionType* FT = getFunctionType();
 	Function* F = Function::Create(FT, Function::ExternalLinkage, Name, TheModule);
 
 	if(F->getName() != Name) {
@@ -438,6 +1977,32 @@ Function* PrototypeAST::Codegen() {
 			ErrorF("redefinition of function with different # args");
 			return 0;
 		}
+
+		if(F->getFunctionType() != FT) {
+			ErrorF("redefinition of function with different types");
+			return 0;
+		}
+	} else if(const HostFunction* HF = LookupHostFunction(Name)) {
+		// First declaration of a host function: bind it to its address
+		if(HF->Arity != Args.size()) {
+			F->eraseFromParent();
+			ErrorF("wrong # args for host function");
+			return 0;
+		}
+		std::vector<const Type*> Doubles(Args.size(), Type::getDoubleTy(getGlobalContext()));
+		if(FT != FunctionType::get(Type::getDoubleTy(getGlobalContext()), Doubles, false)) {
+			F->eraseFromParent();
+			ErrorF("host functions take and return doubles");
+			return 0;
+		}
+
+		TheExecutionEngine->addGlobalMapping(F, HF->Addr);
+		if(HF->Flags & HF_Pure) {
+			F->setDoesNotAccessMemory();
+		}
+		if(HF->Flags & HF_NoUnwind) {
+			F->setDoesNotThrow();
+		}
 	}
 
 	unsigned Idx = 0;
@@ -453,46 +2018,377 @@ Function* PrototypeAST::Codegen() {
 	return F;
 }
 
+// The new body gets a name of its own ("fib.v", "fib.v1", ...); it
+// replaces the old one in the slot once compiled
+Function* PrototypeAST::CodegenRedefinition() {
+	Function* Old = TheModule->getFunction(Name);
+	if(Old->arg_size() != Args.size()) {
+		ErrorF("redefinition of function with different # args");
+		return 0;
+	}
+	if(Old->getFunctionType() != getFunctionType()) {
+		ErrorF("redefinition of function with different types");
+		return 0;
+	}
+
+	Function* F = Function::Create(Old->getFunctionType(), Function::ExternalLinkage,
+																 Name + ".v", TheModule);
+	unsigned Idx = 0;
+	for(Function::arg_iterator AI = F->arg_begin(); Idx != Args.size(); ++AI, ++Idx) {
+		AI->setName(Args[Idx]);
+	}
+	return F;
+}
+
 extern std::map<char, int> KBinopPrecedence;
 
+// Value of a function body, as the return type. Top-level expressions
+// return doubles, so an int one is converted.
+static Value* CodegenResult(ExprAST* Body, Function* F, bool TopLevel) {
+	Value* V = Body->Codegen();
+	if(V == 0) return 0;
+
+	const Type* RetTy = F->getReturnType();
+	if(IsInt(V) && RetTy->isDoubleTy() && TopLevel) {
+		return Builder.CreateSIToFP(V, RetTy, "result");
+	}
+	if(Value* R = Coerce(V, RetTy)) {
+		return R;
+	}
+	return ErrorV(VectorWidth(V) ? "vector used as a number"
+								: "result doesn't have the function's return type");
+}
+
+// ProfileEnter/ProfileExit, bound to the runtime's copies
+static void EmitProfileHook(const char* Name, void* Addr, unsigned Id) {
+	std::vector<const Type*> Params(1, Type::getInt32Ty(getGlobalContext()));
+	FunctionType* FT = FunctionType::get(Type::getVoidTy(getGlobalContext()),
+																			 Params, false);
+	Builder.CreateCall(GetRuntimeFunction(Name, Addr, FT),
+										 ConstantInt::get(Type::getInt32Ty(getGlobalContext()), Id));
+}
+
+// Address of the memo table of Name (F is its new body, "Name.v" under
+// hot reload), as an i8*. The global holding it is an external
+// declaration bound to the table, so code compiled against it needs no
+// load.
+static Value* GetMemoTableAddress(const std::string &Name, Function* F) {
+	void* Table = GetMemoTable(Name, F->arg_size());
+	GlobalVariable* GV = TheModule->getGlobalVariable(Name + ".memo");
+	if(GV == 0) {
+		GV = new GlobalVariable(*TheModule, Type::getInt8Ty(getGlobalContext()), false,
+														GlobalValue::ExternalLinkage, 0, Name + ".memo");
+		TheExecutionEngine->addGlobalMapping(GV, Table);
+	} else {
+		// Same table unless the arity changed
+		TheExecutionEngine->updateGlobalMapping(GV, Table);
+	}
+	return GV;
+}
+
+// Store the bits of F's arguments in Keys, look them up in Table and
+// return straight away on a hit. Leaves the builder where a miss goes.
+static void EmitMemoLookup(Function* F, Value* Table, Value* Keys, unsigned ProfileId) {
+	const Type* I64Ty = Type::getInt64Ty(getGlobalContext());
+	const Type* I64PtrTy = PointerType::getUnqual(I64Ty);
+	unsigned i = 0;
+	for(Function::arg_iterator AI = F->arg_begin(), E = F->arg_end(); AI != E; ++AI, ++i) {
+		Builder.CreateStore(Builder.CreateBitCast(AI, I64Ty),
+												Builder.CreateConstGEP2_32(Keys, 0, i));
+	}
+	AllocaInst* Result = CreateEntryBlockAlloca(F, "memo.result", I64Ty);
+
+	std::vector<const Type*> Params;
+	Params.push_back(Table->getType());
+	Params.push_back(I64PtrTy);
+	Params.push_back(I64PtrTy);
+	FunctionType* FT = FunctionType::get(Type::getInt32Ty(getGlobalContext()), Params, false);
+	Value* Found = Builder.CreateCall3(GetRuntimeFunction("memo.lookup", (void*) MemoLookup, FT),
+																		 Table, Builder.CreateConstGEP2_32(Keys, 0, 0),
+																		 Result, "found");
+
+	BasicBlock* HitBB = BasicBlock::Create(getGlobalContext(), "memo.hit", F);
+	BasicBlock* MissBB = BasicBlock::Create(getGlobalContext(), "memo.miss", F);
+	Builder.CreateCondBr(Builder.CreateICmpNE(Found, ConstantInt::get(Found->getType(), 0)),
+											 HitBB, MissBB);
+
+	Builder.SetInsertPoint(HitBB);
+	Value* Bits = Builder.CreateLoad(Result, "bits");
+	if(TheOptions.Profile) {
+		EmitProfileHook("profile.exit", (void*) ProfileExit, ProfileId);
+	}
+	Builder.CreateRet(Builder.CreateBitCast(Bits, F->getReturnType()));
+
+	Builder.SetInsertPoint(MissBB);
+}
+
+static void EmitMemoStore(Value* Table, Value* Keys, Value* RetVal) {
+	const Type* I64Ty = Type::getInt64Ty(getGlobalContext());
+	std::vector<const Type*> Params;
+	Params.push_back(Table->getType());
+	Params.push_back(PointerType::getUnqual(I64Ty));
+	Params.push_back(I64Ty);
+	FunctionType* FT = FunctionType::get(Type::getVoidTy(getGlobalContext()), Params, false);
+	Builder.CreateCall3(GetRuntimeFunction("memo.store", (void*) MemoStore, FT),
+											Table, Builder.CreateConstGEP2_32(Keys, 0, 0),
+											Builder.CreateBitCast(RetVal, I64Ty));
+}
+
 Function* FunctionAST::Codegen() {
+	PhaseTimer T(PH_IRGen);
 	NamedValues.clear();
+	SSAValues.clear();
+	BufferValues.clear();
+	ColdBlocks.clear();
+	DirectSSA = TheOptions.DirectSSA;
+	FastMathScope FastMathS(TheOptions.FastMath || FastMath);
+
+	if(LookupHostFunction(Proto->getName())) {
+		ErrorF("can't define a body for a host function");
+		return 0;
+	}
 	
-	Function* TheFunction = Proto->Codegen();
+	// Names with a '.' are internal (top-level expressions): no slots
+	const std::string &Name = Proto->getName();
+	Function* OldPrelude = ReplacePreludeFunction(Name);
+	bool Hot = TheOptions.HotReload && Name.find('.') == std::string::npos;
+	Function* Existing = TheModule->getFunction(Name);
+	bool Redefinition = Hot && Existing && !Existing->empty();
+
+	Function* TheFunction = Redefinition ? Proto->CodegenRedefinition()
+		: Proto->Codegen();
 	if(TheFunction == 0) {
+		if(OldPrelude) {
+			RestorePreludeFunction(OldPrelude, Name);
+		}
 		return 0;
 	}
 
+	// Created before the body, so recursive calls go through it too
+	GlobalVariable* NewSlot = 0;
+	if(Hot && !GetFunctionSlot(Name)) {
+		NewSlot = CreateFunctionSlot(TheFunction);
+	}
+
 	// If this is an operator, install it
+	int OldPrecedence = 0;
 	if(Proto->isBinaryOp()) {
+		OldPrecedence = KBinopPrecedence[Proto->getOperatorName()];
 		KBinopPrecedence[Proto->getOperatorName()] = Proto->getBinaryPrecedence();
 	}
 
+	// Keys are bits, so -0.0 and 0.0 (and NaNs) are told apart
+	bool MemoArgsOk = true;
+	if(Memo) {
+		for(Function::arg_iterator AI = TheFunction->arg_begin(), E = TheFunction->arg_end();
+				AI != E; ++AI) {
+			if(!AI->getType()->isDoubleTy() && !AI->getType()->isIntegerTy(64)) {
+				MemoArgsOk = false;
+			}
+		}
+	}
+
 	// Create a new basic block to start insert into.
 	BasicBlock* BB = BasicBlock::Create(getGlobalContext(), "entry", TheFunction);
 	Builder.SetInsertPoint(BB);
 
   // Add all arguments to the symbol table and create their allocas.
-  Proto->CreateArgumentAllocas(TheFunction);
+	if(DirectSSA)
+		Proto->BindArguments(TheFunction);
+	else
+		Proto->CreateArgumentAllocas(TheFunction);
+
+	unsigned ProfileId = 0;
+	if(TheOptions.Profile) {
+		ProfileId = GetProfileId(TheFunction->getNameStr());
+		EmitProfileHook("profile.enter", (void*) ProfileEnter, ProfileId);
+	}
+
+	Value* MemoTable = 0;
+	Value* MemoKeys = 0;
+	if(Memo && MemoArgsOk) {
+		MemoTable = GetMemoTableAddress(Name, TheFunction);
+		unsigned Arity = std::max((unsigned) TheFunction->arg_size(), 1U);
+		MemoKeys = CreateEntryBlockAlloca(TheFunction, "memo.keys",
+			ArrayType::get(Type::getInt64Ty(getGlobalContext()), Arity));
+		EmitMemoLookup(TheFunction, MemoTable, MemoKeys, ProfileId);
+	}
+
+	Value* RetVal = 0;
+	if(!MemoArgsOk) {
+		ErrorF("memo def takes numbers only");
+	} else {
+		RetVal = CodegenResult(Body, TheFunction, TopLevel);
+	}
 
-	if(Value* RetVal = Body->Codegen()) {
+	if(RetVal) {
+		if(MemoTable) {
+			EmitMemoStore(MemoTable, MemoKeys, RetVal);
+		}
+		if(TheOptions.Profile) {
+			EmitProfileHook("profile.exit", (void*) ProfileExit, ProfileId);
+		}
 		Builder.CreateRet(RetVal);
+		MoveColdBlocks(TheFunction);
 
 		// Validate (check consistency)
-		verifyFunction(*TheFunction);
+		{
+			PhaseTimer T(PH_Verify);
+			verifyFunction(*TheFunction);
+		}
+
+		// Before the FPM, so it can use the attributes on calls in this
+		// function, recursive ones included. Top-level expressions can't
+		// be called, so they needn't be known.
+		if(Name.find('.') == std::string::npos) {
+			std::vector<std::string> Callees;
+			CollectCallees(Callees);
+			for(unsigned i = 0, e = Callees.size(); i != e; ++i) {
+				Callees[i] = ResolveFunctionName(Callees[i]);
+			}
+			InferPurity(Name, Callees);
+		}
 
-		// optimize function!
-		fprintf(stderr, "Optimizing function ...\n");
-		TheFPM->run(*TheFunction);
-		fprintf(stderr, "Function optimized...\n");
+		// A remembered result would hide the side effects of later calls
+		std::string Reason;
+		if(Memo && !IsPure(Name, Reason)) {
+			std::string Msg = "memo def of a function that isn't pure (" + Reason + ")";
+			ErrorF(Msg.c_str());
+			ForgetPurity(Name);
+		} else {
+			size_t ASTBytes = MemoryUsage();
+			RecordFunctionIR(TheFunction, ASTBytes, false);
 
-		return TheFunction;
+			// optimize function!
+			if(TheOptions.Verbosity >= 1) {
+				fprintf(stderr, "Optimizing function ...\n");
+			}
+			{
+				PhaseTimer T(PH_Optimize);
+				TheFPM->run(*TheFunction);
+				SpecializeCalls(TheFunction);
+				MergeDuplicate(TheFunction);
+			}
+			if(TheOptions.Verbosity >= 1) {
+				fprintf(stderr, "Function optimized...\n");
+			}
+			RecordFunctionIR(TheFunction, ASTBytes, true);
+
+			if(Hot) {
+				PublishFunction(Name, TheFunction);
+			}
+			return TheFunction;
+		}
 	}
 
 	TheFunction->eraseFromParent();
+	if(NewSlot) {
+		NewSlot->eraseFromParent();
+	}
+	if(OldPrelude) {
+		RestorePreludeFunction(OldPrelude, Name);
+	}
 
-  if(Proto->isBinaryOp())
-    KBinopPrecedence.erase(Proto->getOperatorName());
+	// A failed redefinition leaves the operator as it was
+  if(Proto->isBinaryOp()) {
+		if(Redefinition || OldPrelude)
+			KBinopPrecedence[Proto->getOperatorName()] = OldPrecedence;
+		else
+			KBinopPrecedence.erase(Proto->getOperatorName());
+	}
 
 	return 0;
 }
+
+Function* CreateMapKernel(Function* F) {
+	if(!F->getReturnType()->isDoubleTy()) {
+		return 0;
+	}
+	for(Function::arg_iterator AI = F->arg_begin(), E = F->arg_end(); AI != E; ++AI) {
+		if(!AI->getType()->isDoubleTy()) {
+			return 0;
+		}
+	}
+
+	std::string Name = F->getNameStr() + ".map";
+	// '.' can't appear in a kaleidoscope identifier, so this can't clash
+	if(Function* K = TheModule->getFunction(Name)) {
+		return K;
+	}
+
+	const Type* DoubleTy = Type::getDoubleTy(getGlobalContext());
+	const Type* DoublePtrTy = PointerType::getUnqual(DoubleTy);
+	const Type* IdxTy = Type::getInt64Ty(getGlobalContext());
+
+	// void (double** cols, double* out, i64 n)
+	std::vector<const Type*> Params;
+	Params.push_back(PointerType::getUnqual(DoublePtrTy));
+	Params.push_back(DoublePtrTy);
+	Params.push_back(IdxTy);
+	FunctionType* FT = FunctionType::get(Type::getVoidTy(getGlobalContext()),
+																			 Params, false);
+	Function* K = Function::Create(FT, Function::ExternalLinkage, Name, TheModule);
+
+	Function::arg_iterator AI = K->arg_begin();
+	Value* Cols = AI++;
+	Value* Out = AI++;
+	Value* N = AI;
+	Cols->setName("cols");
+	Out->setName("out");
+	N->setName("n");
+	// No noalias on out: it may be one of the columns (an in place map).
+	// The column pointers are loaded once anyway, before the loop.
+	K->setDoesNotThrow();
+
+	BasicBlock* EntryBB = BasicBlock::Create(getGlobalContext(), "entry", K);
+	BasicBlock* LoopBB = BasicBlock::Create(getGlobalContext(), "loop", K);
+	BasicBlock* AfterBB = BasicBlock::Create(getGlobalContext(), "afterloop", K);
+
+	// Load the column pointers once, outside of the loop
+	Builder.SetInsertPoint(EntryBB);
+	std::vector<Value*> ColPtrs;
+	for(unsigned i = 0, e = F->arg_size(); i != e; ++i) {
+		ColPtrs.push_back(Builder.CreateLoad(Builder.CreateConstGEP1_32(Cols, i),
+																				 "col"));
+	}
+	Value* IsEmpty = Builder.CreateICmpEQ(N, ConstantInt::get(IdxTy, 0), "isempty");
+	Builder.CreateCondBr(IsEmpty, AfterBB, LoopBB);
+
+	Builder.SetInsertPoint(LoopBB);
+	PHINode* Row = Builder.CreatePHI(IdxTy, "i");
+	Row->addIncoming(ConstantInt::get(IdxTy, 0), EntryBB);
+
+	std::vector<Value*> ArgsV;
+	for(unsigned i = 0, e = ColPtrs.size(); i != e; ++i) {
+		ArgsV.push_back(Builder.CreateLoad(Builder.CreateGEP(ColPtrs[i], Row), "x"));
+	}
+	CallInst* Call = Builder.CreateCall(F, ArgsV.begin(), ArgsV.end(), "row");
+	Builder.CreateStore(Call, Builder.CreateGEP(Out, Row));
+
+	Value* NextRow = Builder.CreateAdd(Row, ConstantInt::get(IdxTy, 1), "nexti");
+	Row->addIncoming(NextRow, LoopBB);
+	Value* LoopCond = Builder.CreateICmpULT(NextRow, N, "loopcond");
+	Builder.CreateCondBr(LoopCond, LoopBB, AfterBB);
+
+	Builder.SetInsertPoint(AfterBB);
+	Builder.CreateRetVoid();
+
+	{
+		PhaseTimer T(PH_Verify);
+		verifyFunction(*K);
+	}
+
+	// Get rid of the per-row call, so the optimizer sees the whole row
+	// computation inside the loop. Externs just stay as calls.
+	InlineFunctionInfo IFI;
+	InlineFunction(Call, IFI);
+	RecordFunctionIR(K, 0, false);
+
+	{
+		PhaseTimer T(PH_Optimize);
+		TheFPM->run(*K);
+	}
+	RecordFunctionIR(K, 0, true);
+
+	return K;
+}
@@ -0,0 +1,61 @@
+// Hot redefinition, for sessions with EngineOptions::HotReload. Every
+// user function has a slot: a global holding the address of its current
+// machine code. Calls to it load the slot and call through it. A new
+// definition is compiled under a name of its own, and its address then
+// replaces the old one in the slot, so callers are never recompiled.
+// A thread already inside the old code finishes that call there; old
+// versions are never freed.
+
+#include <llvm/DerivedTypes.h>
+#include <llvm/GlobalVariable.h>
+#include <llvm/Module.h>
+#include <llvm/ExecutionEngine/ExecutionEngine.h>
+
+#include <stdio.h>
+#include "kaleidoscope.hpp"
+#include "engine.hpp"
+
+extern Module* TheModule;
+extern ExecutionEngine* TheExecutionEngine;
+extern EngineOptions TheOptions;
+
+// '.' can't appear in a kaleidoscope identifier, so this can't clash
+static std::string SlotName(const std::string &Name) {
+	return Name + ".slot";
+}
+
+GlobalVariable* GetFunctionSlot(const std::string &Name) {
+	return TheModule->getGlobalVariable(SlotName(Name));
+}
+
+GlobalVariable* CreateFunctionSlot(Function* F) {
+	const Type* SlotTy = PointerType::getUnqual(F->getFunctionType());
+	return new GlobalVariable(*TheModule, SlotTy, false,
+														GlobalValue::ExternalLinkage,
+														Constant::getNullValue(SlotTy),
+														SlotName(F->getNameStr()));
+}
+
+void* ReadFunctionSlot(GlobalVariable* Slot) {
+	return *(void* volatile*) TheExecutionEngine->getPointerToGlobal(Slot);
+}
+
+void PublishFunction(const std::string &Name, Function* F) {
+	void* Code;
+	{
+		PhaseTimer T(PH_Emit);
+		Code = TheExecutionEngine->getPointerToFunction(F);
+	}
+
+	// The JIT has flushed the new code out by now. One aligned store
+	// switches every later call over; the barrier keeps it after the
+	// writes of the code.
+	void** Slot = (void**) TheExecutionEngine->getPointerToGlobal(GetFunctionSlot(Name));
+	__sync_synchronize();
+	void* Old = __sync_lock_test_and_set(Slot, Code);
+
+	if(Old && TheOptions.Verbosity >= 1) {
+		fprintf(stderr, "Swapped %s over to %s\n", Name.c_str(),
+						F->getNameStr().c_str());
+	}
+}
@@ -9,20 +9,71 @@
 //#include <llvm/Module.h>
 //#include <llvm/Analysis/Verifier.h>
 #include <llvm/Support/IRBuilder.h>
+#include <llvm/GlobalVariable.h>
+#include <llvm/ExecutionEngine/JITEventListener.h>
 #include <string>
 #include <vector>
 #include <map>
+#include <set>
+#include <algorithm>
+#include <stdint.h>
 
 using namespace llvm;
 
 int getNextToken();
 
+// Types in annotations, "name : type". Unannotated arguments, results
+// and loop variables are doubles; variables take the type of their
+// initializer.
+enum ValueType {
+	VT_Double,
+	// Host memory: pointer to a DoubleBuffer (engine.hpp)
+	VT_Buffer,
+	// <4 x double>, <8 x double>
+	VT_Vec4,
+	VT_Vec8,
+	// i64
+	VT_Int,
+	// var without annotation
+	VT_Inferred
+};
+
+// "double", "buffer", "vec4", "vec8", "int"; false if Name is no type
+bool ParseTypeName(const std::string &Name, ValueType &Ty);
+
+// Variables an expression uses from outside of itself
+struct FreeVariables {
+	// Bound inside the expression, innermost last
+	std::vector<std::string> Bound;
+	std::set<std::string> Read;
+	std::set<std::string> Assigned;
+	// Stored into through [] (a buffer, or a lane of a vector)
+	std::set<std::string> Stored;
+
+	bool IsBound(const std::string &Name) const {
+		return std::find(Bound.begin(), Bound.end(), Name) != Bound.end();
+	}
+};
+
 // Base class for all expression nodes
-// All values are double, so no need for "type" field
+// Values are doubles, or vectors of them; only the IR knows which
 class ExprAST {
 public:
 	virtual ~ExprAST() {};
 	virtual Value* Codegen() = 0;
+	// As the condition of an if/for: i1, true if the value is nonzero.
+	// Comparisons give their i1 directly, without a round trip through
+	// 0.0/1.0.
+	virtual Value* CodegenCond();
+	// Free of side effects, and cheap enough to evaluate even when the
+	// result isn't needed. Takes its cost out of Budget; false if it
+	// doesn't fit.
+	virtual bool IsSpeculatable(unsigned &Budget) const { return false; }
+	// Bytes taken by this node and its children (approximate)
+	virtual size_t MemoryUsage() const = 0;
+	// Names of the functions and operators this node and its children call
+	virtual void CollectCallees(std::vector<std::string> &Callees) const = 0;
+	virtual void CollectFreeVariables(FreeVariables &FV) const = 0;
 };
 
 // Number AST - for numberals like "1.0"
@@ -30,7 +81,12 @@ class NumberExprAST : public ExprAST {
 	double Val;
 public:
 	NumberExprAST(double val) : Val(val) {}
+	double getVal() const { return Val; }
 	virtual Value* Codegen();
+	virtual bool IsSpeculatable(unsigned &Budget) const { return true; }
+	virtual size_t MemoryUsage() const;
+	virtual void CollectCallees(std::vector<std::string> &Callees) const;
+	virtual void CollectFreeVariables(FreeVariables &FV) const;
 };
 
 class VariableExprAST : public ExprAST {
@@ -38,6 +94,10 @@ class VariableExprAST : public ExprAST {
 public:
 	VariableExprAST(const std::string &name) : Name(name) {};
 	virtual Value* Codegen();
+	virtual bool IsSpeculatable(unsigned &Budget) const { return true; }
+	virtual size_t MemoryUsage() const;
+	virtual void CollectCallees(std::vector<std::string> &Callees) const;
+	virtual void CollectFreeVariables(FreeVariables &FV) const;
 	std::string getName() const {
 		return Name;
 	}
@@ -51,7 +111,16 @@ public:
  BinaryExprAST(char op, ExprAST* lhs, ExprAST* rhs) :
 	Op(op), LHS(lhs), RHS(rhs) {}
 
+	char getOp() const { return Op; }
+	ExprAST* getLHS() const { return LHS; }
+	ExprAST* getRHS() const { return RHS; }
+
 	virtual Value* Codegen();
+	virtual Value* CodegenCond();
+	virtual bool IsSpeculatable(unsigned &Budget) const;
+	virtual size_t MemoryUsage() const;
+	virtual void CollectCallees(std::vector<std::string> &Callees) const;
+	virtual void CollectFreeVariables(FreeVariables &FV) const;
 };
 
 class UnaryExprAST : public ExprAST {
@@ -61,15 +130,41 @@ public:
 	UnaryExprAST(char opcode, ExprAST* operand) : Opcode(opcode), Operand(operand) { }
 	
 	virtual Value* Codegen();
+	virtual size_t MemoryUsage() const;
+	virtual void CollectCallees(std::vector<std::string> &Callees) const;
+	virtual void CollectFreeVariables(FreeVariables &FV) const;
 };
 
 // for function calls
+// Element of a buffer argument: Name[Index]. Reads out of bounds give
+// 0.0, writes out of bounds are dropped; both report an error.
+class IndexExprAST : public ExprAST {
+	std::string Name;
+	ExprAST* Index;
+public:
+	IndexExprAST(const std::string &name, ExprAST* index) : Name(name), Index(index) {}
+	const std::string &getName() const { return Name; }
+	virtual Value* Codegen();
+	// Name[Index] = Val. A vector Val stores that many elements.
+	Value* CodegenStore(Value* Val);
+	virtual size_t MemoryUsage() const;
+	virtual void CollectCallees(std::vector<std::string> &Callees) const;
+	virtual void CollectFreeVariables(FreeVariables &FV) const;
+private:
+	Value* CodegenAccess(Value* StoreVal);
+};
+
 class CallExprAST : public ExprAST {
 	std::string Callee;
 	std::vector<ExprAST*> Args;
  public:
  CallExprAST(const std::string &callee, std::vector<ExprAST*> &args) : Callee(callee), Args(args) {}
+	const std::string &getCallee() const { return Callee; }
+	const std::vector<ExprAST*> &getArgs() const { return Args; }
 	virtual Value* Codegen();
+	virtual size_t MemoryUsage() const;
+	virtual void CollectCallees(std::vector<std::string> &Callees) const;
+	virtual void CollectFreeVariables(FreeVariables &FV) const;
 };
 
 class IfExprAST: public ExprAST {
@@ -78,28 +173,76 @@ public:
 	IfExprAST(ExprAST *cond, ExprAST *then, ExprAST* _else) : 
 		Cond(cond), Then(then), Else(_else) {}
 	virtual Value *Codegen();
+	virtual bool IsSpeculatable(unsigned &Budget) const;
+	virtual size_t MemoryUsage() const;
+	virtual void CollectCallees(std::vector<std::string> &Callees) const;
+	virtual void CollectFreeVariables(FreeVariables &FV) const;
 };
 
 class ForExprAST : public ExprAST {
 	std::string VarName;
   ExprAST *Start, *End, *Step, *Body;
+	// "parallel for": iterations run on the thread pool
+	bool Parallel;
+	// VT_Double or VT_Int ("for i : int = ...")
+	ValueType VarType;
 public:
   ForExprAST(const std::string &varname, ExprAST *start, ExprAST *end,
-             ExprAST *step, ExprAST *body)
-    : VarName(varname), Start(start), End(end), Step(step), Body(body) {}
+             ExprAST *step, ExprAST *body, bool parallel = false,
+						 ValueType vartype = VT_Double)
+    : VarName(varname), Start(start), End(end), Step(step), Body(body),
+		  Parallel(parallel), VarType(vartype) {}
   virtual Value *Codegen();
+  virtual size_t MemoryUsage() const;
+  virtual void CollectCallees(std::vector<std::string> &Callees) const;
+  virtual void CollectFreeVariables(FreeVariables &FV) const;
+private:
+	// EngineOptions::DirectSSA version of Codegen
+	Value* CodegenSSA();
+	Value* CodegenParallel();
+	// Bounds of the loop variable, for hoisting buffer bounds checks
+	bool CreateRange(Value* StartVal, Value* &Lo, Value* &Hi);
+};
+
+// sum/min/max i = start, end [, step] in body: body reduced over
+// i = start, start + step, ... while i < end
+class ReduceExprAST : public ExprAST {
+public:
+	enum Kind { Sum, Min, Max };
+private:
+	Kind K;
+	std::string VarName;
+	ExprAST *Start, *End, *Step, *Body;
+public:
+	ReduceExprAST(Kind k, const std::string &varname, ExprAST *start, ExprAST *end,
+								ExprAST *step, ExprAST *body)
+		: K(k), VarName(varname), Start(start), End(end), Step(step), Body(body) {}
+	virtual Value *Codegen();
+	virtual size_t MemoryUsage() const;
+	virtual void CollectCallees(std::vector<std::string> &Callees) const;
+	virtual void CollectFreeVariables(FreeVariables &FV) const;
+private:
+	Value* Combine(Value* Acc, Value* V);
 };
 
 // VarExprAST - Expression class for var/in
 class VarExprAST : public ExprAST {
 	std::vector<std::pair<std::string, ExprAST*> > VarNames;
+	// One per name, VT_Inferred where there is no annotation
+	std::vector<ValueType> VarTypes;
   ExprAST *Body;
 public:
   VarExprAST(const std::vector<std::pair<std::string, ExprAST*> > &varnames,
-             ExprAST *body)
-		: VarNames(varnames), Body(body) {}
+             ExprAST *body,
+						 const std::vector<ValueType> &vartypes = std::vector<ValueType>())
+		: VarNames(varnames), VarTypes(vartypes), Body(body) {
+		VarTypes.resize(VarNames.size(), VT_Inferred);
+	}
   
   virtual Value *Codegen();
+  virtual size_t MemoryUsage() const;
+  virtual void CollectCallees(std::vector<std::string> &Callees) const;
+  virtual void CollectFreeVariables(FreeVariables &FV) const;
 };
 
 // "prototype" or a function - 
@@ -107,39 +250,219 @@ public:
 class PrototypeAST {
 	std::string Name;
 	std::vector<std::string> Args;
+	std::vector<ValueType> ArgTypes;
+	// VT_Double or VT_Int
+	ValueType RetType;
 	bool isOperator;
 	unsigned Precedence;
  public:
 
+	// No argtypes: all doubles
 	PrototypeAST(const std::string &name, const std::vector<std::string> &args,
-							 bool isoperator = false, unsigned prec = 0) : 
-		Name(name), Args(args), isOperator(isoperator), Precedence(prec) {}
+							 bool isoperator = false, unsigned prec = 0,
+							 const std::vector<ValueType> &argtypes = std::vector<ValueType>(),
+							 ValueType rettype = VT_Double) :
+		Name(name), Args(args), ArgTypes(argtypes), RetType(rettype),
+		isOperator(isoperator), Precedence(prec) {
+		ArgTypes.resize(Args.size(), VT_Double);
+	}
 
 	bool isUnaryOp() const { return isOperator && Args.size() == 1; }
 	bool isBinaryOp() const { return isOperator && Args.size() == 2; }
 
+	// Right after "unary" or "binary": a daemon client's definition has
+	// a suffix after it (see daemon.cc)
 	char getOperatorName() const  {
 		assert(isUnaryOp() || isBinaryOp());
-		return Name[Name.size() - 1];
+		return Name[isBinaryOp() ? 6 : 5];
 	}
 
 	unsigned getBinaryPrecedence() const { return Precedence; }
 
+	const std::string &getName() const { return Name; }
+	void setName(const std::string &name) { Name = name; }
+
+	FunctionType* getFunctionType() const;
+
+	// Hot reload: a new body for an already defined function
+	Function* CodegenRedefinition();
+
 	void CreateArgumentAllocas(Function *F);
+	// Direct SSA codegen: the arguments are the variables' initial values
+	void BindArguments(Function *F);
 
 	Function* Codegen();
+	size_t MemoryUsage() const;
 };
 
 // Function definition
 class FunctionAST {
 	PrototypeAST* Proto;
 	ExprAST* Body;
+	// "fast def": FP arithmetic may be reassociated
+	bool FastMath;
+	// "memo def": results are remembered, see GetMemoTable
+	bool Memo;
+	// A top-level expression, not a definition
+	bool TopLevel;
  public:
- FunctionAST(PrototypeAST* proto, ExprAST* body) : Proto(proto), Body(body) {}
+ FunctionAST(PrototypeAST* proto, ExprAST* body, bool fastmath = false,
+						 bool memo = false, bool toplevel = false) :
+	Proto(proto), Body(body), FastMath(fastmath), Memo(memo), TopLevel(toplevel) {}
+
+	const std::string &getName() const { return Proto->getName(); }
+	PrototypeAST* getProto() const { return Proto; }
 
 	Function* Codegen();
+	size_t MemoryUsage() const;
+	void CollectCallees(std::vector<std::string> &Callees) const;
 };
 
+// Registered host function, see RegisterHostFunction in engine.hpp
+struct HostFunction {
+	void* Addr;
+	unsigned Arity;
+	unsigned Flags;
+};
+
+// 0 if Name was not registered
+const HostFunction* LookupHostFunction(const std::string &Name);
+
+// JIT listener writing the perf map and/or jitdump (perfmap.cc)
+JITEventListener* CreatePerfMapListener(bool WriteMap, bool WriteJitDump);
+
+// Phase timers (stats.cc). Only running when a report was asked for.
+enum Phase {
+	PH_Lex, PH_Parse, PH_IRGen, PH_Verify, PH_Optimize, PH_Emit, PH_Exec,
+	NumPhases
+};
+
+extern bool StatsEnabled;
+
+uint64_t StatsNow();
+void StatsPushPhase(Phase P);
+void StatsPopPhase();
+// Everything timed since the previous item belongs to this one
+void StatsEndItem(const char* Kind, const std::string &Name);
+// JSON if Path ends in .json, CSV otherwise
+bool WriteStatsReport(const std::string &Path);
+
+// Times the enclosing scope as phase P
+class PhaseTimer {
+public:
+	PhaseTimer(Phase P) {
+		if(StatsEnabled) StatsPushPhase(P);
+	}
+	~PhaseTimer() {
+		if(StatsEnabled) StatsPopPhase();
+	}
+};
+
+// Memory accounting (memory.cc)
+// Size of F's IR, after codegen or after the FPM
+void RecordFunctionIR(Function* F, size_t ASTBytes, bool Optimized);
+// Keeps track of the machine code the JIT emits
+JITEventListener* CreateMemoryListener();
+// "@memory" REPL command: one function, or all of them if Name is empty
+void PrintMemoryReport(const std::string &Name);
+
+// Call profiler (profile.cc), for sessions with EngineOptions::Profile.
+// Instrumented functions call ProfileEnter(id) on entry and
+// ProfileExit(id) before returning.
+unsigned GetProfileId(const std::string &Name);
+extern "C" void ProfileEnter(uint32_t Id);
+extern "C" void ProfileExit(uint32_t Id);
+// Sorted by self time
+void PrintProfileReport();
+
+// Hot redefinition (hotreload.cc), for sessions with
+// EngineOptions::HotReload. The slot of a user function holds the
+// address of its current code; 0 if Name was never defined.
+GlobalVariable* GetFunctionSlot(const std::string &Name);
+GlobalVariable* CreateFunctionSlot(Function* F);
+void* ReadFunctionSlot(GlobalVariable* Slot);
+// Compile F, the new body of Name, and switch Name's slot over to it
+void PublishFunction(const std::string &Name, Function* F);
+
+// Purity inference (purity.cc). Kaleidoscope has no global state, so a
+// function is pure (readnone) unless it calls something that isn't, and
+// nounwind unless it calls something that may unwind. Run for every new
+// definition, before it is optimized; functions in a cycle with it are
+// updated too.
+void InferPurity(const std::string &Name, const std::vector<std::string> &Callees);
+// Undoes the last InferPurity, of a definition that was rejected after
+// all: Name gets back the record of its previous body, if any, and the
+// functions calling it are updated again
+void ForgetPurity(const std::string &Name);
+// As found by the last InferPurity; Reason says why not
+bool IsPure(const std::string &Name, std::string &Reason);
+// "@pure" REPL command
+void PrintPurityReport();
+// Extern that codegen treats as a pure libm function
+bool IsMathFunction(Function* F);
+
+// Thread pool for "parallel for" (parallel.cc). A loop body is outlined
+// into a function running iterations [Begin, End); Env holds the start,
+// the step and the captured variables.
+typedef void (*ParallelBodyFn)(double* Env, int64_t Begin, int64_t End);
+extern "C" void ParallelFor(ParallelBodyFn Body, double* Env, int64_t N);
+void StopThreadPool();
+
+// Memo tables (memo.cc). A "memo def" looks its arguments' bits up in
+// its table on entry, and stores its result's bits there before
+// returning. The table of Name is created on its first definition, and
+// emptied by later ones.
+void* GetMemoTable(const std::string &Name, unsigned Arity);
+extern "C" int32_t MemoLookup(void* Table, const uint64_t* Keys, uint64_t* Result);
+extern "C" void MemoStore(void* Table, const uint64_t* Keys, uint64_t Result);
+// "@memo" REPL command
+void PrintMemoReport();
+
+// Call-site specialization (specialize.cc). Run on a function once it's
+// optimized: calls with constant arguments may go to clones of the
+// callee with those folded in.
+void SpecializeCalls(Function* F);
+// "@spec" REPL command
+void PrintSpecializationReport();
+
+// Merging of identical functions (dedup.cc). Run on a definition once
+// it's optimized: if an earlier one has the same IR, F becomes a thunk
+// calling it, and true is returned.
+bool MergeDuplicate(Function* F);
+// The function calls to F should go to: F, or what it was merged into
+Function* GetMergedFunction(Function* F);
+// "@dedup" REPL command
+void PrintDedupReport();
+
+// Precompiled prelude (prelude.cc). LoadPrelude gives the module the
+// session starts with, 0 on error. A definition of a name the prelude
+// has moves the prelude's function out of the way first (0 if it has
+// none), and puts it back if the definition fails.
+struct PreludeImage;
+Module* LoadPrelude(const PreludeImage &P);
+Function* ReplacePreludeFunction(const std::string &Name);
+void RestorePreludeFunction(Function* F, const std::string &Name);
+
+// EvalSource, but top-level expressions are compiled and not run: they
+// are added to Exprs, in order, and errors to Errors instead of stderr
+bool CompileSource(const std::string &Src, std::vector<Function*> &Exprs,
+									 std::string &Errors);
+
+// Namespaces of daemon clients (daemon.cc). Outside of a request the
+// daemon is compiling, names are left as they are.
+// The function in the module that Name stands for in the current request
+std::string ResolveFunctionName(const std::string &Name);
+// Before F (of source Text) is compiled: moves it into the client's
+// namespace. False if the same definition, calling the same functions,
+// was compiled before (for any client); its name then stands for that
+// one, and F is not compiled.
+bool EnterDefinition(FunctionAST* F, const std::string &Text);
+// After F is compiled, or failed to be
+void LeaveDefinition(FunctionAST* F, bool Compiled);
+
+// Build "<name>.map", a loop calling F once per row of its input columns
+// (see MapKernelFn in engine.hpp), with F inlined into the loop body.
+Function* CreateMapKernel(Function* F);
 
 ExprAST* Error(const char* Str);
 
@@ -164,13 +487,17 @@ static ExprAST* ParseUnary();
 
 static ExprAST* ParsePrimary();
 
+// Called on 'for'; Parallel when 'parallel' came before it
+static ForExprAST* ParseForExpr(bool Parallel = false);
+
 static ExprAST* ParseExpression();
 
 static ExprAST* ParseBinOpRHS(int ExprPrec, ExprAST *LHS);
 
 static PrototypeAST* ParsePrototype();
 
-static FunctionAST* ParseDefinition();
+// Called on 'def', with the modifiers before it
+static FunctionAST* ParseDefinition(bool FastMath, bool Memo);
 
 static PrototypeAST* ParseExtern();
 
@@ -1,79 +1,124 @@
 /*
  This tutorial implements the lexer / parser manually. Cool ... NOT
  */
-#include <llvm/DerivedTypes.h>
-#include <llvm/ExecutionEngine/ExecutionEngine.h>
-#include <llvm/ExecutionEngine/JIT.h>
-#include <llvm/LLVMContext.h>
 #include <llvm/Module.h>
-#include <llvm/PassManager.h>
-#include <llvm/Analysis/Verifier.h>
-#include <llvm/Target/TargetData.h>
-#include <llvm/Target/TargetSelect.h>
-#include <llvm/Transforms/Scalar.h>
-#include <llvm/Support/IRBuilder.h>
 
 #include <stdio.h>
+#include <cstdlib>
+#include <string.h>
 #include "kaleidoscope.hpp"
+#include "engine.hpp"
 
-extern std::map<char, int> KBinopPrecedence;
 extern Module* TheModule;
 
-FunctionPassManager *TheFPM;
-
-ExecutionEngine *TheExecutionEngine;
-
 int main(int argc, char** argv) {
-	// This is needed by the JIT
-	InitializeNativeTarget();
-
-	// Fill precedence table
-	KBinopPrecedence['='] = 2;
-	KBinopPrecedence['<'] = 10;
-	KBinopPrecedence['+'] = 20;
-	KBinopPrecedence['-'] = 20;
-	KBinopPrecedence['*'] = 40; // higher
-
-  fprintf(stderr, "ready> ");
-  getNextToken();
+	EngineOptions Opts;
+	// The REPL shows what it's doing
+	Opts.Verbosity = 2;
+	Opts.Prelude = &StandardPrelude;
+
+	std::string Daemon;
+	bool VerbositySet = false;
+	for(int i = 1; i < argc; ++i) {
+		if(!strcmp(argv[i], "-binary-output")) {
+			SetBinaryOutput(true);
+		} else if(!strcmp(argv[i], "-no-math-builtins")) {
+			Opts.MathBuiltins = false;
+		} else if(!strcmp(argv[i], "-fast-math")) {
+			Opts.FastMath = true;
+		} else if(!strcmp(argv[i], "-profile")) {
+			Opts.Profile = true;
+		} else if(!strcmp(argv[i], "-direct-ssa")) {
+			Opts.DirectSSA = true;
+		} else if(!strcmp(argv[i], "-no-branchless-if")) {
+			Opts.BranchlessIf = false;
+		} else if(!strcmp(argv[i], "-no-prelude")) {
+			Opts.Prelude = 0;
+		} else if(!strcmp(argv[i], "-no-dedup")) {
+			Opts.Dedup = false;
+		} else if(!strcmp(argv[i], "-hot-reload")) {
+			Opts.HotReload = true;
+		} else if(!strcmp(argv[i], "-perf-map")) {
+			Opts.PerfMap = true;
+		} else if(!strcmp(argv[i], "-perf-jitdump")) {
+			Opts.PerfJitDump = true;
+		} else if(!strncmp(argv[i], "-v=", 3)) {
+			Opts.Verbosity = atoi(argv[i] + 3);
+			VerbositySet = true;
+		} else if(!strncmp(argv[i], "-daemon=", 8)) {
+			Daemon = argv[i] + 8;
+		} else if(!strncmp(argv[i], "-connect=", 9)) {
+			// Client of a daemon: send stdin as one request, print the reply
+			std::string Src, Reply;
+			int C;
+			while((C = getchar()) != EOF) {
+				Src += (char) C;
+			}
+			if(!SendToDaemon(argv[i] + 9, Src, Reply)) {
+				fprintf(stderr, "Could not reach the daemon at %s\n", argv[i] + 9);
+				exit(-1);
+			}
+			fputs(Reply.c_str(), stdout);
+			exit(0);
+		} else if(!strncmp(argv[i], "-threads=", 9)) {
+			Opts.Threads = atoi(argv[i] + 9);
+		} else if(!strncmp(argv[i], "-memo-capacity=", 15)) {
+			Opts.MemoCapacity = atoi(argv[i] + 15);
+		} else if(!strcmp(argv[i], "-memo-eviction=lru")) {
+			Opts.MemoEviction = ME_LRU;
+		} else if(!strcmp(argv[i], "-memo-eviction=fifo")) {
+			Opts.MemoEviction = ME_FIFO;
+		} else if(!strncmp(argv[i], "-specialize-budget=", 19)) {
+			Opts.SpecializeBudget = atoi(argv[i] + 19);
+		} else if(!strncmp(argv[i], "-stats=", 7)) {
+			Opts.StatsFile = argv[i] + 7;
+		} else if(!strncmp(argv[i], "-mcpu=", 6)) {
+			Opts.CPU = argv[i] + 6;
+		} else if(!strncmp(argv[i], "-mattr=", 7)) {
+			// comma separated, like llc
+			std::string Attrs = argv[i] + 7;
+			size_t Pos = 0;
+			while(Pos <= Attrs.size()) {
+				size_t Comma = Attrs.find(',', Pos);
+				if(Comma == std::string::npos) Comma = Attrs.size();
+				if(Comma > Pos) Opts.CPUFeatures.push_back(Attrs.substr(Pos, Comma - Pos));
+				Pos = Comma + 1;
+			}
+		} else if(argv[i][0] == '-' && argv[i][1] == 'O' &&
+							argv[i][2] >= '0' && argv[i][2] <= '3' && !argv[i][3]) {
+			Opts.CodegenOptLevel = argv[i][2] - '0';
+		} else {
+			fprintf(stderr, "Unknown option %s\n", argv[i]);
+			exit(-1);
+		}
+	}
 
-	TheModule = new Module("cool jit", getGlobalContext());
+	// Nobody is watching the daemon's stderr
+	if(!Daemon.empty() && !VerbositySet) {
+		Opts.Verbosity = 0;
+	}
 
-	// Create a JIT. Taks ownership of the module
-	std::string ErrStr;
-	TheExecutionEngine = EngineBuilder(TheModule).setErrorStr(&ErrStr).create();
-	if(!TheExecutionEngine) {
-		fprintf(stderr, "Could not create ExecutionEngine: %s\n", ErrStr.c_str());
+	if(!InitializeEngine(Opts)) {
 		exit(-1);
 	}
 
-	// Set up optimizing pipeline
-	FunctionPassManager OurFPM(TheModule);
-	// Set up the optimizer pipeline.  Start with registering info about how the
-	// target lays out data structures.
-	OurFPM.add(new TargetData(*TheExecutionEngine->getTargetData()));
-	// Promote allocas to registers.
-	OurFPM.add(createPromoteMemoryToRegisterPass());
-	// Simple "peephole" optimizations and bit-twiddling optzns.
-  OurFPM.add(createInstructionCombiningPass());
-  // Reassociate expressions.
-  OurFPM.add(createReassociatePass());
-  // Eliminate Common SubExpressions.
-  OurFPM.add(createGVNPass());
-  // Simplify the control flow graph (deleting unreachable blocks, etc).
-  OurFPM.add(createCFGSimplificationPass());
-
-  OurFPM.doInitialization();
+	if(!Daemon.empty()) {
+		RunDaemon(Daemon);
+		exit(-1);
+	}
 
-  // Set the global so the code gen can use this.
-  TheFPM = &OurFPM;
+  fprintf(stderr, "ready> ");
+  getNextToken();
 
   // Run the main "interpreter loop" now.
   MainLoop();
 
-	TheFPM = 0;
+	ShutdownEngine();
+	FlushOutput();
 
-	TheModule->dump();
+	if(Opts.Verbosity >= 2) {
+		TheModule->dump();
+	}
 
 	return 0;
 }
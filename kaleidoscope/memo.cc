@@ -0,0 +1,229 @@
+// Tables of "memo def" functions. A table maps the bits of the
+// arguments to the bits of the result. It is set associative: a key
+// hashes to a set of MemoWays entries that sit next to each other, so a
+// lookup touches one or two cache lines and never probes further. A full
+// set gives up an entry as EngineOptions::MemoEviction says. Tables are
+// never freed or moved: code compiled against one (an older body under
+// hot reload too) keeps its address. Each one has a spin lock, held for
+// the few loads and stores of a lookup or insert, so memo functions can
+// be called from parallel for bodies.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include "kaleidoscope.hpp"
+#include "engine.hpp"
+
+extern EngineOptions TheOptions;
+
+static const unsigned MemoWays = 4;
+// Larger capacities are clamped to this (a power of two, so rounding
+// up can't overflow)
+static const unsigned MaxMemoCapacity = 1u << 26;
+
+namespace {
+
+struct MemoTable {
+	volatile int Lock;
+	unsigned Arity;
+	unsigned NumSets;
+	// Words per set: a header, then per entry the keys and the result
+	unsigned SetWords;
+	MemoEvictionPolicy Eviction;
+	std::vector<uint64_t> Sets;
+	uint64_t Hits, Misses, Evictions;
+};
+
+// First word of a set
+struct SetHeader {
+	// Bit per way holding an entry
+	uint8_t Used;
+	// ME_FIFO: way to replace next
+	uint8_t Next;
+	// ME_LRU: 0 for the most recently used way, MemoWays - 1 for the least
+	uint8_t Rank[MemoWays];
+};
+
+}
+
+static std::map<std::string, MemoTable*> Tables;
+
+static void LockTable(MemoTable* T) {
+	while(__sync_lock_test_and_set(&T->Lock, 1)) {
+		while(T->Lock) {
+		}
+	}
+}
+
+static void UnlockTable(MemoTable* T) {
+	__sync_lock_release(&T->Lock);
+}
+
+static void ClearTable(MemoTable* T) {
+	std::fill(T->Sets.begin(), T->Sets.end(), 0);
+	for(unsigned s = 0; s != T->NumSets; ++s) {
+		SetHeader* H = (SetHeader*) &T->Sets[(size_t) s * T->SetWords];
+		for(unsigned w = 0; w != MemoWays; ++w) {
+			H->Rank[w] = w;
+		}
+	}
+	T->Hits = T->Misses = T->Evictions = 0;
+}
+
+void* GetMemoTable(const std::string &Name, unsigned Arity) {
+	MemoTable* &T = Tables[Name];
+	if(T && T->Arity == Arity) {
+		// A new body may compute something else. The old one may still be
+		// running, on other threads too.
+		LockTable(T);
+		ClearTable(T);
+		UnlockTable(T);
+		return T;
+	}
+
+	unsigned Capacity = 1;
+	while(Capacity < std::min(TheOptions.MemoCapacity, MaxMemoCapacity)) {
+		Capacity *= 2;
+	}
+	T = new MemoTable();
+	T->Lock = 0;
+	T->Arity = Arity;
+	T->NumSets = Capacity > MemoWays ? Capacity / MemoWays : 1;
+	T->SetWords = 1 + MemoWays * (Arity + 1);
+	T->Eviction = TheOptions.MemoEviction;
+	T->Sets.resize((size_t) T->NumSets * T->SetWords);
+	ClearTable(T);
+	return T;
+}
+
+static uint64_t* FindSet(MemoTable* T, const uint64_t* Keys) {
+	uint64_t H = 0x9e3779b97f4a7c15ULL;
+	for(unsigned i = 0; i != T->Arity; ++i) {
+		H = (H ^ Keys[i]) * 0xff51afd7ed558ccdULL;
+		H ^= H >> 32;
+	}
+	return &T->Sets[(size_t) (H & (T->NumSets - 1)) * T->SetWords];
+}
+
+static uint64_t* GetEntry(MemoTable* T, uint64_t* Set, unsigned Way) {
+	return Set + 1 + Way * (T->Arity + 1);
+}
+
+// Way holding Keys, or MemoWays
+static unsigned FindWay(MemoTable* T, uint64_t* Set, const uint64_t* Keys) {
+	SetHeader* H = (SetHeader*) Set;
+	for(unsigned w = 0; w != MemoWays; ++w) {
+		if((H->Used & (1 << w)) &&
+			 !memcmp(GetEntry(T, Set, w), Keys, T->Arity * sizeof(uint64_t))) {
+			return w;
+		}
+	}
+	return MemoWays;
+}
+
+static void Touch(SetHeader* H, unsigned Way) {
+	for(unsigned w = 0; w != MemoWays; ++w) {
+		if(H->Rank[w] < H->Rank[Way]) {
+			++H->Rank[w];
+		}
+	}
+	H->Rank[Way] = 0;
+}
+
+extern "C" int32_t MemoLookup(void* Table, const uint64_t* Keys, uint64_t* Result) {
+	MemoTable* T = (MemoTable*) Table;
+	LockTable(T);
+	uint64_t* Set = FindSet(T, Keys);
+	unsigned Way = FindWay(T, Set, Keys);
+	if(Way == MemoWays) {
+		++T->Misses;
+		UnlockTable(T);
+		return 0;
+	}
+	*Result = GetEntry(T, Set, Way)[T->Arity];
+	if(T->Eviction == ME_LRU) {
+		Touch((SetHeader*) Set, Way);
+	}
+	++T->Hits;
+	UnlockTable(T);
+	return 1;
+}
+
+extern "C" void MemoStore(void* Table, const uint64_t* Keys, uint64_t Result) {
+	MemoTable* T = (MemoTable*) Table;
+	LockTable(T);
+	uint64_t* Set = FindSet(T, Keys);
+	SetHeader* H = (SetHeader*) Set;
+
+	// A recursive call, or another thread, may have got there first
+	unsigned Way = FindWay(T, Set, Keys);
+	if(Way == MemoWays) {
+		for(Way = 0; Way != MemoWays && (H->Used & (1 << Way)); ++Way) {
+		}
+	}
+	if(Way == MemoWays) {
+		if(T->Eviction == ME_LRU) {
+			for(Way = 0; H->Rank[Way] != MemoWays - 1; ++Way) {
+			}
+		} else {
+			Way = H->Next;
+			H->Next = (H->Next + 1) % MemoWays;
+		}
+		++T->Evictions;
+	}
+
+	uint64_t* Entry = GetEntry(T, Set, Way);
+	memcpy(Entry, Keys, T->Arity * sizeof(uint64_t));
+	Entry[T->Arity] = Result;
+	H->Used |= 1 << Way;
+	Touch(H, Way);
+	UnlockTable(T);
+}
+
+bool GetMemoStats(const std::string &Name, MemoStats &Out) {
+	std::map<std::string, MemoTable*>::iterator I = Tables.find(Name);
+	if(I == Tables.end()) {
+		return false;
+	}
+	MemoTable* T = I->second;
+	LockTable(T);
+	Out.Hits = T->Hits;
+	Out.Misses = T->Misses;
+	Out.Evictions = T->Evictions;
+	Out.Capacity = T->NumSets * MemoWays;
+	Out.Entries = 0;
+	for(unsigned s = 0; s != T->NumSets; ++s) {
+		Out.Entries += __builtin_popcount(((SetHeader*) &T->Sets[(size_t) s * T->SetWords])->Used);
+	}
+	UnlockTable(T);
+	return true;
+}
+
+void ClearMemoTables() {
+	for(std::map<std::string, MemoTable*>::iterator I = Tables.begin(), E = Tables.end();
+			I != E; ++I) {
+		LockTable(I->second);
+		ClearTable(I->second);
+		UnlockTable(I->second);
+	}
+}
+
+void PrintMemoReport() {
+	fprintf(stderr, "%-24s %10s %10s %10s %6s %10s\n", "function", "entries",
+					"hits", "misses", "hit %", "evictions");
+	for(std::map<std::string, MemoTable*>::iterator I = Tables.begin(), E = Tables.end();
+			I != E; ++I) {
+		MemoStats S;
+		GetMemoStats(I->first, S);
+		uint64_t Lookups = S.Hits + S.Misses;
+		fprintf(stderr, "%-24s %5u/%-5u %10llu %10llu %6.1f %10llu\n", I->first.c_str(),
+						S.Entries, S.Capacity, (unsigned long long) S.Hits,
+						(unsigned long long) S.Misses,
+						Lookups ? 100.0 * S.Hits / Lookups : 0.0,
+						(unsigned long long) S.Evictions);
+	}
+}
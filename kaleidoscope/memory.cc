@@ -0,0 +1,141 @@
+// Where the memory of a session goes: AST, IR and machine code, per function
+
+#include <llvm/Function.h>
+#include <llvm/Module.h>
+#include <llvm/ExecutionEngine/JITEventListener.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <map>
+#include "kaleidoscope.hpp"
+#include "engine.hpp"
+
+extern Module* TheModule;
+
+static std::map<std::string, FunctionMemory> Functions;
+
+// Emitted code, by address, so NotifyFreeingMachineCode can find its size
+static std::map<void*, std::pair<std::string, size_t> > Code;
+static size_t TotalCodeBytes = 0;
+
+static FunctionMemory &GetRecord(const std::string &Name) {
+	std::map<std::string, FunctionMemory>::iterator I = Functions.find(Name);
+	if(I == Functions.end()) {
+		FunctionMemory M;
+		memset(&M, 0, sizeof(M));
+		I = Functions.insert(std::make_pair(Name, M)).first;
+	}
+	return I->second;
+}
+
+static void CountIR(const Function* F, unsigned &Instructions, unsigned &Blocks) {
+	Instructions = Blocks = 0;
+	for(Function::const_iterator BB = F->begin(), E = F->end(); BB != E; ++BB) {
+		++Blocks;
+		Instructions += BB->size();
+	}
+}
+
+void RecordFunctionIR(Function* F, size_t ASTBytes, bool Optimized) {
+	FunctionMemory &M = GetRecord(F->getNameStr());
+	M.ASTBytes = ASTBytes;
+	if(Optimized) {
+		CountIR(F, M.OptIRInstructions, M.OptIRBlocks);
+	} else {
+		CountIR(F, M.IRInstructions, M.IRBlocks);
+	}
+}
+
+namespace {
+
+class MemoryListener : public JITEventListener {
+public:
+	virtual void NotifyFunctionEmitted(const Function &F, void *Addr, size_t Size,
+																		 const EmittedFunctionDetails &Details) {
+		std::string Name = F.getNameStr();
+		GetRecord(Name).CodeBytes = Size;
+		Code[Addr] = std::make_pair(Name, Size);
+		TotalCodeBytes += Size;
+	}
+
+	virtual void NotifyFreeingMachineCode(void *OldPtr) {
+		std::map<void*, std::pair<std::string, size_t> >::iterator I = Code.find(OldPtr);
+		if(I == Code.end()) {
+			return;
+		}
+		TotalCodeBytes -= I->second.second;
+		std::map<std::string, FunctionMemory>::iterator F = Functions.find(I->second.first);
+		// Unless a new definition of the name has taken the record over,
+		// nothing is left of the function (e.g. a daemon request's
+		// expression) but an entry nobody asks for
+		if(F != Functions.end() && F->second.CodeBytes == I->second.second) {
+			Functions.erase(F);
+		}
+		Code.erase(I);
+	}
+};
+
+}
+
+JITEventListener* CreateMemoryListener() {
+	return new MemoryListener();
+}
+
+bool GetFunctionMemory(const std::string &Name, FunctionMemory &Out) {
+	std::map<std::string, FunctionMemory>::const_iterator I = Functions.find(Name);
+	if(I == Functions.end()) {
+		return false;
+	}
+	Out = I->second;
+	return true;
+}
+
+void GetSessionMemory(SessionMemory &Out) {
+	memset(&Out, 0, sizeof(Out));
+	for(Module::const_iterator F = TheModule->begin(), E = TheModule->end();
+			F != E; ++F) {
+		unsigned Instructions, Blocks;
+		CountIR(&*F, Instructions, Blocks);
+		++Out.Functions;
+		Out.IRInstructions += Instructions;
+		Out.IRBlocks += Blocks;
+	}
+	for(std::map<std::string, FunctionMemory>::const_iterator I = Functions.begin(),
+				E = Functions.end(); I != E; ++I) {
+		Out.ASTBytes += I->second.ASTBytes;
+	}
+	Out.CodeBytes = TotalCodeBytes;
+}
+
+static void PrintFunctionMemory(const std::string &Name, const FunctionMemory &M) {
+	fprintf(stderr, "%-24s %10lu %6u/%-6u %6u/%-6u %10lu\n", Name.c_str(),
+					(unsigned long) M.ASTBytes, M.IRInstructions, M.IRBlocks,
+					M.OptIRInstructions, M.OptIRBlocks, (unsigned long) M.CodeBytes);
+}
+
+void PrintMemoryReport(const std::string &Name) {
+	fprintf(stderr, "%-24s %10s %13s %13s %10s\n", "function", "AST bytes",
+					"IR inst/bb", "opt inst/bb", "code bytes");
+
+	if(!Name.empty()) {
+		FunctionMemory M;
+		if(!GetFunctionMemory(Name, M)) {
+			fprintf(stderr, "No function %s\n", Name.c_str());
+			return;
+		}
+		PrintFunctionMemory(Name, M);
+		return;
+	}
+
+	for(std::map<std::string, FunctionMemory>::const_iterator I = Functions.begin(),
+				E = Functions.end(); I != E; ++I) {
+		PrintFunctionMemory(I->first, I->second);
+	}
+
+	SessionMemory S;
+	GetSessionMemory(S);
+	fprintf(stderr, "module: %u functions, %u instructions in %u blocks\n",
+					S.Functions, S.IRInstructions, S.IRBlocks);
+	fprintf(stderr, "AST: %lu bytes, machine code: %lu bytes\n",
+					(unsigned long) S.ASTBytes, (unsigned long) S.CodeBytes);
+}
@@ -0,0 +1,228 @@
+// Thread pool running the iterations of "parallel for" loops. Each
+// participant (the workers and the calling thread) starts with an equal
+// share of the iteration range, and runs it a chunk at a time from the
+// front. A participant whose range is used up steals the back half of
+// another one's, so uneven iterations still keep every thread busy.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <vector>
+#include "kaleidoscope.hpp"
+#include "engine.hpp"
+
+namespace {
+
+// Iterations [Begin, End) not taken yet. Stealing aside, only its owner
+// touches it; the padding keeps it off its neighbours' cache lines.
+struct Range {
+	pthread_mutex_t Lock;
+	int64_t Begin;
+	int64_t End;
+	char Pad[64];
+};
+
+}
+
+// Participants, the calling thread included
+static unsigned NumThreads = 1;
+static std::vector<pthread_t> Workers;
+static Range* Ranges = 0;
+
+// One loop at a time. Loops started while the pool is busy (nested ones,
+// or from another host thread) just run on the calling thread.
+static pthread_mutex_t PoolLock = PTHREAD_MUTEX_INITIALIZER;
+static __thread bool InParallelFor = false;
+
+// The current loop, published under JobLock by bumping Generation
+static pthread_mutex_t JobLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t JobCond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t DoneCond = PTHREAD_COND_INITIALIZER;
+static unsigned Generation = 0;
+// Generation when the workers were started; they wait for the next one
+static unsigned StartGeneration = 0;
+static bool Quit = false;
+static ParallelBodyFn JobBody;
+static double* JobEnv;
+static int64_t JobGrain;
+// Where the calling thread's output goes, for the workers' to go too
+static int JobOutFd;
+// Participants not done with the current loop
+static unsigned Active = 0;
+
+static bool TakeChunk(unsigned Self, int64_t &Begin, int64_t &End) {
+	Range &R = Ranges[Self];
+	pthread_mutex_lock(&R.Lock);
+	bool Found = R.Begin < R.End;
+	if(Found) {
+		Begin = R.Begin;
+		End = R.End - R.Begin > JobGrain ? R.Begin + JobGrain : R.End;
+		R.Begin = End;
+	}
+	pthread_mutex_unlock(&R.Lock);
+	return Found;
+}
+
+// Move the back half of some other participant's range into ours
+static bool Steal(unsigned Self) {
+	for(unsigned i = 1; i < NumThreads; ++i) {
+		Range &Victim = Ranges[(Self + i) % NumThreads];
+		pthread_mutex_lock(&Victim.Lock);
+		int64_t Left = Victim.End - Victim.Begin;
+		int64_t Mid = Victim.Begin + Left / 2;
+		int64_t End = Victim.End;
+		if(Left > 0) {
+			Victim.End = Mid;
+		}
+		pthread_mutex_unlock(&Victim.Lock);
+
+		if(Left > 0) {
+			Range &Own = Ranges[Self];
+			pthread_mutex_lock(&Own.Lock);
+			Own.Begin = Mid;
+			Own.End = End;
+			pthread_mutex_unlock(&Own.Lock);
+			return true;
+		}
+	}
+	return false;
+}
+
+// Until every range is empty. Whatever was stolen from under us
+// is run by the thief, so there is nothing to wait for at the end.
+static void RunJob(unsigned Self) {
+	InParallelFor = true;
+	int64_t Begin, End;
+	for(;;) {
+		if(!TakeChunk(Self, Begin, End) && !(Steal(Self) && TakeChunk(Self, Begin, End))) {
+			break;
+		}
+		JobBody(JobEnv, Begin, End);
+	}
+	InParallelFor = false;
+}
+
+static void* WorkerMain(void* Arg) {
+	unsigned Self = (unsigned) (intptr_t) Arg;
+	unsigned Seen = StartGeneration;
+	for(;;) {
+		pthread_mutex_lock(&JobLock);
+		while(Generation == Seen && !Quit) {
+			pthread_cond_wait(&JobCond, &JobLock);
+		}
+		if(Quit) {
+			pthread_mutex_unlock(&JobLock);
+			return 0;
+		}
+		Seen = Generation;
+		pthread_mutex_unlock(&JobLock);
+
+		SetOutputDescriptor(JobOutFd);
+		RunJob(Self);
+		// printd buffers per thread
+		SetOutputDescriptor(-1);
+
+		pthread_mutex_lock(&JobLock);
+		if(--Active == 0) {
+			pthread_cond_signal(&DoneCond);
+		}
+		pthread_mutex_unlock(&JobLock);
+	}
+}
+
+static void StopWorkers() {
+	pthread_mutex_lock(&JobLock);
+	Quit = true;
+	pthread_cond_broadcast(&JobCond);
+	pthread_mutex_unlock(&JobLock);
+	for(unsigned i = 0, e = Workers.size(); i != e; ++i) {
+		pthread_join(Workers[i], 0);
+	}
+	Workers.clear();
+	Quit = false;
+	delete[] Ranges;
+	Ranges = 0;
+}
+
+// Started by the first loop, so sessions without one have no threads
+static void StartWorkers() {
+	Ranges = new Range[NumThreads];
+	for(unsigned i = 0; i < NumThreads; ++i) {
+		pthread_mutex_init(&Ranges[i].Lock, 0);
+	}
+	StartGeneration = Generation;
+	for(unsigned i = 1; i < NumThreads; ++i) {
+		pthread_t T;
+		if(pthread_create(&T, 0, WorkerMain, (void*) (intptr_t) i) != 0) {
+			fprintf(stderr, "could not start parallel for thread\n");
+			NumThreads = i;
+			break;
+		}
+		Workers.push_back(T);
+	}
+}
+
+void SetParallelThreads(unsigned Threads) {
+	if(Threads == 0) {
+		long N = sysconf(_SC_NPROCESSORS_ONLN);
+		Threads = N > 0 ? (unsigned) N : 1;
+	}
+
+	pthread_mutex_lock(&PoolLock);
+	StopWorkers();
+	NumThreads = Threads;
+	pthread_mutex_unlock(&PoolLock);
+}
+
+void StopThreadPool() {
+	pthread_mutex_lock(&PoolLock);
+	StopWorkers();
+	pthread_mutex_unlock(&PoolLock);
+}
+
+extern "C" void ParallelFor(ParallelBodyFn Body, double* Env, int64_t N) {
+	if(N <= 0) {
+		return;
+	}
+	if(NumThreads == 1 || N == 1 || InParallelFor || pthread_mutex_trylock(&PoolLock) != 0) {
+		Body(Env, 0, N);
+		return;
+	}
+	if(!Ranges) {
+		StartWorkers();
+	}
+
+	// Chunks small enough to even out the load, big enough that taking
+	// one is cheap next to running it
+	JobBody = Body;
+	JobEnv = Env;
+	JobGrain = N / (NumThreads * 16);
+	if(JobGrain == 0) {
+		JobGrain = 1;
+	}
+	// What was printed before the loop comes out before the workers' output
+	FlushOutput();
+	JobOutFd = GetOutputDescriptor();
+	for(unsigned i = 0; i < NumThreads; ++i) {
+		Ranges[i].Begin = N * i / NumThreads;
+		Ranges[i].End = N * (i + 1) / NumThreads;
+	}
+
+	pthread_mutex_lock(&JobLock);
+	Active = NumThreads;
+	++Generation;
+	pthread_cond_broadcast(&JobCond);
+	pthread_mutex_unlock(&JobLock);
+
+	RunJob(0);
+
+	pthread_mutex_lock(&JobLock);
+	--Active;
+	while(Active != 0) {
+		pthread_cond_wait(&DoneCond, &JobLock);
+	}
+	pthread_mutex_unlock(&JobLock);
+
+	pthread_mutex_unlock(&PoolLock);
+}
@@ -0,0 +1,149 @@
+// Lets perf symbolize JITed code.
+//
+// The perf map (/tmp/perf-<pid>.map) is a text line per function, read by
+// "perf report" directly. The jitdump (jit-<pid>.dump) also carries the
+// code bytes, so "perf inject --jit" can annotate it; record with
+// "perf record -k mono" for that.
+
+#include <llvm/Function.h>
+#include <llvm/ExecutionEngine/JITEventListener.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "kaleidoscope.hpp"
+
+namespace {
+
+// jitdump format, see tools/perf/Documentation/jitdump-specification.txt
+struct JitDumpHeader {
+	uint32_t Magic;
+	uint32_t Version;
+	uint32_t TotalSize;
+	uint32_t ElfMach;
+	uint32_t Pad1;
+	uint32_t Pid;
+	uint64_t Timestamp;
+	uint64_t Flags;
+};
+
+struct JitDumpCodeLoad {
+	uint32_t Id;
+	uint32_t TotalSize;
+	uint64_t Timestamp;
+	uint32_t Pid;
+	uint32_t Tid;
+	uint64_t Vma;
+	uint64_t CodeAddr;
+	uint64_t CodeSize;
+	uint64_t CodeIndex;
+};
+
+static const uint32_t JitDumpMagic = 0x4A695444;
+static const uint32_t JitCodeLoad = 0;
+static const uint32_t EM_X86_64_ = 62;
+
+// Same clock as "perf record -k mono"
+static uint64_t MonotonicNanos() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+class PerfMapListener : public JITEventListener {
+	FILE* Map;
+	FILE* Dump;
+	void* DumpMarker;
+	uint64_t CodeIndex;
+
+public:
+	PerfMapListener(bool WriteMap, bool WriteJitDump)
+		: Map(0), Dump(0), DumpMarker(0), CodeIndex(0) {
+		char Path[64];
+		if(WriteMap) {
+			snprintf(Path, sizeof(Path), "/tmp/perf-%d.map", (int) getpid());
+			Map = fopen(Path, "w");
+			if(!Map) {
+				fprintf(stderr, "Could not open %s\n", Path);
+			}
+		}
+
+		if(WriteJitDump) {
+			snprintf(Path, sizeof(Path), "jit-%d.dump", (int) getpid());
+			Dump = fopen(Path, "w+");
+			if(!Dump) {
+				fprintf(stderr, "Could not open %s\n", Path);
+				return;
+			}
+
+			// perf finds the dump through this (executable) mapping of it
+			long PageSize = sysconf(_SC_PAGESIZE);
+			DumpMarker = mmap(0, PageSize, PROT_READ | PROT_EXEC, MAP_PRIVATE,
+												fileno(Dump), 0);
+			if(DumpMarker == MAP_FAILED) {
+				DumpMarker = 0;
+			}
+
+			JitDumpHeader H;
+			memset(&H, 0, sizeof(H));
+			H.Magic = JitDumpMagic;
+			H.Version = 1;
+			H.TotalSize = sizeof(H);
+			H.ElfMach = EM_X86_64_;
+			H.Pid = getpid();
+			H.Timestamp = MonotonicNanos();
+			fwrite(&H, sizeof(H), 1, Dump);
+			fflush(Dump);
+		}
+	}
+
+	~PerfMapListener() {
+		if(Map) {
+			fclose(Map);
+		}
+		if(DumpMarker) {
+			munmap(DumpMarker, sysconf(_SC_PAGESIZE));
+		}
+		if(Dump) {
+			fclose(Dump);
+		}
+	}
+
+	virtual void NotifyFunctionEmitted(const Function &F, void *Code, size_t Size,
+																		 const EmittedFunctionDetails &Details) {
+		std::string Name = F.getNameStr();
+
+		if(Map) {
+			fprintf(Map, "%lx %lx %s\n", (unsigned long) Code, (unsigned long) Size,
+							Name.c_str());
+			fflush(Map);
+		}
+
+		if(Dump) {
+			JitDumpCodeLoad R;
+			R.Id = JitCodeLoad;
+			R.TotalSize = sizeof(R) + Name.size() + 1 + Size;
+			R.Timestamp = MonotonicNanos();
+			R.Pid = getpid();
+			R.Tid = syscall(SYS_gettid);
+			R.Vma = (uint64_t) (uintptr_t) Code;
+			R.CodeAddr = R.Vma;
+			R.CodeSize = Size;
+			R.CodeIndex = CodeIndex++;
+			fwrite(&R, sizeof(R), 1, Dump);
+			fwrite(Name.c_str(), Name.size() + 1, 1, Dump);
+			fwrite(Code, Size, 1, Dump);
+			fflush(Dump);
+		}
+	}
+};
+
+}
+
+JITEventListener* CreatePerfMapListener(bool WriteMap, bool WriteJitDump) {
+	return new PerfMapListener(WriteMap, WriteJitDump);
+}
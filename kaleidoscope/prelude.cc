@@ -0,0 +1,61 @@
+// Loading a precompiled prelude (EngineOptions::Prelude). The session's
+// module starts out as the prelude's bitcode, so its definitions are
+// there without being parsed, generated or optimized again; the JIT
+// emits each one on its first call, as for any other function. Only the
+// precedences of its binary operators live outside of the module.
+
+#include <llvm/Function.h>
+#include <llvm/LLVMContext.h>
+#include <llvm/Module.h>
+#include <llvm/Bitcode/ReaderWriter.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+#include <stdio.h>
+#include <string>
+#include <map>
+#include <set>
+#include "kaleidoscope.hpp"
+#include "engine.hpp"
+
+extern std::map<char, int> KBinopPrecedence;
+extern Module* TheModule;
+
+// Prelude definitions not replaced by the session yet
+static std::set<std::string> PreludeFunctions;
+
+Module* LoadPrelude(const PreludeImage &P) {
+	MemoryBuffer* Buffer = MemoryBuffer::getMemBuffer(
+		StringRef((const char*) P.Bitcode, P.BitcodeSize), "prelude");
+	std::string Err;
+	Module* M = ParseBitcodeFile(Buffer, getGlobalContext(), &Err);
+	delete Buffer;
+	if(M == 0) {
+		fprintf(stderr, "Could not load the prelude: %s\n", Err.c_str());
+		return 0;
+	}
+
+	for(Module::iterator F = M->begin(), E = M->end(); F != E; ++F) {
+		if(!F->isDeclaration()) {
+			PreludeFunctions.insert(F->getNameStr());
+		}
+	}
+	for(const PreludeOperator* Op = P.Operators; Op->Op; ++Op) {
+		KBinopPrecedence[Op->Op] = Op->Precedence;
+	}
+	return M;
+}
+
+Function* ReplacePreludeFunction(const std::string &Name) {
+	if(!PreludeFunctions.erase(Name)) {
+		return 0;
+	}
+	// '.' can't appear in a kaleidoscope identifier, so this can't clash
+	Function* F = TheModule->getFunction(Name);
+	F->setName(Name + ".prelude");
+	return F;
+}
+
+void RestorePreludeFunction(Function* F, const std::string &Name) {
+	F->setName(Name);
+	PreludeFunctions.insert(Name);
+}
@@ -0,0 +1,138 @@
+// Compiles a prelude (prelude.k) and writes it out as C++ defining
+// StandardPrelude (engine.hpp), to be linked into main:
+//   prelude-gen prelude.k > prelude_data.cc
+// The prelude may only have definitions and externs: top-level
+// expressions would run at build time, and buffers, memo tables and
+// parallel for loops call into the runtime through mappings that only
+// exist in the session that made them.
+#include <llvm/Function.h>
+#include <llvm/GlobalVariable.h>
+#include <llvm/Module.h>
+#include <llvm/Bitcode/ReaderWriter.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <map>
+#include "kaleidoscope.hpp"
+#include "engine.hpp"
+
+extern Module* TheModule;
+extern std::map<char, int> KBinopPrecedence;
+
+static bool ReadFile(const char* Path, std::string &Out) {
+	FILE* F = fopen(Path, "r");
+	if(!F) {
+		return false;
+	}
+	char Buf[4096];
+	size_t N;
+	while((N = fread(Buf, 1, sizeof(Buf), F)) != 0) {
+		Out.append(Buf, N);
+	}
+	fclose(F);
+	return true;
+}
+
+static bool CheckModule() {
+	if(!TheModule->global_empty()) {
+		fprintf(stderr, "prelude: memo defs can't be precompiled\n");
+		return false;
+	}
+	for(Module::iterator F = TheModule->begin(), E = TheModule->end(); F != E; ++F) {
+		std::string Name = F->getNameStr();
+		if(Name.find('.') != std::string::npos && !F->getIntrinsicID()) {
+			fprintf(stderr, "prelude: %s is internal to the session (buffers, parallel for)\n",
+							Name.c_str());
+			return false;
+		}
+	}
+	return true;
+}
+
+static void WriteString(const std::string &S) {
+	putchar('"');
+	for(size_t i = 0; i != S.size(); ++i) {
+		if(S[i] == '\n') {
+			printf("\\n\"\n\t\"");
+		} else if(S[i] == '"' || S[i] == '\\') {
+			printf("\\%c", S[i]);
+		} else {
+			putchar(S[i]);
+		}
+	}
+	putchar('"');
+}
+
+int main(int argc, char** argv) {
+	if(argc != 2) {
+		fprintf(stderr, "usage: prelude-gen prelude.k > prelude_data.cc\n");
+		return 1;
+	}
+	std::string Src;
+	if(!ReadFile(argv[1], Src)) {
+		fprintf(stderr, "prelude: can't read %s\n", argv[1]);
+		return 1;
+	}
+
+	// Only what every session gets: no clones or thunks, whose
+	// originals the session might replace
+	EngineOptions Opts;
+	Opts.SpecializeBudget = 0;
+	Opts.Dedup = false;
+	if(!InitializeEngine(Opts)) {
+		return 1;
+	}
+	// Compiled, not run, so expressions can be told apart from definitions
+	std::map<char, int> Builtin = KBinopPrecedence;
+	std::vector<Function*> Exprs;
+	std::string Errors;
+	bool Ok = CompileSource(Src, Exprs, Errors);
+	fputs(Errors.c_str(), stderr);
+	if(!Exprs.empty()) {
+		fprintf(stderr, "prelude: only definitions and externs, no expressions\n");
+		return 1;
+	}
+	if(!Ok || !CheckModule()) {
+		return 1;
+	}
+
+	std::string Bitcode;
+	{
+		raw_string_ostream OS(Bitcode);
+		WriteBitcodeToFile(TheModule, OS);
+	}
+
+	printf("// Generated by prelude-gen from %s. Do not edit.\n", argv[1]);
+	printf("#include \"engine.hpp\"\n\n");
+
+	// A NUL after the end, not counted in the size: MemoryBuffer wants
+	// one past its end
+	printf("static const unsigned char Bitcode[] __attribute__((aligned(4))) = {");
+	for(size_t i = 0; i != Bitcode.size(); ++i) {
+		printf("%s0x%02x,", i % 12 ? " " : "\n\t", (unsigned char) Bitcode[i]);
+	}
+	printf("\n\t0x00\n};\n\n");
+
+	printf("static const PreludeOperator Operators[] = {\n");
+	for(std::map<char, int>::iterator I = KBinopPrecedence.begin(),
+				E = KBinopPrecedence.end(); I != E; ++I) {
+		// Entries at 0 aren't operators
+		if(!Builtin.count(I->first) && I->second > 0) {
+			printf("\t{ '%s%c', %d },\n", I->first == '\'' || I->first == '\\' ? "\\" : "",
+						 I->first, I->second);
+		}
+	}
+	printf("\t{ 0, 0 }\n};\n\n");
+
+	printf("static const char Source[] =\n\t");
+	WriteString(Src);
+	printf(";\n\n");
+
+	printf("const PreludeImage StandardPrelude = {\n"
+				 "\tBitcode, sizeof(Bitcode) - 1, Operators, Source\n};\n");
+
+	ShutdownEngine();
+	return 0;
+}
@@ -0,0 +1,157 @@
+// Call profiler for "-profile" sessions. Codegen brackets the body of
+// every function with ProfileEnter/ProfileExit; each thread counts into
+// its own table, so there is no contention between threads running
+// JITed code. Times are in cycle counter ticks.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include "kaleidoscope.hpp"
+
+static inline uint64_t ReadCycles() {
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	return StatsNow();
+#endif
+}
+
+namespace {
+
+struct Counters {
+	uint64_t Calls;
+	uint64_t Inclusive;
+	uint64_t Self;
+	// Active calls on this thread; recursive calls add to Inclusive
+	// only at the outermost one
+	unsigned Depth;
+};
+
+struct Frame {
+	unsigned Id;
+	uint64_t Start;
+	uint64_t Children;
+};
+
+struct ProfileThread {
+	std::vector<Counters> Table;
+	std::vector<Frame> Stack;
+};
+
+}
+
+static std::vector<std::string> FunctionNames;
+static std::map<std::string, unsigned> FunctionIds;
+
+// Every thread's table, for the report. Only touched when a thread
+// enters JITed code for the first time.
+static std::vector<ProfileThread*> Threads;
+static pthread_mutex_t ThreadsLock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread ProfileThread* ThisThread = 0;
+
+unsigned GetProfileId(const std::string &Name) {
+	std::map<std::string, unsigned>::iterator I = FunctionIds.find(Name);
+	if(I != FunctionIds.end()) {
+		return I->second;
+	}
+	unsigned Id = FunctionNames.size();
+	FunctionNames.push_back(Name);
+	FunctionIds[Name] = Id;
+	return Id;
+}
+
+static ProfileThread* GetThread() {
+	if(!ThisThread) {
+		ThisThread = new ProfileThread();
+		pthread_mutex_lock(&ThreadsLock);
+		Threads.push_back(ThisThread);
+		pthread_mutex_unlock(&ThreadsLock);
+	}
+	return ThisThread;
+}
+
+extern "C" void ProfileEnter(uint32_t Id) {
+	ProfileThread* T = GetThread();
+	if(Id >= T->Table.size()) {
+		Counters Zero = { 0, 0, 0, 0 };
+		T->Table.resize(Id + 1, Zero);
+	}
+	++T->Table[Id].Calls;
+	++T->Table[Id].Depth;
+
+	Frame F = { Id, ReadCycles(), 0 };
+	T->Stack.push_back(F);
+}
+
+extern "C" void ProfileExit(uint32_t Id) {
+	uint64_t Now = ReadCycles();
+	ProfileThread* T = ThisThread;
+	Frame F = T->Stack.back();
+	T->Stack.pop_back();
+
+	uint64_t Elapsed = Now - F.Start;
+	Counters &C = T->Table[Id];
+	C.Self += Elapsed - F.Children;
+	if(--C.Depth == 0) {
+		C.Inclusive += Elapsed;
+	}
+	if(!T->Stack.empty()) {
+		T->Stack.back().Children += Elapsed;
+	}
+}
+
+namespace {
+
+struct ReportLine {
+	unsigned Id;
+	Counters Total;
+};
+
+bool BySelfTime(const ReportLine &A, const ReportLine &B) {
+	return A.Total.Self > B.Total.Self;
+}
+
+}
+
+void PrintProfileReport() {
+	std::vector<ReportLine> Lines(FunctionNames.size());
+	uint64_t TotalSelf = 0;
+	for(unsigned i = 0; i != Lines.size(); ++i) {
+		Lines[i].Id = i;
+		Counters Zero = { 0, 0, 0, 0 };
+		Lines[i].Total = Zero;
+	}
+
+	pthread_mutex_lock(&ThreadsLock);
+	for(unsigned t = 0; t != Threads.size(); ++t) {
+		std::vector<Counters> &Table = Threads[t]->Table;
+		for(unsigned i = 0; i != Table.size() && i != Lines.size(); ++i) {
+			Lines[i].Total.Calls += Table[i].Calls;
+			Lines[i].Total.Inclusive += Table[i].Inclusive;
+			Lines[i].Total.Self += Table[i].Self;
+			TotalSelf += Table[i].Self;
+		}
+	}
+	pthread_mutex_unlock(&ThreadsLock);
+
+	std::sort(Lines.begin(), Lines.end(), BySelfTime);
+
+	fprintf(stderr, "%-24s %12s %16s %7s %16s\n", "function", "calls",
+					"self cycles", "self%", "incl cycles");
+	for(unsigned i = 0; i != Lines.size(); ++i) {
+		const Counters &C = Lines[i].Total;
+		if(C.Calls == 0) {
+			continue;
+		}
+		fprintf(stderr, "%-24s %12llu %16llu %6.2f%% %16llu\n",
+						FunctionNames[Lines[i].Id].c_str(), (unsigned long long) C.Calls,
+						(unsigned long long) C.Self,
+						TotalSelf ? 100.0 * C.Self / TotalSelf : 0.0,
+						(unsigned long long) C.Inclusive);
+	}
+}
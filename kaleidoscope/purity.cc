@@ -0,0 +1,209 @@
+// Purity inference over the call graph of the definitions. Every
+// definition's callees come from its AST. A function is assumed pure
+// (nounwind) until one of its callees turns out not to be, which settles
+// recursive functions too; a function with buffer arguments is impure
+// by itself. Only a new definition and its callers up the graph can
+// change, so only those are looked at again.
+
+#include <llvm/Function.h>
+#include <llvm/Module.h>
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
+#include "kaleidoscope.hpp"
+#include "engine.hpp"
+
+extern Module* TheModule;
+extern EngineOptions TheOptions;
+
+namespace {
+
+struct PurityInfo {
+	std::vector<std::string> Callees;
+	bool Pure;
+	bool NoUnwind;
+	// Why it's impure (may unwind), for the report
+	std::string ImpureReason;
+	std::string UnwindReason;
+	// Set when the function itself reads or writes memory (a buffer)
+	std::string LocalImpurity;
+};
+
+}
+
+static std::map<std::string, PurityInfo> Functions;
+static std::map<std::string, std::set<std::string> > Callers;
+
+// The record the last InferPurity replaced, for ForgetPurity
+static std::string LastName;
+static bool LastHadInfo = false;
+static PurityInfo LastInfo;
+
+// For a callee that isn't a definition of the session: what its
+// declaration says, or for one of the prelude's, what inference found
+// when the prelude was built. No function at all means a builtin (len,
+// vec4, hsum, ...), which is pure; buffer reads count against the
+// function with the buffer.
+static bool ExternIsPure(const std::string &Name) {
+	Function* F = TheModule->getFunction(Name);
+	return !F || F->doesNotAccessMemory() || IsMathFunction(F);
+}
+
+static bool ExternIsNoUnwind(const std::string &Name) {
+	Function* F = TheModule->getFunction(Name);
+	return !F || F->doesNotThrow() || IsMathFunction(F);
+}
+
+// Optimistic fixed point for one property over the functions in Set
+// Local, if given, is what the function itself does against it
+static void Solve(const std::set<std::string> &Set, bool PurityInfo::*Has,
+									std::string PurityInfo::*Blame, std::string PurityInfo::*Local,
+									bool (*ExternHas)(const std::string&)) {
+	for(std::set<std::string>::const_iterator I = Set.begin(), E = Set.end(); I != E; ++I) {
+		PurityInfo &Info = Functions[*I];
+		Info.*Blame = Local ? Info.*Local : "";
+		Info.*Has = (Info.*Blame).empty();
+	}
+
+	bool Changed = true;
+	while(Changed) {
+		Changed = false;
+		for(std::set<std::string>::const_iterator I = Set.begin(), E = Set.end();
+				I != E; ++I) {
+			PurityInfo &Info = Functions[*I];
+			if(!(Info.*Has)) {
+				continue;
+			}
+			for(unsigned i = 0, e = Info.Callees.size(); i != e; ++i) {
+				std::map<std::string, PurityInfo>::iterator C = Functions.find(Info.Callees[i]);
+				bool CalleeHas = C != Functions.end() ? C->second.*Has
+					: ExternHas(Info.Callees[i]);
+				if(!CalleeHas) {
+					Info.*Has = false;
+					Info.*Blame = "calls " + Info.Callees[i];
+					Changed = true;
+					break;
+				}
+			}
+		}
+	}
+}
+
+// Solves the functions that call Name, directly or not, and Name itself
+// if it has a record: those called it while it was only declared, or an
+// older body of it
+static void Update(const std::string &Name) {
+	std::set<std::string> Set;
+	std::vector<std::string> Work;
+	if(Functions.count(Name)) {
+		Work.push_back(Name);
+	} else {
+		Set.insert(Name);
+		const std::set<std::string> &NameCallers = Callers[Name];
+		Work.insert(Work.end(), NameCallers.begin(), NameCallers.end());
+	}
+	while(!Work.empty()) {
+		std::string F = Work.back();
+		Work.pop_back();
+		if(!Set.insert(F).second) {
+			continue;
+		}
+		const std::set<std::string> &FCallers = Callers[F];
+		Work.insert(Work.end(), FCallers.begin(), FCallers.end());
+	}
+	if(!Functions.count(Name)) {
+		Set.erase(Name);
+	}
+
+	Solve(Set, &PurityInfo::Pure, &PurityInfo::ImpureReason, &PurityInfo::LocalImpurity,
+				ExternIsPure);
+	Solve(Set, &PurityInfo::NoUnwind, &PurityInfo::UnwindReason, 0, ExternIsNoUnwind);
+
+	// Calls through a hot reload slot don't look at the callee's
+	// attributes, and a later body might not deserve them anyway
+	if(TheOptions.HotReload) {
+		return;
+	}
+	for(std::set<std::string>::iterator I = Set.begin(), E = Set.end(); I != E; ++I) {
+		const PurityInfo &Info = Functions[*I];
+		Function* F = TheModule->getFunction(*I);
+		// Profiled functions call the profiler after all
+		if(Info.Pure && !TheOptions.Profile) {
+			F->setDoesNotAccessMemory();
+		}
+		if(Info.NoUnwind) {
+			F->setDoesNotThrow();
+		}
+	}
+}
+
+void InferPurity(const std::string &Name, const std::vector<std::string> &Callees) {
+	std::map<std::string, PurityInfo>::iterator Old = Functions.find(Name);
+	LastName = Name;
+	LastHadInfo = Old != Functions.end();
+	LastInfo = LastHadInfo ? Old->second : PurityInfo();
+
+	Functions[Name].Callees = Callees;
+	Functions[Name].LocalImpurity.clear();
+	Function* Def = TheModule->getFunction(Name);
+	for(Function::arg_iterator AI = Def->arg_begin(), E = Def->arg_end(); AI != E; ++AI) {
+		if(AI->getType()->isPointerTy()) {
+			Functions[Name].LocalImpurity = "buffer arguments";
+		}
+	}
+	for(unsigned i = 0, e = Callees.size(); i != e; ++i) {
+		Callers[Callees[i]].insert(Name);
+	}
+	Update(Name);
+}
+
+void ForgetPurity(const std::string &Name) {
+	if(Name != LastName) {
+		return;
+	}
+	LastName.clear();
+
+	// Calls only the rejected body made
+	const std::vector<std::string> &Callees = Functions[Name].Callees;
+	for(unsigned i = 0, e = Callees.size(); i != e; ++i) {
+		if(std::find(LastInfo.Callees.begin(), LastInfo.Callees.end(), Callees[i]) ==
+			 LastInfo.Callees.end()) {
+			Callers[Callees[i]].erase(Name);
+		}
+	}
+	if(LastHadInfo) {
+		Functions[Name] = LastInfo;
+	} else {
+		Functions.erase(Name);
+	}
+	Update(Name);
+}
+
+bool IsPure(const std::string &Name, std::string &Reason) {
+	std::map<std::string, PurityInfo>::iterator I = Functions.find(Name);
+	if(I == Functions.end()) {
+		Reason = "not defined";
+		return false;
+	}
+	Reason = I->second.ImpureReason;
+	return I->second.Pure;
+}
+
+void PrintPurityReport() {
+	unsigned NumPure = 0;
+	fprintf(stderr, "%-24s %-8s %s\n", "function", "pure", "nounwind");
+	for(std::map<std::string, PurityInfo>::iterator I = Functions.begin(),
+				E = Functions.end(); I != E; ++I) {
+		const PurityInfo &Info = I->second;
+		std::string Pure = Info.Pure ? "yes" : "no (" + Info.ImpureReason + ")";
+		std::string NoUnwind = Info.NoUnwind ? "yes" : "no (" + Info.UnwindReason + ")";
+		fprintf(stderr, "%-24s %-8s %s\n", I->first.c_str(), Pure.c_str(),
+						NoUnwind.c_str());
+		NumPure += Info.Pure;
+	}
+	fprintf(stderr, "%u of %u functions pure\n", NumPure, (unsigned) Functions.size());
+}
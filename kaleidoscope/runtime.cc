@@ -0,0 +1,153 @@
+// Runtime library for kaleidoscope code. Registered as host functions
+// by InitializeEngine, so externs to it are bound without symbol lookup.
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "engine.hpp"
+
+// Each thread writes into its own buffer, so printing a value takes
+// neither the stdio lock nor a pass through the printf format parser
+static const unsigned OutBufSize = 64 * 1024;
+static __thread char OutBuf[OutBufSize];
+static __thread unsigned OutLen = 0;
+// -1 for stdout
+static __thread int OutFd = -1;
+
+static bool BinaryOutput = false;
+
+void FlushOutput() {
+	if(OutLen == 0) {
+		return;
+	}
+	if(OutFd >= 0) {
+		for(unsigned Done = 0; Done < OutLen; ) {
+			ssize_t N = write(OutFd, OutBuf + Done, OutLen - Done);
+			if(N <= 0) {
+				// The reader went away: drop the rest
+				break;
+			}
+			Done += N;
+		}
+	} else {
+		fwrite(OutBuf, 1, OutLen, stdout);
+		fflush(stdout);
+	}
+	OutLen = 0;
+}
+
+void SetOutputDescriptor(int Fd) {
+	FlushOutput();
+	OutFd = Fd;
+}
+
+int GetOutputDescriptor() {
+	return OutFd;
+}
+
+void SetBinaryOutput(bool Enable) {
+	BinaryOutput = Enable;
+}
+
+static char* Reserve(unsigned Size) {
+	if(OutLen + Size > OutBufSize) {
+		FlushOutput();
+	}
+	return OutBuf + OutLen;
+}
+
+// Same text as printf("%f", X), for the common case of finite values
+// below 2^53. Returns the number of chars written, 0 if X is not
+// handled here.
+static unsigned FormatFixed6(double X, char* Buf) {
+	double A = fabs(X);
+	if(!(A < 9007199254740992.0)) { // also rejects nan
+		return 0;
+	}
+
+	// Integer part and fraction are both exact
+	uint64_t IntPart = (uint64_t) A;
+	double Frac = A - (double) IntPart;
+
+	// Round Frac * 10^6 to nearest, ties to even, the way printf does it
+	// with the exact decimal value. The product can only land on the
+	// wrong side of a tie when it rounds to exactly k + 0.5; the fma
+	// gives the rounding error to break it.
+	double P = Frac * 1e6;
+	double R = nearbyint(P);
+	if(fabs(P - R) == 0.5) {
+		double Err = fma(Frac, 1e6, -P);
+		if(Err > 0) {
+			R = floor(P) + 1;
+		} else if(Err < 0) {
+			R = floor(P);
+		}
+	}
+	uint64_t FracDigits = (uint64_t) R;
+	if(FracDigits == 1000000) {
+		FracDigits = 0;
+		++IntPart;
+	}
+
+	char Tmp[32];
+	unsigned N = 0;
+	for(unsigned i = 0; i < 6; ++i) {
+		Tmp[N++] = '0' + FracDigits % 10;
+		FracDigits /= 10;
+	}
+	Tmp[N++] = '.';
+	do {
+		Tmp[N++] = '0' + IntPart % 10;
+		IntPart /= 10;
+	} while(IntPart);
+	if(signbit(X)) {
+		Tmp[N++] = '-';
+	}
+
+	for(unsigned i = 0; i < N; ++i) {
+		Buf[i] = Tmp[N - 1 - i];
+	}
+	return N;
+}
+
+extern "C" double printd(double x) {
+	if(BinaryOutput) {
+		memcpy(Reserve(sizeof(x)), &x, sizeof(x));
+		OutLen += sizeof(x);
+		return 0.0;
+	}
+
+	// %f of DBL_MAX is 316 chars
+	char* Buf = Reserve(320);
+	unsigned N = FormatFixed6(x, Buf);
+	if(N == 0) {
+		N = snprintf(Buf, 320, "%f", x);
+	}
+	OutLen += N;
+	return 0.0;
+}
+
+extern "C" double putchard(double X) {
+	*Reserve(1) = (char) X;
+	++OutLen;
+	return 0.0;
+}
+
+// Out of line path of a checked buffer access. The access is skipped.
+// The message goes where the thread's output goes if that is a file
+// descriptor (a daemon client), else to stderr.
+extern "C" void BufferBoundsError(double Index, uint64_t Length) {
+	char Msg[128];
+	int N = snprintf(Msg, sizeof(Msg), "Error: buffer index %g out of bounds (length %llu)\n",
+									 Index, (unsigned long long) Length);
+	if(OutFd >= 0) {
+		memcpy(Reserve(N), Msg, N);
+		OutLen += N;
+		FlushOutput();
+	} else {
+		FlushOutput();
+		fputs(Msg, stderr);
+	}
+}
@@ -0,0 +1,236 @@
+// Call-site specialization. Once a function is optimized, a direct call
+// in it to a user function with some constant arguments can go to a
+// clone of the callee with those arguments replaced by the constants,
+// optimized on its own, so branches and arithmetic on them fold away.
+// Small callees are specialized anywhere, bigger ones only for calls in
+// a loop. Clones are kept by callee and constants, so every call with
+// the same ones shares a clone, and their size all together is bounded
+// by EngineOptions::SpecializeBudget.
+
+#include <llvm/Constants.h>
+#include <llvm/DerivedTypes.h>
+#include <llvm/Function.h>
+#include <llvm/Instructions.h>
+#include <llvm/Module.h>
+#include <llvm/PassManager.h>
+#include <llvm/Support/CFG.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include "kaleidoscope.hpp"
+#include "engine.hpp"
+
+extern Module* TheModule;
+extern FunctionPassManager* TheFPM;
+extern EngineOptions TheOptions;
+
+// Callee size, in IR instructions, up to which calls are specialized
+static const unsigned SmallCallee = 40;
+static const unsigned HotCallee = 400;
+
+namespace {
+
+// Argument index and bits of each constant argument
+typedef std::vector<std::pair<unsigned, uint64_t> > ConstantArgs;
+// By the callee itself, not its name: a prelude function replaced by a
+// definition of the same name keeps its body (and clones) under another
+// name, and bodies of user functions are never freed
+typedef std::pair<Function*, ConstantArgs> SpecKey;
+
+struct Specialization {
+	Function* Clone;
+	// Readable form of the call, e.g. score(_, 3, 0.5)
+	std::string Call;
+	unsigned CalleeInstructions, Instructions;
+	unsigned CallSites;
+};
+
+}
+
+static std::map<SpecKey, Specialization> Specializations;
+static unsigned BudgetUsed = 0;
+
+static unsigned CountInstructions(const Function* F) {
+	unsigned N = 0;
+	for(Function::const_iterator BB = F->begin(), E = F->end(); BB != E; ++BB) {
+		N += BB->size();
+	}
+	return N;
+}
+
+// Whether BB is on a cycle of the CFG
+static bool InLoop(BasicBlock* BB) {
+	std::set<BasicBlock*> Seen;
+	std::vector<BasicBlock*> Work(succ_begin(BB), succ_end(BB));
+	while(!Work.empty()) {
+		BasicBlock* B = Work.back();
+		Work.pop_back();
+		if(B == BB) {
+			return true;
+		}
+		if(Seen.insert(B).second) {
+			Work.insert(Work.end(), succ_begin(B), succ_end(B));
+		}
+	}
+	return false;
+}
+
+static bool GetConstantBits(Value* V, uint64_t &Bits) {
+	if(ConstantFP* C = dyn_cast<ConstantFP>(V)) {
+		if(!C->getType()->isDoubleTy()) return false;
+		Bits = C->getValueAPF().bitcastToAPInt().getZExtValue();
+		return true;
+	}
+	if(ConstantInt* C = dyn_cast<ConstantInt>(V)) {
+		Bits = C->getZExtValue();
+		return true;
+	}
+	return false;
+}
+
+static std::string DescribeCall(Function* Callee, CallInst* CI) {
+	std::string S = Callee->getNameStr() + "(";
+	for(unsigned i = 0, e = CI->getNumArgOperands(); i != e; ++i) {
+		if(i != 0) S += ", ";
+		char Buf[32];
+		Value* V = CI->getArgOperand(i);
+		if(ConstantFP* C = dyn_cast<ConstantFP>(V)) {
+			snprintf(Buf, sizeof(Buf), "%g", C->getValueAPF().convertToDouble());
+			S += Buf;
+		} else if(ConstantInt* C = dyn_cast<ConstantInt>(V)) {
+			snprintf(Buf, sizeof(Buf), "%lld", (long long) C->getSExtValue());
+			S += Buf;
+		} else {
+			S += "_";
+		}
+	}
+	return S + ")";
+}
+
+// The clone of Callee for the constant arguments of CI, 0 if it isn't
+// worth one or the budget is spent
+static Function* GetSpecialization(Function* Callee, CallInst* CI) {
+	SpecKey Key(Callee, ConstantArgs());
+	unsigned i = 0;
+	for(Function::arg_iterator AI = Callee->arg_begin(), E = Callee->arg_end(); AI != E;
+			++AI, ++i) {
+		uint64_t Bits;
+		if(GetConstantBits(CI->getArgOperand(i), Bits)) {
+			Key.second.push_back(std::make_pair(i, Bits));
+		}
+	}
+	if(Key.second.empty()) {
+		return 0;
+	}
+
+	std::map<SpecKey, Specialization>::iterator I = Specializations.find(Key);
+	if(I != Specializations.end()) {
+		++I->second.CallSites;
+		return I->second.Clone;
+	}
+
+	unsigned Size = CountInstructions(Callee);
+	if(Size > (InLoop(CI->getParent()) ? HotCallee : SmallCallee) ||
+		 BudgetUsed + Size > TheOptions.SpecializeBudget) {
+		return 0;
+	}
+
+	ValueToValueMapTy VMap;
+	i = 0;
+	for(Function::arg_iterator AI = Callee->arg_begin(), E = Callee->arg_end(); AI != E;
+			++AI, ++i) {
+		uint64_t Bits;
+		if(GetConstantBits(CI->getArgOperand(i), Bits)) {
+			VMap[AI] = CI->getArgOperand(i);
+		}
+	}
+	// Mapped arguments are left out of the clone's prototype
+	Function* Clone = CloneFunction(Callee, VMap, false);
+	// '.' can't appear in a kaleidoscope identifier, so this can't clash
+	Clone->setName(Callee->getNameStr() + ".spec");
+	TheModule->getFunctionList().push_back(Clone);
+	if(Callee->doesNotAccessMemory()) Clone->setDoesNotAccessMemory();
+	if(Callee->doesNotThrow()) Clone->setDoesNotThrow();
+
+	RecordFunctionIR(Clone, 0, false);
+	TheFPM->run(*Clone);
+	RecordFunctionIR(Clone, 0, true);
+
+	Specialization &S = Specializations[Key];
+	S.Clone = Clone;
+	S.Call = DescribeCall(Callee, CI);
+	S.CalleeInstructions = Size;
+	S.Instructions = CountInstructions(Clone);
+	S.CallSites = 1;
+	BudgetUsed += S.Instructions;
+
+	if(TheOptions.Verbosity >= 1) {
+		fprintf(stderr, "Specialized %s as %s\n", S.Call.c_str(), Clone->getNameStr().c_str());
+	}
+	return Clone;
+}
+
+void SpecializeCalls(Function* F) {
+	// Internal functions (top-level expressions) run once, and may be
+	// freed after that; a clone made for them would outlive them unused
+	if(TheOptions.SpecializeBudget == 0 || F->getNameStr().find('.') != std::string::npos) {
+		return;
+	}
+
+	std::vector<CallInst*> Calls;
+	for(Function::iterator BB = F->begin(), E = F->end(); BB != E; ++BB) {
+		for(BasicBlock::iterator II = BB->begin(), IE = BB->end(); II != IE; ++II) {
+			CallInst* CI = dyn_cast<CallInst>(II);
+			// Calls through a hot reload slot aren't direct, so never
+			// specialized: a clone would keep the old body
+			Function* Callee = CI ? CI->getCalledFunction() : 0;
+			// Only user functions: not externs, nor internal ones (map
+			// kernels, parallel for bodies, clones)
+			if(Callee && !Callee->isDeclaration() && Callee != F &&
+				 Callee->getNameStr().find('.') == std::string::npos) {
+				Calls.push_back(CI);
+			}
+		}
+	}
+
+	for(unsigned c = 0, e = Calls.size(); c != e; ++c) {
+		CallInst* CI = Calls[c];
+		Function* Callee = CI->getCalledFunction();
+		Function* Clone = GetSpecialization(Callee, CI);
+		if(Clone == 0) {
+			continue;
+		}
+
+		std::vector<Value*> Args;
+		for(unsigned i = 0, e = CI->getNumArgOperands(); i != e; ++i) {
+			uint64_t Bits;
+			if(!GetConstantBits(CI->getArgOperand(i), Bits)) {
+				Args.push_back(CI->getArgOperand(i));
+			}
+		}
+		CallInst* New = CallInst::Create(Clone, Args.begin(), Args.end(), "", CI);
+		if(CI->doesNotAccessMemory()) New->setDoesNotAccessMemory();
+		if(CI->doesNotThrow()) New->setDoesNotThrow();
+		New->takeName(CI);
+		CI->replaceAllUsesWith(New);
+		CI->eraseFromParent();
+	}
+}
+
+void PrintSpecializationReport() {
+	fprintf(stderr, "%-32s %-20s %8s %8s %6s\n", "call", "clone", "callee", "clone",
+					"sites");
+	for(std::map<SpecKey, Specialization>::iterator I = Specializations.begin(),
+				E = Specializations.end(); I != E; ++I) {
+		const Specialization &S = I->second;
+		fprintf(stderr, "%-32s %-20s %8u %8u %6u\n", S.Call.c_str(),
+						S.Clone->getNameStr().c_str(), S.CalleeInstructions, S.Instructions,
+						S.CallSites);
+	}
+	fprintf(stderr, "%u specializations, %u of %u instructions of budget used\n",
+					(unsigned) Specializations.size(), BudgetUsed, TheOptions.SpecializeBudget);
+}
@@ -0,0 +1,163 @@
+// Time spent in each compile/run phase, per top-level item and per session.
+// Phases nest (lexing happens inside parsing, the FPM inside codegen), and
+// a phase's time excludes the phases nested in it.
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+#include "kaleidoscope.hpp"
+
+bool StatsEnabled = false;
+
+static const char* PhaseNames[NumPhases] = {
+	"lex", "parse", "irgen", "verify", "optimize", "emit", "exec"
+};
+
+struct StatsItem {
+	std::string Kind;
+	std::string Name;
+	uint64_t Nanos[NumPhases];
+	unsigned FPMRuns;
+};
+
+static std::vector<Phase> PhaseStack;
+static uint64_t PhaseStart;
+// Item being compiled
+static uint64_t Current[NumPhases];
+static unsigned CurrentFPMRuns;
+
+static std::vector<StatsItem> Items;
+
+uint64_t StatsNow() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void StatsPushPhase(Phase P) {
+	uint64_t T = StatsNow();
+	if(!PhaseStack.empty()) {
+		Current[PhaseStack.back()] += T - PhaseStart;
+	}
+	PhaseStack.push_back(P);
+	PhaseStart = T;
+
+	if(P == PH_Optimize) {
+		++CurrentFPMRuns;
+	}
+}
+
+void StatsPopPhase() {
+	uint64_t T = StatsNow();
+	Current[PhaseStack.back()] += T - PhaseStart;
+	PhaseStack.pop_back();
+	PhaseStart = T;
+}
+
+void StatsEndItem(const char* Kind, const std::string &Name) {
+	if(!StatsEnabled) {
+		return;
+	}
+
+	StatsItem I;
+	I.Kind = Kind;
+	I.Name = Name;
+	memcpy(I.Nanos, Current, sizeof(Current));
+	I.FPMRuns = CurrentFPMRuns;
+	Items.push_back(I);
+
+	memset(Current, 0, sizeof(Current));
+	CurrentFPMRuns = 0;
+}
+
+// Session totals; includes what happened outside of any item
+static StatsItem Totals() {
+	StatsItem T;
+	T.Kind = "total";
+	memcpy(T.Nanos, Current, sizeof(Current));
+	T.FPMRuns = CurrentFPMRuns;
+	for(unsigned i = 0; i != Items.size(); ++i) {
+		for(unsigned p = 0; p != NumPhases; ++p) {
+			T.Nanos[p] += Items[i].Nanos[p];
+		}
+		T.FPMRuns += Items[i].FPMRuns;
+	}
+	return T;
+}
+
+static void WriteJSONString(FILE* Out, const std::string &S) {
+	fputc('"', Out);
+	for(unsigned i = 0; i != S.size(); ++i) {
+		unsigned char C = S[i];
+		if(C == '"' || C == '\\') {
+			fprintf(Out, "\\%c", C);
+		} else if(C < 0x20 || C >= 0x7f) {
+			fprintf(Out, "\\u%04x", C);
+		} else {
+			fputc(C, Out);
+		}
+	}
+	fputc('"', Out);
+}
+
+static void WriteJSONItem(FILE* Out, const StatsItem &I) {
+	fprintf(Out, "{\"kind\": ");
+	WriteJSONString(Out, I.Kind);
+	fprintf(Out, ", \"name\": ");
+	WriteJSONString(Out, I.Name);
+	for(unsigned p = 0; p != NumPhases; ++p) {
+		fprintf(Out, ", \"%s_ns\": %llu", PhaseNames[p],
+						(unsigned long long) I.Nanos[p]);
+	}
+	fprintf(Out, ", \"fpm_runs\": %u}", I.FPMRuns);
+}
+
+static void WriteCSVItem(FILE* Out, const StatsItem &I) {
+	fprintf(Out, "%s,\"", I.Kind.c_str());
+	for(unsigned i = 0; i != I.Name.size(); ++i) {
+		if(I.Name[i] == '"') {
+			fputc('"', Out);
+		}
+		fputc(I.Name[i], Out);
+	}
+	fputc('"', Out);
+	for(unsigned p = 0; p != NumPhases; ++p) {
+		fprintf(Out, ",%llu", (unsigned long long) I.Nanos[p]);
+	}
+	fprintf(Out, ",%u\n", I.FPMRuns);
+}
+
+bool WriteStatsReport(const std::string &Path) {
+	FILE* Out = fopen(Path.c_str(), "w");
+	if(!Out) {
+		fprintf(stderr, "Could not write %s\n", Path.c_str());
+		return false;
+	}
+
+	bool JSON = Path.size() >= 5 && Path.compare(Path.size() - 5, 5, ".json") == 0;
+	if(JSON) {
+		fprintf(Out, "{\"items\": [\n");
+		for(unsigned i = 0; i != Items.size(); ++i) {
+			fprintf(Out, "  ");
+			WriteJSONItem(Out, Items[i]);
+			fprintf(Out, i + 1 != Items.size() ? ",\n" : "\n");
+		}
+		fprintf(Out, "],\n\"total\": ");
+		WriteJSONItem(Out, Totals());
+		fprintf(Out, "}\n");
+	} else {
+		fprintf(Out, "kind,name");
+		for(unsigned p = 0; p != NumPhases; ++p) {
+			fprintf(Out, ",%s_ns", PhaseNames[p]);
+		}
+		fprintf(Out, ",fpm_runs\n");
+		for(unsigned i = 0; i != Items.size(); ++i) {
+			WriteCSVItem(Out, Items[i]);
+		}
+		WriteCSVItem(Out, Totals());
+	}
+
+	fclose(Out);
+	return true;
+}